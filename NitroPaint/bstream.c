@@ -67,6 +67,10 @@ int bstreamSeek(BSTREAM *stream, int pos, int relative) {
 }
 
 int bstreamCompress(BSTREAM *stream, int algorithm, int start, int size) {
+	return bstreamCompressEx(stream, algorithm, start, size, NULL);
+}
+
+int bstreamCompressEx(BSTREAM *stream, int algorithm, int start, int size, int *algorithmUsed) {
 	//checks
 	if (size == 0) {
 		size = stream->size - start;
@@ -79,7 +83,12 @@ int bstreamCompress(BSTREAM *stream, int algorithm, int start, int size) {
 	//compress section
 	char *compressed = NULL;
 	int compressedSize = size;
-	compressed = compress(src, size, algorithm, &compressedSize);
+	if (algorithm == COMPRESSION_AUTO) {
+		compressed = compressAuto(src, size, &compressedSize, &algorithm);
+	} else {
+		compressed = compress(src, size, algorithm, &compressedSize);
+	}
+	if (algorithmUsed != NULL) *algorithmUsed = algorithm;
 
 	//insert section
 	int beforeCompressed = start;
@@ -17,3 +17,5 @@ void bstreamWrite(BSTREAM *stream, void *data, int size);
 int bstreamSeek(BSTREAM *stream, int pos, int relative);
 
 int bstreamCompress(BSTREAM *stream, int algorithm, int start, int size);
+
+int bstreamCompressEx(BSTREAM *stream, int algorithm, int start, int size, int *algorithmUsed);
@@ -4,6 +4,7 @@
 
 #include "compression.h"
 #include "bstream.h"
+#include "parallel.h"
 
 char *lz77decompress(char *buffer, int size, unsigned int *uncompressedSize){
 	//decompress the input buffer. 
@@ -21,7 +22,7 @@ char *lz77decompress(char *buffer, int size, unsigned int *uncompressedSize){
 	//initialize variables
 	uint32_t offset = 4;
 	uint32_t dstOffset = 0;
-	while (1) {
+	while (dstOffset < length) {
 		uint8_t head = buffer[offset];
 		offset++;
 		//loop 8 times
@@ -71,7 +72,7 @@ char *lz11decompress(char *buffer, int size, int *uncompressedSize) {
 	//initialize variables
 	uint32_t offset = 4;
 	uint32_t dstOffset = 0;
-	while (1) {
+	while (dstOffset < length) {
 		uint8_t head = buffer[offset];
 		offset++;
 
@@ -121,75 +122,262 @@ char *lz11decompress(char *buffer, int size, int *uncompressedSize) {
 	return result;
 }
 
+#define HUFFMAN_LOOKUP_BITS 10
+
+//
+// Entry of the Huffman decoding table, indexed by the next HUFFMAN_LOOKUP_BITS
+// bits of the stream. If the code is no longer than the table index, the entry
+// holds the decoded symbol. Otherwise it holds the tree offset reached after
+// HUFFMAN_LOOKUP_BITS bits, and decoding continues one bit at a time.
+//
+typedef struct HUFFMAN_LOOKUP_ {
+	uint16_t value;    //symbol, or tree offset to continue from
+	uint8_t nBits;     //number of bits consumed by this entry
+	uint8_t isLeaf;    //value is a symbol
+} HUFFMAN_LOOKUP;
+
+//
+// Step once through the tree. Returns the new tree offset, or -1 if the tree
+// refers outside of itself.
+//
+static __inline int huffmanTreeStep(unsigned char *treeBase, int treeSize, int trOffs, int lr, int *isLeaf) {
+	unsigned char thisNode = treeBase[trOffs];
+	int thisNodeOffs = ((thisNode & 0x3F) + 1) << 1; //add to current offset rounded down to get next element offset
+
+	trOffs = (trOffs & ~1) + thisNodeOffs + lr;
+	if (trOffs >= treeSize) return -1;
+	*isLeaf = (thisNode & (0x80 >> lr)) != 0;
+	return trOffs;
+}
+
+static int huffmanBuildLookup(unsigned char *treeBase, int treeSize, HUFFMAN_LOOKUP *table) {
+	for (int i = 0; i < (1 << HUFFMAN_LOOKUP_BITS); i++) {
+		int trOffs = 1, isLeaf = 0, nBits = 0;
+		while (!isLeaf && nBits < HUFFMAN_LOOKUP_BITS) {
+			int lr = (i >> (HUFFMAN_LOOKUP_BITS - 1 - nBits)) & 1;
+			trOffs = huffmanTreeStep(treeBase, treeSize, trOffs, lr, &isLeaf);
+			if (trOffs == -1) return 0;
+			nBits++;
+		}
+
+		table[i].value = isLeaf ? treeBase[trOffs] : trOffs;
+		table[i].nBits = nBits;
+		table[i].isLeaf = isLeaf;
+	}
+	return 1;
+}
+
 char *huffmanDecompress(unsigned char *buffer, int size, int *uncompressedSize) {
 	if (size < 5) return NULL;
 
 	int outSize = (*(uint32_t *) buffer) >> 8;
+	unsigned char *treeBase = buffer + 4;
+	int symSize = *buffer & 0xF;
+	int treeSize = (*treeBase + 1) << 1;
+	if (symSize != 4 && symSize != 8) return NULL;
+	if (treeSize + 4 > size) return NULL;
+
+	HUFFMAN_LOOKUP table[1 << HUFFMAN_LOOKUP_BITS];
+	if (!huffmanBuildLookup(treeBase, treeSize, table)) return NULL;
+
 	char *out = (char *) malloc((outSize + 3) & ~3);
 	*uncompressedSize = outSize;
 
-	unsigned char *treeBase = buffer + 4;
-	int symSize = *buffer & 0xF;
 	int bufferFill = 0;
 	int bufferSize = 32 / symSize;
 	uint32_t outBuffer = 0;
 
-	int offs = ((*treeBase + 1) << 1) + 4;
-	int trOffs = 1;
+	//bits are consumed from the top of a 64-bit accumulator, refilled a word at a time.
+	int offs = treeSize + 4;
+	uint64_t bits = 0;
+	int nBitsAvailable = 0;
 
 	int nWritten = 0;
 	while (nWritten < outSize) {
+		if (nBitsAvailable < HUFFMAN_LOOKUP_BITS) {
+			uint32_t word = 0;
+			if (offs + 4 <= size) word = *(uint32_t *) (buffer + offs);
+			offs += 4;
+			bits |= ((uint64_t) word) << (32 - nBitsAvailable);
+			nBitsAvailable += 32;
+		}
 
-		uint32_t bits = *(uint32_t *) (buffer + offs);
-		offs += 4;
-
-		for (int i = 0; i < 32; i++) {
-			int lr = (bits >> 31) & 1;
-			unsigned char thisNode = treeBase[trOffs];
-			int thisNodeOffs = ((thisNode & 0x3F) + 1) << 1; //add to current offset rounded down to get next element offset
-
-			trOffs = (trOffs & ~1) + thisNodeOffs + lr;
-
-			if (thisNode & (0x80 >> lr)) { //reached a leaf node!
-				outBuffer >>= symSize;
-				outBuffer |= treeBase[trOffs] << (32 - symSize);
-				trOffs = 1;
-				bufferFill++;
+		HUFFMAN_LOOKUP *entry = &table[bits >> (64 - HUFFMAN_LOOKUP_BITS)];
+		bits <<= entry->nBits;
+		nBitsAvailable -= entry->nBits;
+
+		int sym = entry->value;
+		if (!entry->isLeaf) {
+			//long code, finish walking the tree bit by bit
+			int trOffs = entry->value, isLeaf = 0;
+			while (!isLeaf) {
+				if (nBitsAvailable == 0) {
+					uint32_t word = 0;
+					if (offs + 4 <= size) word = *(uint32_t *) (buffer + offs);
+					offs += 4;
+					bits = ((uint64_t) word) << 32;
+					nBitsAvailable = 32;
+				}
 
-				if (bufferFill >= bufferSize) {
-					*(uint32_t *) (out + nWritten) = outBuffer;
-					nWritten += 4;
-					bufferFill = 0;
+				int lr = (int) (bits >> 63);
+				bits <<= 1;
+				nBitsAvailable--;
+				trOffs = huffmanTreeStep(treeBase, treeSize, trOffs, lr, &isLeaf);
+				if (trOffs == -1) {
+					free(out);
+					return NULL;
 				}
 			}
-			if (nWritten >= outSize) return out;
-			bits <<= 1; //next bit
+			sym = treeBase[trOffs];
+		}
+
+		outBuffer >>= symSize;
+		outBuffer |= ((uint32_t) sym) << (32 - symSize);
+		bufferFill++;
+
+		if (bufferFill >= bufferSize) {
+			*(uint32_t *) (out + nWritten) = outBuffer;
+			nWritten += 4;
+			bufferFill = 0;
 		}
 	}
 
 	return out;
 }
 
-int compareMemory(char *b1, char *b2, int nMax, int nAbsoluteMax) {
-	int nSame = 0;
-	if (nMax > nAbsoluteMax) nMax = nAbsoluteMax;
-	//count up to nMax. If all match, count 0x12-nMax bytes. The b1 just starts over.
-	for (int i = 0; i < nMax; i++) {
-		if (*(b1++) == *(b2++)) nSame++;
-		else break;
+//----- LZ match finder
+
+#define LZ_MIN_MATCH         3
+#define LZ_MIN_DISTANCE      2       //distance 1 is never used, keeps output VRAM-safe
+#define LZ_WINDOW_SIZE       0x1000
+#define LZ_HASH_BITS         14
+#define LZ_HASH_SIZE         (1 << LZ_HASH_BITS)
+
+//worst case output size. Tokens never take more bytes than they cover, and there
+//is a flag byte per 8 tokens. At least one flag group is written, whose unused
+//slots are padded with up to 8 zero bytes, and LZ11 output is padded to 4 bytes.
+#define LZ_MAX_COMPRESSED_SIZE(size) (4 + (size) + ((size) >> 3) + 1 + 8 + 3)
+
+//
+// Hash chains over every 3-byte sequence in the buffer. Chain links are only
+// kept for the last LZ_WINDOW_SIZE positions, since nothing further back can
+// be referenced by a match.
+//
+typedef struct LZ_MATCHER_ {
+	unsigned char *buffer;         //buffer being compressed
+	int size;                      //size of the buffer
+	int maxChain;                  //maximum number of candidates tested per search
+	int nInserted;                 //number of positions entered into the chains
+	int head[LZ_HASH_SIZE];        //most recent position per hash, or -1
+	int prev[LZ_WINDOW_SIZE];      //previous position with the same hash
+} LZ_MATCHER;
+
+static int lzEffortToChainLength(int effort) {
+	switch (effort) {
+		case LZ_EFFORT_FAST:
+			return 16;
+		case LZ_EFFORT_NORMAL:
+			return 256;
 	}
-	if (nSame == nMax) {
-		b1 -= nMax;
-		for (int i = 0; i < nAbsoluteMax - nMax; i++) {
-			if (*(b1++) == *(b2++)) nSame++;
-			else break;
+	return LZ_WINDOW_SIZE; //exhaustive
+}
+
+static LZ_MATCHER *lzMatcherCreate(unsigned char *buffer, int size, int effort) {
+	LZ_MATCHER *matcher = (LZ_MATCHER *) malloc(sizeof(LZ_MATCHER));
+	matcher->buffer = buffer;
+	matcher->size = size;
+	matcher->maxChain = lzEffortToChainLength(effort);
+	matcher->nInserted = 0;
+	memset(matcher->head, 0xFF, sizeof(matcher->head));
+	return matcher;
+}
+
+static void lzMatcherFree(LZ_MATCHER *matcher) {
+	free(matcher);
+}
+
+static __inline unsigned int lzHash(unsigned char *p) {
+	uint32_t seq = (p[0] << 16) | (p[1] << 8) | p[2];
+	return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static void lzMatcherInsertUpTo(LZ_MATCHER *matcher, int pos) {
+	//only positions with 3 bytes after them can start a match
+	int end = pos;
+	if (end > matcher->size - 2) end = matcher->size - 2;
+	for (int i = matcher->nInserted; i < end; i++) {
+		unsigned int hash = lzHash(matcher->buffer + i);
+		matcher->prev[i & (LZ_WINDOW_SIZE - 1)] = matcher->head[hash];
+		matcher->head[hash] = i;
+	}
+	if (end > matcher->nInserted) matcher->nInserted = end;
+}
+
+//
+// Find the longest match for the data at pos, up to maxLength bytes. On ties
+// the nearest match wins, so the result is the same as a full backwards scan
+// of the window. If knownLength is nonzero, a match of that length is already
+// known to exist at *distance and only longer matches are looked for. Returns
+// the match length, or 0 if there is no usable match.
+//
+static int lzMatcherSearch(LZ_MATCHER *matcher, int pos, int maxLength, int knownLength, int *distance) {
+	if (maxLength > matcher->size - pos) maxLength = matcher->size - pos;
+	if (maxLength < LZ_MIN_MATCH) return 0;
+
+	unsigned char *buffer = matcher->buffer;
+	unsigned char *cur = buffer + pos;
+	if (knownLength) {
+		//the known match may run on further than it was known to.
+		unsigned char *src = cur - *distance;
+		if (knownLength > maxLength) knownLength = maxLength;
+		while (knownLength < maxLength && src[knownLength] == cur[knownLength]) knownLength++;
+		if (knownLength == maxLength) return maxLength;
+	}
+
+	lzMatcherInsertUpTo(matcher, pos);
+
+	//search backwards up to 0xFFF bytes, but not to the start of the buffer.
+	int maxDistance = LZ_WINDOW_SIZE - 1;
+	if (maxDistance > pos - 1) maxDistance = pos - 1;
+
+	int biggestRun = knownLength, biggestRunDistance = knownLength ? *distance : 0;
+	int nChain = matcher->maxChain;
+
+	int candidate = matcher->head[lzHash(cur)];
+	while (candidate >= 0 && nChain > 0) {
+		int dist = pos - candidate;
+		if (dist > maxDistance) break;
+
+		if (dist >= LZ_MIN_DISTANCE) {
+			//check the byte that would extend the best match first
+			unsigned char *src = buffer + candidate;
+			if (src[biggestRun] == cur[biggestRun]) {
+				int nMatched = 0;
+				while (nMatched < maxLength && src[nMatched] == cur[nMatched]) nMatched++;
+
+				if (nMatched > biggestRun) {
+					biggestRun = nMatched;
+					biggestRunDistance = dist;
+					if (nMatched == maxLength) break;
+				}
+			}
+			nChain--;
 		}
+		candidate = matcher->prev[candidate & (LZ_WINDOW_SIZE - 1)];
 	}
-	return nSame;
+
+	if (biggestRun < LZ_MIN_MATCH) return 0;
+	*distance = biggestRunDistance;
+	return biggestRun;
+}
+
+char *lz77compress(char *buffer, int size, unsigned int *compressedSize) {
+	return lz77compressEx(buffer, size, compressedSize, LZ_EFFORT_MAX);
 }
 
-char *lz77compress(char *buffer, int size, unsigned int *compressedSize){
-	int compressedMaxSize = 4 + 9 * ((size + 7) >> 3);
+char *lz77compressEx(char *buffer, int size, unsigned int *compressedSize, int effort) {
+	LZ_MATCHER *matcher = lzMatcherCreate((unsigned char *) buffer, size, effort);
+	int compressedMaxSize = LZ_MAX_COMPRESSED_SIZE(size);
 	char *compressed = (char *) malloc(compressedMaxSize);
 	char *compressedBase = compressed;
 	*(unsigned *) compressed = size << 8;
@@ -218,28 +406,9 @@ char *lz77compress(char *buffer, int size, unsigned int *compressedSize){
 				continue;
 			}
 
-			//search backwards up to 0xFFF bytes.
-			int maxSearch = 0x1000;
-			if (maxSearch > nProcessedBytes) maxSearch = nProcessedBytes;
-
-			//the biggest match, and where it was
-			int biggestRun = 0, biggestRunIndex = 0;
-
-			//begin searching backwards.
-			for (int j = 2; j < maxSearch; j++) {
-				//compare up to 0xF bytes, at most j bytes.
-				int nCompare = 0x12;
-				if (nCompare > j) nCompare = j;
-				int nBytesLeft = size - nProcessedBytes;
-				int nAbsoluteMaxCompare = 0x12;
-				if (nAbsoluteMaxCompare > nBytesLeft) nAbsoluteMaxCompare = nBytesLeft;
-				int nMatched = compareMemory(buffer - j, buffer, nCompare, nAbsoluteMaxCompare);
-				if (nMatched > biggestRun) {
-					if (biggestRun == 0x12) break;
-					biggestRun = nMatched;
-					biggestRunIndex = j;
-				}
-			}
+			//find the longest match in the window.
+			int biggestRunIndex = 0;
+			int biggestRun = lzMatcherSearch(matcher, nProcessedBytes, 0x12, 0, &biggestRunIndex);
 
 			//if the biggest run is at least 3, then we use it.
 			if (biggestRun >= 3) {
@@ -262,10 +431,10 @@ char *lz77compress(char *buffer, int size, unsigned int *compressedSize){
 		*headLocation = head;
 		if (nProcessedBytes >= size) break;
 	}
+	lzMatcherFree(matcher);
 	*compressedSize = nSize;
 	return realloc(compressedBase, nSize);
-
-}//22999
+}
 
 char *lz77HeaderCompress(char *buffer, int size, int *compressedSize) {
 	char *compressed = lz77compress(buffer, size, compressedSize);
@@ -280,8 +449,36 @@ char *lz77HeaderCompress(char *buffer, int size, int *compressedSize) {
 	return compressed;
 }
 
+static int lz11WriteMatch(char *compressed, int biggestRun, int biggestRunIndex) {
+	if (biggestRun <= 0x10) {
+		//First byte has high nybble as length minus 1, low nybble as the high byte of the offset.
+		compressed[0] = ((biggestRun - 1) << 4) | (((biggestRunIndex - 1) >> 8) & 0xF);
+		compressed[1] = (biggestRunIndex - 1) & 0xFF;
+		return 2;
+	} else if (biggestRun <= 0xFF + 0x11) {
+		//First byte has the high 4 bits of run length minus 0x11
+		//Second byte has the low 4 bits of the run length minus 0x11 in the high nybble
+		compressed[0] = (biggestRun - 0x11) >> 4;
+		compressed[1] = (((biggestRun - 0x11) & 0xF) << 4) | ((biggestRunIndex - 1) >> 8);
+		compressed[2] = (biggestRunIndex - 1) & 0xFF;
+		return 3;
+	} else {
+		//First byte is 0x10 ORed with the high 4 bits of run length minus 0x111
+		compressed[0] = 0x10 | (((biggestRun - 0x111) >> 12) & 0xF);
+		compressed[1] = ((biggestRun - 0x111) >> 4) & 0xFF;
+		compressed[2] = (((biggestRun - 0x111) & 0xF) << 4) | (((biggestRunIndex - 1) >> 8) & 0xF);
+		compressed[3] = (biggestRunIndex - 1) & 0xFF;
+		return 4;
+	}
+}
+
 char *lz11compress(char *buffer, int size, int *compressedSize) {
-	int compressedMaxSize = 7 + 9 * ((size + 7) >> 3);
+	return lz11compressEx(buffer, size, compressedSize, LZ_EFFORT_MAX);
+}
+
+char *lz11compressEx(char *buffer, int size, int *compressedSize, int effort) {
+	LZ_MATCHER *matcher = lzMatcherCreate((unsigned char *) buffer, size, effort);
+	int compressedMaxSize = LZ_MAX_COMPRESSED_SIZE(size);
 	char *compressed = (char *) malloc(compressedMaxSize);
 	char *compressedBase = compressed;
 	*(unsigned *) compressed = size << 8;
@@ -310,56 +507,19 @@ char *lz11compress(char *buffer, int size, int *compressedSize) {
 				continue;
 			}
 
-			//search backwards up to 0xFFF bytes.
-			int maxSearch = 0x1000;
-			if (maxSearch > nProcessedBytes) maxSearch = nProcessedBytes;
-
-			//the biggest match, and where it was
-			int biggestRun = 0, biggestRunIndex = 0;
-
-			//begin searching backwards.
-			for (int j = 2; j < maxSearch; j++) {
-				//compare up to 0xF bytes, at most j bytes.
-				int nCompare = 0xFFFF + 0x111; //max run length
-				if (nCompare > j) nCompare = j;
-				int nBytesLeft = size - nProcessedBytes;
-				int nAbsoluteMaxCompare = 0xFFFF + 0x111; //max run length
-				if (nAbsoluteMaxCompare > nBytesLeft) nAbsoluteMaxCompare = nBytesLeft;
-				int nMatched = compareMemory(buffer - j, buffer, nCompare, nAbsoluteMaxCompare);
-				if (nMatched > biggestRun) {
-					if (biggestRun == 0x12) break;
-					biggestRun = nMatched;
-					biggestRunIndex = j;
-				}
-			}
+			//find the longest match in the window.
+			int biggestRunIndex = 0;
+			int biggestRun = lzMatcherSearch(matcher, nProcessedBytes, 0xFFFF + 0x111, 0, &biggestRunIndex);
 
 			//if the biggest run is at least 3, then we use it.
 			if (biggestRun >= 3) {
 				head |= 1;
 				nProcessedBytes += biggestRun;
 				//encode the match.
+				int nWritten = lz11WriteMatch(compressed, biggestRun, biggestRunIndex);
+				compressed += nWritten;
+				nSize += nWritten;
 
-				if (biggestRun <= 0x10) {
-					//First byte has high nybble as length minus 1, low nybble as the high byte of the offset.
-					*(compressed++) = ((biggestRun - 1) << 4) | (((biggestRunIndex - 1) >> 8) & 0xF);
-					*(compressed++) = (biggestRunIndex - 1) & 0xFF;
-					nSize += 2;
-				} else if (biggestRun <= 0xFF + 0x11) {
-					//First byte has the high 4 bits of run length minus 0x11
-					//Second byte has the low 4 bits of the run length minus 0x11 in the high nybble
-					*(compressed++) = (biggestRun - 0x11) >> 4;
-					*(compressed++) = (((biggestRun - 0x11) & 0xF) << 4) | ((biggestRunIndex - 1) >> 8);
-					*(compressed++) = (biggestRunIndex - 1) & 0xFF;
-					nSize += 3;
-				} else if (biggestRun <= 0xFFFF + 0x111) {
-					//First byte is 0x10 ORed with the high 4 bits of run length minus 0x111
-					*(compressed++) = 0x10 | (((biggestRun - 0x111) >> 12) & 0xF);
-					*(compressed++) = ((biggestRun - 0x111) >> 4) & 0xFF;
-					*(compressed++) = (((biggestRun - 0x111) & 0xF) << 4) | (((biggestRunIndex - 1) >> 8) & 0xF);
-					*(compressed++) = (biggestRunIndex - 1) & 0xFF;
-
-					nSize += 4;
-				}
 				//advance the buffer
 				buffer += biggestRun;
 				if (nProcessedBytes >= size) isDone = 1;
@@ -378,219 +538,446 @@ char *lz11compress(char *buffer, int size, int *compressedSize) {
 		*(compressed++) = 0;
 		nSize++;
 	}
+	lzMatcherFree(matcher);
 	*compressedSize = nSize;
 	return realloc(compressedBase, nSize);
 }
 
-typedef struct HUFFNODE_ {
-	unsigned char sym;
-	unsigned char symMin; //had space to spare, maybe make searches a little simpler
-	unsigned char symMax;
-	unsigned char nRepresent;
-	int freq;
-	struct HUFFNODE_ *left;
-	struct HUFFNODE_ *right;
-} HUFFNODE;
-
-typedef struct BITSTREAM_ {
-	unsigned *bits;
-	int nWords;
-	int nBitsInLastWord;
-	int nWordsAlloc;
-} BITSTREAM;
+//----- LZ optimal parsing
+
+//
+// Cost classes of a match in bits, including the flag bit. LZ77 has a single
+// class, LZ11 costs more bytes as the match length grows.
+//
+typedef struct LZ_COST_CLASS_ {
+	int minLength;
+	int maxLength;
+	int cost;
+} LZ_COST_CLASS;
+
+static const LZ_COST_CLASS lz77CostClasses[] = {
+	{ 3, 0x12, 17 }
+};
+
+static const LZ_COST_CLASS lz11CostClasses[] = {
+	{ 3,     0x10,          17 },
+	{ 0x11,  0xFF + 0x11,   25 },
+	{ 0x111, 0xFFFF + 0x111, 33 }
+};
+
+//pick whichever position has the cheaper remaining cost, favoring longer matches
+static __inline int lzBetterPosition(uint32_t *cost, int a, int b) {
+	if (a < 0) return b;
+	if (b < 0) return a;
+	if (cost[a] != cost[b]) return cost[a] < cost[b] ? a : b;
+	return a > b ? a : b;
+}
 
-void bitStreamCreate(BITSTREAM *stream) {
-	stream->nWords = 1;
-	stream->nBitsInLastWord = 0;
-	stream->nWordsAlloc = 16;
-	stream->bits = (unsigned *) calloc(16, 4);
+static void lzCostTreeUpdate(int *tree, uint32_t *cost, int treeBase, int pos) {
+	int node = treeBase + pos;
+	tree[node] = pos;
+	node >>= 1;
+	while (node) {
+		tree[node] = lzBetterPosition(cost, tree[node * 2], tree[node * 2 + 1]);
+		node >>= 1;
+	}
 }
 
-void bitStreamFree(BITSTREAM *stream) {
-	free(stream->bits);
+static int lzCostTreeQuery(int *tree, uint32_t *cost, int treeBase, int first, int last) {
+	int best = -1;
+	int l = first + treeBase, r = last + treeBase + 1;
+	while (l < r) {
+		if (l & 1) best = lzBetterPosition(cost, best, tree[l++]);
+		if (r & 1) best = lzBetterPosition(cost, best, tree[--r]);
+		l >>= 1;
+		r >>= 1;
+	}
+	return best;
 }
 
-void bitStreamWrite(BITSTREAM *stream, int bit) {
-	if (stream->nBitsInLastWord == 32) {
-		stream->nBitsInLastWord = 0;
-		stream->nWords++;
-		if (stream->nWords > stream->nWordsAlloc) {
-			int newAllocSize = (stream->nWordsAlloc + 2) * 3 / 2;
-			stream->bits = realloc(stream->bits, newAllocSize * 4);
-			stream->nWordsAlloc = newAllocSize;
+//
+// Get the size in bytes of a parse, not counting the alignment of LZ11 output.
+// Each group of 8 tokens takes a flag byte, and the unused slots of the last
+// group are padded with a zero byte each. Lengths under LZ_MIN_MATCH are
+// literals.
+//
+static int lzParseSize(int *lengths, int size, const LZ_COST_CLASS *classes, int nClasses) {
+	int nBytes = 4, nTokens = 0;
+	for (int i = 0; i < size; nTokens++) {
+		int length = lengths[i];
+		if (length < LZ_MIN_MATCH) {
+			nBytes++;
+			i++;
+			continue;
 		}
-		stream->bits[stream->nWords - 1] = 0;
+
+		int j = 0;
+		while (length > classes[j].maxLength) j++;
+		nBytes += classes[j].cost >> 3;
+		i += length;
 	}
 
-	stream->bits[stream->nWords - 1] |= (bit << (31 - stream->nBitsInLastWord));
-	stream->nBitsInLastWord++;
+	int nGroups = nTokens ? ((nTokens + 7) >> 3) : 1;
+	return nBytes + nGroups * 9 - nTokens;
 }
 
-#define ISLEAF(n) ((n)->left==NULL&&(n)->right==NULL)
+//
+// Find the parse of the buffer with the smallest encoded size. Working from the
+// end of the buffer, the cost of encoding each suffix is the cheaper of a
+// literal or any match length from the longest match found there. Since every
+// length in a cost class costs the same, only the cheapest suffix reachable by
+// that class needs to be looked up, which a min segment tree answers quickly.
+// Token costs leave out the padding of the last flag group, so the greedy
+// parse is also measured and used instead if it comes out smaller.
+// On return, lengths[i] holds the length of the token starting at i (1 for a
+// literal) and distances[i] the distance of the match found at i.
+//
+static void lzComputeOptimalParse(unsigned char *buffer, int size, const LZ_COST_CLASS *classes, int nClasses, int *lengths, int *distances) {
+	int maxRun = classes[nClasses - 1].maxLength;
+
+	//find the longest match at every position.
+	LZ_MATCHER *matcher = lzMatcherCreate(buffer, size, LZ_EFFORT_MAX);
+	int *matchLengths = (int *) calloc(size, sizeof(int));
+	for (int i = 0; i < size; i++) {
+		//a match continues at the same distance one byte shorter, so only longer ones need testing.
+		int knownLength = 0;
+		if (i > 0 && matchLengths[i - 1] > LZ_MIN_MATCH) {
+			knownLength = matchLengths[i - 1] - 1;
+			distances[i] = distances[i - 1];
+		}
+		matchLengths[i] = lzMatcherSearch(matcher, i, maxRun, knownLength, &distances[i]);
+	}
+	lzMatcherFree(matcher);
+
+	//segment tree over the suffix costs
+	int treeBase = 1;
+	while (treeBase < size + 1) treeBase <<= 1;
+	int *tree = (int *) malloc(treeBase * 2 * sizeof(int));
+	memset(tree, 0xFF, treeBase * 2 * sizeof(int));
+	uint32_t *cost = (uint32_t *) calloc(size + 1, sizeof(uint32_t));
+	lzCostTreeUpdate(tree, cost, treeBase, size);
+
+	for (int i = size - 1; i >= 0; i--) {
+		cost[i] = cost[i + 1] + 9;
+		lengths[i] = 1;
+
+		int longest = matchLengths[i];
+		for (int j = 0; j < nClasses && longest >= classes[j].minLength; j++) {
+			int last = min(longest, classes[j].maxLength);
+			int best = lzCostTreeQuery(tree, cost, treeBase, i + classes[j].minLength, i + last);
+			if (cost[best] + classes[j].cost < cost[i]) {
+				cost[i] = cost[best] + classes[j].cost;
+				lengths[i] = best - i;
+			}
+		}
+		lzCostTreeUpdate(tree, cost, treeBase, i);
+	}
 
-int huffNodeComparator(const void *p1, const void *p2) {
-	return ((HUFFNODE *) p2)->freq - ((HUFFNODE *) p1)->freq;
-}
+	//the greedy parse takes the longest match at every token.
+	if (lzParseSize(matchLengths, size, classes, nClasses) < lzParseSize(lengths, size, classes, nClasses)) {
+		for (int i = 0; i < size; i++) {
+			lengths[i] = matchLengths[i] >= LZ_MIN_MATCH ? matchLengths[i] : 1;
+		}
+	}
 
-unsigned int huffmanWriteNode(unsigned char *tree, unsigned int pos, HUFFNODE *node) {
-	HUFFNODE *left = node->left;
-	HUFFNODE *right = node->right;
+	free(cost);
+	free(tree);
+	free(matchLengths);
+}
 
-	//we will write two bytes. 
-	unsigned int afterPos = pos + 2;
-	if (ISLEAF(left)) {
-		tree[pos] = left->sym;
+static char *lzCompressOptimal(char *buffer, int size, int *compressedSize, int lz11) {
+	int *lengths = (int *) calloc(size, sizeof(int));
+	int *distances = (int *) calloc(size, sizeof(int));
+	if (lz11) {
+		lzComputeOptimalParse((unsigned char *) buffer, size, lz11CostClasses, 3, lengths, distances);
 	} else {
-		HUFFNODE *leftLeft = left->left;
-		HUFFNODE *leftRight = left->right;
-		unsigned char flag = (ISLEAF(leftLeft) << 7) | (ISLEAF(leftRight) << 6);
-		unsigned lastAfterPos = afterPos;
-		afterPos = huffmanWriteNode(tree, afterPos, left);
-		tree[pos] = flag | ((((lastAfterPos - pos) >> 1) - 1) & 0x3F);
-		if (((lastAfterPos - pos) >> 1) - 1 > 0x3F) _asm int 3;
+		lzComputeOptimalParse((unsigned char *) buffer, size, lz77CostClasses, 1, lengths, distances);
 	}
 
-	if (ISLEAF(right)) {
-		tree[pos + 1] = right->sym;
-	} else {
-		HUFFNODE *rightLeft = right->left;
-		HUFFNODE *rightRight = right->right;
-		unsigned char flag = (ISLEAF(rightLeft) << 7) | (ISLEAF(rightRight) << 6);
-		unsigned lastAfterPos = afterPos;
-		afterPos = huffmanWriteNode(tree, afterPos, right);
-		tree[pos + 1] = flag | ((((lastAfterPos - pos) >> 1) - 1) & 0x3F);
-		if (((lastAfterPos - pos) >> 1) - 1 > 0x3F) _asm int 3;
-	}
-	return afterPos;
-}
-
-void makeShallowNodeFirst(HUFFNODE *node) {
-	if (ISLEAF(node)) return;
-	if (node->left->nRepresent > node->right->nRepresent) {
-		HUFFNODE *left = node->left;
-		node->left = node->right;
-		node->right = left;
-	}
-	makeShallowNodeFirst(node->left);
-	makeShallowNodeFirst(node->right);
-}
-
-int huffmanNodeHasSymbol(HUFFNODE *node, unsigned char sym) {
-	if (ISLEAF(node)) return node->sym == sym;
-	if (sym < node->symMin || sym > node->symMax) return 0;
-	HUFFNODE *left = node->left;
-	HUFFNODE *right = node->right;
-	return huffmanNodeHasSymbol(left, sym) || huffmanNodeHasSymbol(right, sym);
-}
-
-void huffmanWriteSymbol(BITSTREAM *bits, unsigned char sym, HUFFNODE *tree) {
-	if (ISLEAF(tree)) return;
-	HUFFNODE *left = tree->left;
-	HUFFNODE *right = tree->right;
-	if (huffmanNodeHasSymbol(left, sym)) {
-		bitStreamWrite(bits, 0);
-		huffmanWriteSymbol(bits, sym, left);
-	} else {
-		bitStreamWrite(bits, 1);
-		huffmanWriteSymbol(bits, sym, right);
+	int compressedMaxSize = LZ_MAX_COMPRESSED_SIZE(size);
+	char *compressed = (char *) malloc(compressedMaxSize);
+	char *compressedBase = compressed;
+	*(unsigned *) compressed = size << 8;
+	*compressed = lz11 ? 0x11 : 0x10;
+	int nProcessedBytes = 0;
+	int nSize = 4;
+	compressed += 4;
+	while (1) {
+		//make note of where to store the head for later.
+		char *headLocation = compressed;
+		compressed++;
+		nSize++;
+		char head = 0;
+
+		for (int i = 0; i < 8; i++) {
+			head <<= 1;
+
+			//zero-pad the rest of the last head.
+			if (nProcessedBytes >= size) {
+				*(compressed++) = 0;
+				nSize++;
+				continue;
+			}
+
+			int length = lengths[nProcessedBytes];
+			if (length >= 3) {
+				int distance = distances[nProcessedBytes];
+				int nWritten = 2;
+				head |= 1;
+				if (lz11) {
+					nWritten = lz11WriteMatch(compressed, length, distance);
+				} else {
+					compressed[0] = ((length - 3) << 4) | (((distance - 1) >> 8) & 0xF);
+					compressed[1] = (distance - 1) & 0xFF;
+				}
+				compressed += nWritten;
+				nSize += nWritten;
+				nProcessedBytes += length;
+			} else {
+				*(compressed++) = buffer[nProcessedBytes++];
+				nSize++;
+			}
+		}
+		*headLocation = head;
+		if (nProcessedBytes >= size) break;
 	}
-}
 
-void huffmanConstructTree(HUFFNODE *nodes, int nNodes) {
-	//sort by frequency, then cut off the remainder (freq=0).
-	qsort(nodes, nNodes, sizeof(HUFFNODE), huffNodeComparator);
-	for (int i = 0; i < nNodes; i++) {
-		if (nodes[i].freq == 0) {
-			nNodes = i;
-			break;
+	if (lz11) {
+		while (nSize & 3) {
+			*(compressed++) = 0;
+			nSize++;
 		}
 	}
+	free(lengths);
+	free(distances);
+	*compressedSize = nSize;
+	return realloc(compressedBase, nSize);
+}
+
+char *lz77compressOptimal(char *buffer, int size, unsigned int *compressedSize) {
+	return lzCompressOptimal(buffer, size, compressedSize, 0);
+}
+
+char *lz11compressOptimal(char *buffer, int size, int *compressedSize) {
+	return lzCompressOptimal(buffer, size, compressedSize, 1);
+}
+
+typedef struct HUFFNODE_ {
+	int sym;
+	int freq;
+	int nRepresent; //number of leaves under this node
+	struct HUFFNODE_ *left;
+	struct HUFFNODE_ *right;
+} HUFFNODE;
+
+typedef struct HUFFCODE_ {
+	uint64_t bits;  //code, right-aligned
+	int length;     //length of the code in bits
+} HUFFCODE;
 
-	//unflatten the histogram into a huffman tree. 
-	int nRoots = nNodes;
-	int nTotalNodes = nNodes;
-	while (nRoots > 1) {
-		//copy bottom two nodes to just outside the current range
-		HUFFNODE *srcA = nodes + nRoots - 2;
-		HUFFNODE *destA = nodes + nTotalNodes;
-		memcpy(destA, srcA, sizeof(HUFFNODE));
+//a node waiting for its children to be written to the serialized tree
+typedef struct HUFFPENDING_ {
+	HUFFNODE *node;
+	int pos;        //position of the node's byte in the tree
+	int deadline;   //last slot the children can be written to
+	uint64_t code;
+	int codeLength;
+} HUFFPENDING;
+
+#define ISLEAF(n) ((n)->left==NULL&&(n)->right==NULL)
 
-		HUFFNODE *left = destA;
-		HUFFNODE *right = nodes + nRoots - 1;
-		HUFFNODE *branch = srcA;
+#define HUFFMAN_MAX_OFFSET      0x3F
+#define HUFFMAN_URGENT_SLACK    8    //nodes this close to their deadline are written first
 
-		branch->freq = left->freq + right->freq;
+static int huffNodeComparator(const void *p1, const void *p2) {
+	HUFFNODE *n1 = (HUFFNODE *) p1;
+	HUFFNODE *n2 = (HUFFNODE *) p2;
+	if (n1->freq != n2->freq) return n1->freq < n2->freq ? -1 : 1;
+	return n1->sym - n2->sym;
+}
+
+//
+// Build a Huffman tree from the leaves in nodes, which must have room for
+// 2 * nSym nodes. Returns the root. At least two leaves are always used, so
+// that every symbol has a code of at least one bit.
+//
+static HUFFNODE *huffmanConstructTree(HUFFNODE *nodes, int nSym) {
+	//sort by frequency, zero-frequency symbols first.
+	qsort(nodes, nSym, sizeof(HUFFNODE), huffNodeComparator);
+	int firstLeaf = 0;
+	while (firstLeaf < nSym - 2 && nodes[firstLeaf].freq == 0) firstLeaf++;
+
+	//merge the two lightest nodes until one remains. Merged nodes are created
+	//in order of increasing frequency, so they form a second sorted queue.
+	HUFFNODE *leaves = nodes + firstLeaf, *branches = nodes + nSym;
+	int nLeaves = nSym - firstLeaf, leafPos = 0, nBranches = 0, branchPos = 0;
+	for (int i = 0; i < nLeaves - 1; i++) {
+		HUFFNODE *pair[2];
+		for (int j = 0; j < 2; j++) {
+			if (branchPos >= nBranches || (leafPos < nLeaves && leaves[leafPos].freq <= branches[branchPos].freq)) {
+				pair[j] = &leaves[leafPos++];
+			} else {
+				pair[j] = &branches[branchPos++];
+			}
+		}
+
+		HUFFNODE *branch = &branches[nBranches++];
 		branch->sym = 0;
-		branch->left = left;
-		branch->right = right;
-		branch->symMin = min(left->symMin, right->symMin);
-		branch->symMax = max(right->symMax, left->symMax);
-		branch->nRepresent = left->nRepresent + right->nRepresent; //may overflow for root, but the root doesn't really matter for this
+		branch->freq = pair[0]->freq + pair[1]->freq;
+		branch->nRepresent = pair[0]->nRepresent + pair[1]->nRepresent;
+		branch->left = pair[0];
+		branch->right = pair[1];
+	}
+	return &branches[nBranches - 1];
+}
 
-		nRoots--;
-		nTotalNodes++;
-		qsort(nodes, nRoots, sizeof(HUFFNODE), huffNodeComparator);
+//
+// Serialize the tree and assign each symbol its code. Each node stores a 6-bit
+// offset to its children, so they must be written within 0x40 slots of it.
+// Writing breadth-first runs out of range on wide trees, so nodes close to
+// their deadline are written first, and otherwise the smallest subtree is
+// written first to keep the number of waiting nodes low. Returns the size of
+// the tree in bytes, or 0 if the tree could not be laid out.
+//
+static int huffmanWriteTree(unsigned char *tree, HUFFNODE *root, HUFFCODE *codes) {
+	HUFFPENDING pending[256];
+	int nPending = 1;
+	pending[0].node = root;
+	pending[0].pos = 1;
+	pending[0].deadline = 1;
+	pending[0].code = 0;
+	pending[0].codeLength = 0;
+
+	int slot = 1;
+	while (nPending > 0) {
+		//find the most urgent node, and the smallest one
+		int urgent = 0, smallest = 0;
+		for (int i = 1; i < nPending; i++) {
+			if (pending[i].deadline < pending[urgent].deadline) urgent = i;
+			if (pending[i].node->nRepresent < pending[smallest].node->nRepresent) smallest = i;
+		}
+		int chosen = (pending[urgent].deadline - slot <= HUFFMAN_URGENT_SLACK) ? urgent : smallest;
+		HUFFPENDING entry = pending[chosen];
+		pending[chosen] = pending[--nPending];
+		if (slot > entry.deadline) return 0;
+
+		//write the node, pointing to its children at this slot
+		HUFFNODE *node = entry.node;
+		int childPos = slot * 2;
+		tree[entry.pos] = (ISLEAF(node->left) << 7) | (ISLEAF(node->right) << 6) | (slot - (entry.pos >> 1) - 1);
+
+		HUFFNODE *children[2] = { node->left, node->right };
+		for (int i = 0; i < 2; i++) {
+			HUFFNODE *child = children[i];
+			uint64_t code = (entry.code << 1) | i;
+			if (ISLEAF(child)) {
+				tree[childPos + i] = child->sym;
+				codes[child->sym].bits = code;
+				codes[child->sym].length = entry.codeLength + 1;
+			} else {
+				HUFFPENDING *childEntry = &pending[nPending++];
+				childEntry->node = child;
+				childEntry->pos = childPos + i;
+				childEntry->deadline = slot + 1 + HUFFMAN_MAX_OFFSET;
+				childEntry->code = code;
+				childEntry->codeLength = entry.codeLength + 1;
+			}
+		}
+		slot++;
+	}
+	return slot * 2;
+}
+
+typedef struct HUFFWRITER_ {
+	uint32_t *out;
+	uint64_t bits;  //pending bits, left-aligned
+	int nBits;
+} HUFFWRITER;
+
+static __inline void huffmanWriteBits(HUFFWRITER *writer, uint64_t bits, int length) {
+	//write at most 32 bits at a time
+	if (length > 32) {
+		huffmanWriteBits(writer, bits >> 32, length - 32);
+		length = 32;
+		bits &= 0xFFFFFFFF;
 	}
 
-	//just to be sure, make sure the shallow node always comes first
-	makeShallowNodeFirst(nodes);
+	writer->bits |= bits << (64 - writer->nBits - length);
+	writer->nBits += length;
+	if (writer->nBits >= 32) {
+		*(writer->out++) = (uint32_t) (writer->bits >> 32);
+		writer->bits <<= 32;
+		writer->nBits -= 32;
+	}
 }
 
 char *huffmanCompress(unsigned char *buffer, int size, int *compressedSize, int nBits) {
 	//create a histogram of each byte in the file.
-	HUFFNODE *nodes = (HUFFNODE *) calloc(512, sizeof(HUFFNODE));
 	int nSym = 1 << nBits;
-	for (int i = 0; i < nSym; i++) {
-		nodes[i].sym = i;
-		nodes[i].symMin = i;
-		nodes[i].symMax = i;
-		nodes[i].nRepresent = 1;
-	}
-
-	//construct histogram
+	int freqs[256] = { 0 };
 	if (nBits == 8) {
 		for (int i = 0; i < size; i++) {
-			nodes[buffer[i]].freq++;
+			freqs[buffer[i]]++;
 		}
 	} else {
 		for (int i = 0; i < size; i++) {
-			nodes[buffer[i] & 0xF].freq++;
-			nodes[buffer[i] >> 4].freq++;
+			freqs[buffer[i] & 0xF]++;
+			freqs[buffer[i] >> 4]++;
 		}
 	}
 
-	huffmanConstructTree(nodes, nSym);
+	//build the tree and code table. In the unlikely case the tree can't be
+	//written with 6-bit offsets, flatten the frequencies and try again; equal
+	//frequencies always give a tree that fits.
+	HUFFNODE nodes[512];
+	HUFFCODE codes[256];
+	unsigned char tree[512] = { 0 };
+	int treeSize = 0;
+	for (int shift = 0; treeSize == 0; shift++) {
+		memset(nodes, 0, sizeof(nodes));
+		for (int i = 0; i < nSym; i++) {
+			nodes[i].sym = i;
+			nodes[i].freq = (freqs[i] && shift) ? ((freqs[i] >> shift) | 1) : freqs[i];
+			nodes[i].nRepresent = 1;
+		}
 
-	//now we've got a proper Huffman tree. Great! 
-	unsigned char *tree = (unsigned char *) calloc(512, 1);
-	uint32_t treeSize = huffmanWriteNode(tree, 2, nodes);
+		HUFFNODE *root = huffmanConstructTree(nodes, nSym);
+		memset(codes, 0, sizeof(codes));
+		treeSize = huffmanWriteTree(tree, root, codes);
+	}
 	treeSize = (treeSize + 3) & ~3; //round up
 	tree[0] = (treeSize >> 1) - 1;
-	tree[1] = 0;
+
+	//compute the size of the bit stream to allocate the output once.
+	uint64_t nTotalBits = 0;
+	for (int i = 0; i < nSym; i++) {
+		nTotalBits += (uint64_t) freqs[i] * codes[i].length;
+	}
+	int nWords = (int) ((nTotalBits + 31) / 32);
+	if (nWords == 0) nWords = 1;
+
+	uint32_t outSize = 4 + treeSize + nWords * 4;
+	char *finBuf = (char *) calloc(outSize, 1);
+	*(uint32_t *) finBuf = 0x20 | nBits | (size << 8);
+	memcpy(finBuf + 4, tree, treeSize);
 
 	//now write bits out.
-	BITSTREAM stream;
-	bitStreamCreate(&stream);
+	HUFFWRITER writer = { 0 };
+	writer.out = (uint32_t *) (finBuf + 4 + treeSize);
 	if (nBits == 8) {
 		for (int i = 0; i < size; i++) {
-			huffmanWriteSymbol(&stream, buffer[i], nodes);
+			HUFFCODE *code = &codes[buffer[i]];
+			huffmanWriteBits(&writer, code->bits, code->length);
 		}
 	} else {
 		for (int i = 0; i < size; i++) {
-			huffmanWriteSymbol(&stream, buffer[i] & 0xF, nodes);
-			huffmanWriteSymbol(&stream, buffer[i] >> 4, nodes);
+			HUFFCODE *code = &codes[buffer[i] & 0xF];
+			huffmanWriteBits(&writer, code->bits, code->length);
+			code = &codes[buffer[i] >> 4];
+			huffmanWriteBits(&writer, code->bits, code->length);
 		}
 	}
-
-	//combine into one
-	uint32_t outSize = 4 + treeSize + stream.nWords * 4;
-	char *finBuf = (char *) malloc(outSize);
-	*(uint32_t *) finBuf = 0x20 | nBits | (size << 8);
-	memcpy(finBuf + 4, tree, treeSize);
-	memcpy(finBuf + 4 + treeSize, stream.bits, stream.nWords * 4);
-	free(tree);
-	free(nodes);
-	bitStreamFree(&stream);
+	if (writer.nBits > 0) *writer.out = (uint32_t) (writer.bits >> 32);
 
 	*compressedSize = outSize;
 	return finBuf;
@@ -725,7 +1112,7 @@ int huffmanIsCompressed(unsigned char *buffer, unsigned size) {
 	if (*buffer != 0x24 && *buffer != 0x28) return 0;
 
 	uint32_t length = (*(uint32_t *) buffer) >> 8;
-	uint32_t bitStreamOffset = ((buffer[5] + 1) << 1) + 4;
+	uint32_t bitStreamOffset = (((buffer[5] & 0x3F) + 1) << 1) + 4;
 	if (bitStreamOffset > size) return 0;
 
 	//process huffman tree
@@ -817,6 +1204,18 @@ char *lz11CompHeaderDecompress(char *buffer, int size, int *uncompressedSize) {
 	return out;
 }
 
+typedef struct LZ11_SEGMENT_ {
+	char *buffer;
+	int size;
+	char *compressed;
+	int compressedSize;
+} LZ11_SEGMENT;
+
+static void lz11CompressSegment(void *param, int index, int threadIndex) {
+	LZ11_SEGMENT *segment = ((LZ11_SEGMENT *) param) + index;
+	segment->compressed = lz11compress(segment->buffer, segment->size, &segment->compressedSize);
+}
+
 char *lz11CompHeaderCompress(char *buffer, int size, int *compressedSize) {
 	uint32_t nSegments = (size + 0xFFF) / 0x1000;  //following LEGO Battles precedent
 	uint32_t headerSize = 0x10 + 4 * nSegments;
@@ -826,38 +1225,444 @@ char *lz11CompHeaderCompress(char *buffer, int size, int *compressedSize) {
 	*(uint32_t *) (header + 4) = size;
 	*(uint32_t *) (header + 8) = nSegments;
 
+	//segments are independent, so compress them all at once
+	LZ11_SEGMENT *segments = (LZ11_SEGMENT *) calloc(nSegments, sizeof(LZ11_SEGMENT));
+	for (uint32_t i = 0; i < nSegments; i++) {
+		segments[i].buffer = buffer + i * 0x1000;
+		segments[i].size = min(size - (int) i * 0x1000, 0x1000);
+	}
+	parallelFor(nSegments, lz11CompressSegment, segments);
+
 	BSTREAM stream;
 	bstreamCreate(&stream, NULL, 0);
 	bstreamWrite(&stream, header, headerSize); //bstreamCreate bug workaround
 	free(header);
 
 	uint32_t longestCompress = 0;
-	uint32_t bytesRemaining = size;
-
-	int i = 0;
-	uint32_t offs = 0;
-	while (bytesRemaining > 0) {
-		unsigned thisRunLength = 0x1000;
-		if (thisRunLength > bytesRemaining) thisRunLength = bytesRemaining;
-
-		uint32_t thisRunCompressedSize;
-		char *thisRunCompressed = lz11compress(buffer + offs, thisRunLength, &thisRunCompressedSize);
-		bstreamWrite(&stream, thisRunCompressed, thisRunCompressedSize);
-		free(thisRunCompressed);
+	for (uint32_t i = 0; i < nSegments; i++) {
+		uint32_t thisRunCompressedSize = segments[i].compressedSize;
+		bstreamWrite(&stream, segments[i].compressed, thisRunCompressedSize);
+		free(segments[i].compressed);
 
 		if (thisRunCompressedSize > longestCompress) longestCompress = thisRunCompressedSize;
-		bytesRemaining -= thisRunLength;
-
 		*(uint32_t *) (stream.buffer + 0x10 + i * 4) = thisRunCompressedSize;
-		offs += thisRunLength;
-		i++;
 	}
 	*(uint32_t *) (stream.buffer + 0xC) = longestCompress;
+	free(segments);
 
 	*compressedSize = stream.size;
 	return stream.buffer;
 }
 
+//----- Streaming decompression
+
+#define DECOMPRESSOR_HEADER       0  //reading the stream header
+#define DECOMPRESSOR_COMP_SIZES   1  //reading the COMP segment size table
+#define DECOMPRESSOR_RAW          2  //copying an uncompressed COMP segment
+#define DECOMPRESSOR_SKIP         3  //skipping padding at the end of a COMP segment
+#define DECOMPRESSOR_LZ_HEADER    4  //reading the header of an LZ stream
+#define DECOMPRESSOR_LZ_FLAGS     5  //reading an LZ flag byte
+#define DECOMPRESSOR_LZ_TOKEN     6  //reading an LZ literal or match
+#define DECOMPRESSOR_HUFF_TREE    7  //reading the Huffman tree
+#define DECOMPRESSOR_HUFF_DATA    8  //reading the Huffman bit stream
+#define DECOMPRESSOR_DONE         9
+#define DECOMPRESSOR_ERROR        10
+
+int decompressorInit(DECOMPRESSOR *decompressor, int type, unsigned char *ring, int ringSize) {
+	if (ringSize < DECOMPRESSOR_MIN_RING_SIZE || (ringSize & (ringSize - 1))) return 0;
+	switch (type) {
+		case COMPRESSION_LZ77:
+		case COMPRESSION_LZ11:
+		case COMPRESSION_LZ11_COMP_HEADER:
+		case COMPRESSION_HUFFMAN_4:
+		case COMPRESSION_HUFFMAN_8:
+		case COMPRESSION_LZ77_HEADER:
+			break;
+		default:
+			return 0;
+	}
+
+	memset(decompressor, 0, sizeof(DECOMPRESSOR));
+	decompressor->type = type;
+	decompressor->ring = ring;
+	decompressor->ringMask = ringSize - 1;
+	decompressor->state = DECOMPRESSOR_HEADER;
+	decompressor->segmentRemaining = -1;
+
+	switch (type) {
+		case COMPRESSION_LZ11_COMP_HEADER:
+			decompressor->nNeeded = 0x10;
+			break;
+		case COMPRESSION_LZ77_HEADER:
+			decompressor->nNeeded = 8;
+			break;
+		default:
+			decompressor->nNeeded = 4;
+			break;
+	}
+	return 1;
+}
+
+void decompressorFree(DECOMPRESSOR *decompressor) {
+	if (decompressor->segmentSizes != NULL) free(decompressor->segmentSizes);
+	if (decompressor->huffmanLookup != NULL) free(decompressor->huffmanLookup);
+	decompressor->segmentSizes = NULL;
+	decompressor->huffmanLookup = NULL;
+}
+
+//number of bytes that can be written to the ring without overwriting unread output or the LZ window
+static unsigned int decompressorSpace(DECOMPRESSOR *decompressor) {
+	unsigned int keepFrom = decompressor->readPos;
+	unsigned int windowStart = decompressor->writePos > LZ_WINDOW_SIZE ? decompressor->writePos - LZ_WINDOW_SIZE : 0;
+	if (windowStart < keepFrom) keepFrom = windowStart;
+	return decompressor->ringMask + 1 - (decompressor->writePos - keepFrom);
+}
+
+static __inline void decompressorPut(DECOMPRESSOR *decompressor, unsigned char b) {
+	decompressor->ring[decompressor->writePos & decompressor->ringMask] = b;
+	decompressor->writePos++;
+}
+
+static void decompressorNextSegment(DECOMPRESSOR *decompressor) {
+	while (decompressor->segment < decompressor->nSegments) {
+		int32_t segmentSize = decompressor->segmentSizes[decompressor->segment++];
+		if (segmentSize == 0) continue;
+
+		if (segmentSize > 0) {
+			decompressor->segmentRemaining = segmentSize;
+			decompressor->state = DECOMPRESSOR_LZ_HEADER;
+			decompressor->nBuffered = 0;
+			decompressor->nNeeded = 4;
+		} else {
+			decompressor->segmentRemaining = -segmentSize;
+			decompressor->state = DECOMPRESSOR_RAW;
+		}
+		return;
+	}
+
+	decompressor->segmentRemaining = -1;
+	decompressor->state = decompressor->writePos == decompressor->size ? DECOMPRESSOR_DONE : DECOMPRESSOR_ERROR;
+}
+
+//called when the current LZ or Huffman stream has produced all of its output
+static void decompressorStreamFinished(DECOMPRESSOR *decompressor) {
+	if (decompressor->type != COMPRESSION_LZ11_COMP_HEADER) {
+		decompressor->state = DECOMPRESSOR_DONE;
+	} else if (decompressor->segmentRemaining > 0) {
+		decompressor->state = DECOMPRESSOR_SKIP;
+	} else {
+		decompressorNextSegment(decompressor);
+	}
+}
+
+static void decompressorEmitSymbol(DECOMPRESSOR *decompressor, int sym) {
+	if (decompressor->symSize == 8) {
+		decompressorPut(decompressor, (unsigned char) sym);
+	} else if (!decompressor->nibbleFull) {
+		decompressor->nibble = sym & 0xF;
+		decompressor->nibbleFull = 1;
+		return;
+	} else {
+		decompressorPut(decompressor, (unsigned char) (decompressor->nibble | (sym << 4)));
+		decompressor->nibbleFull = 0;
+	}
+	if (decompressor->writePos == decompressor->streamEnd) {
+		decompressor->nBits = 0;
+		decompressorStreamFinished(decompressor);
+	}
+}
+
+//
+// Produce any output still pending from the last token. Returns 1 if nothing
+// is pending and there is room for at least one more byte.
+//
+static int decompressorFlush(DECOMPRESSOR *decompressor) {
+	unsigned int space = decompressorSpace(decompressor);
+
+	//rest of an LZ match
+	while (decompressor->copyLength > 0 && space > 0) {
+		unsigned int src = decompressor->writePos - decompressor->copyDistance;
+		decompressorPut(decompressor, decompressor->ring[src & decompressor->ringMask]);
+		decompressor->copyLength--;
+		space--;
+		if (decompressor->copyLength == 0 && decompressor->writePos == decompressor->streamEnd) {
+			decompressorStreamFinished(decompressor);
+		}
+	}
+	if (decompressor->copyLength > 0) return 0;
+
+	//rest of a Huffman word
+	HUFFMAN_LOOKUP *table = (HUFFMAN_LOOKUP *) decompressor->huffmanLookup;
+	unsigned char *treeBase = decompressor->tree;
+	while (decompressor->nBits > 0 && decompressor->state == DECOMPRESSOR_HUFF_DATA) {
+		if (space == 0) return 0;
+
+		if (decompressor->trOffs == 1 && decompressor->nBits >= HUFFMAN_LOOKUP_BITS) {
+			HUFFMAN_LOOKUP *entry = &table[decompressor->bits >> (64 - HUFFMAN_LOOKUP_BITS)];
+			decompressor->bits <<= entry->nBits;
+			decompressor->nBits -= entry->nBits;
+			if (!entry->isLeaf) {
+				decompressor->trOffs = entry->value;
+				continue;
+			}
+			decompressorEmitSymbol(decompressor, entry->value);
+		} else {
+			int lr = (int) (decompressor->bits >> 63), isLeaf = 0;
+			decompressor->bits <<= 1;
+			decompressor->nBits--;
+			decompressor->trOffs = huffmanTreeStep(treeBase, decompressor->treeSize, decompressor->trOffs, lr, &isLeaf);
+			if (decompressor->trOffs == -1) {
+				decompressor->state = DECOMPRESSOR_ERROR;
+				return 0;
+			}
+			if (!isLeaf) continue;
+
+			int sym = treeBase[decompressor->trOffs];
+			decompressor->trOffs = 1;
+			decompressorEmitSymbol(decompressor, sym);
+		}
+		space = decompressorSpace(decompressor);
+	}
+	return space > 0;
+}
+
+static void decompressorReadLzHeader(DECOMPRESSOR *decompressor) {
+	uint32_t header = *(uint32_t *) decompressor->buffer;
+	int lz11 = decompressor->type == COMPRESSION_LZ11 || decompressor->type == COMPRESSION_LZ11_COMP_HEADER;
+	if ((header & 0xFF) != (lz11 ? 0x11u : 0x10u)) {
+		decompressor->state = DECOMPRESSOR_ERROR;
+		return;
+	}
+
+	decompressor->lz11 = lz11;
+	decompressor->streamStart = decompressor->writePos;
+	decompressor->streamEnd = decompressor->writePos + (header >> 8);
+	if (decompressor->type != COMPRESSION_LZ11_COMP_HEADER) {
+		decompressor->size = header >> 8;
+		decompressor->sizeKnown = 1;
+	}
+	decompressor->state = DECOMPRESSOR_LZ_FLAGS;
+	if (decompressor->writePos == decompressor->streamEnd) decompressorStreamFinished(decompressor);
+}
+
+static void decompressorReadHeader(DECOMPRESSOR *decompressor) {
+	unsigned char *header = decompressor->buffer;
+	switch (decompressor->type) {
+		case COMPRESSION_LZ11_COMP_HEADER:
+		{
+			uint32_t magic = *(uint32_t *) header;
+			if (magic != 'COMP' && magic != 'PMOC') {
+				decompressor->state = DECOMPRESSOR_ERROR;
+				return;
+			}
+			decompressor->size = *(uint32_t *) (header + 4);
+			decompressor->nSegments = *(uint32_t *) (header + 8);
+			decompressor->sizeKnown = 1;
+			if (decompressor->nSegments <= 0) {
+				decompressor->state = DECOMPRESSOR_ERROR;
+				return;
+			}
+			decompressor->segmentSizes = (int32_t *) calloc(decompressor->nSegments, sizeof(int32_t));
+			if (decompressor->segmentSizes == NULL) {
+				decompressor->state = DECOMPRESSOR_ERROR;
+				return;
+			}
+			decompressor->state = DECOMPRESSOR_COMP_SIZES;
+			decompressor->nBuffered = 0;
+			return;
+		}
+		case COMPRESSION_HUFFMAN_4:
+		case COMPRESSION_HUFFMAN_8:
+			decompressor->symSize = header[0] & 0xF;
+			if ((header[0] & 0xF0) != 0x20 || (decompressor->symSize != 4 && decompressor->symSize != 8)) {
+				decompressor->state = DECOMPRESSOR_ERROR;
+				return;
+			}
+			decompressor->size = (*(uint32_t *) header) >> 8;
+			decompressor->streamEnd = decompressor->size;
+			decompressor->sizeKnown = 1;
+			decompressor->state = DECOMPRESSOR_HUFF_TREE;
+			decompressor->treeSize = 0;
+			decompressor->nNeeded = 1;
+			return;
+		case COMPRESSION_LZ77_HEADER:
+			if (memcmp(header, "LZ77", 4) != 0) {
+				decompressor->state = DECOMPRESSOR_ERROR;
+				return;
+			}
+			memmove(header, header + 4, 4);
+			//fall through
+		default:
+			decompressorReadLzHeader(decompressor);
+			return;
+	}
+}
+
+static void decompressorReadMatch(DECOMPRESSOR *decompressor) {
+	unsigned char *token = decompressor->buffer;
+	uint32_t len, offs;
+	if (!decompressor->lz11) {
+		len = (token[0] >> 4) + 3;
+		offs = (((token[0] & 0xF) << 8) | token[1]) + 1;
+	} else {
+		switch (token[0] >> 4) {
+			case 0:
+				len = ((token[0] << 4) | (token[1] >> 4)) + 0x11;
+				offs = (((token[1] & 0xF) << 8) | token[2]) + 1;
+				break;
+			case 1:
+				len = (((token[0] & 0xF) << 12) | (token[1] << 4) | (token[2] >> 4)) + 0x111;
+				offs = (((token[2] & 0xF) << 8) | token[3]) + 1;
+				break;
+			default:
+				len = (token[0] >> 4) + 1;
+				offs = (((token[0] & 0xF) << 8) | token[1]) + 1;
+				break;
+		}
+	}
+
+	//matches may not reach before the start of the stream, and stop at its end
+	if (offs > decompressor->writePos - decompressor->streamStart) {
+		decompressor->state = DECOMPRESSOR_ERROR;
+		return;
+	}
+	if (len > decompressor->streamEnd - decompressor->writePos) len = decompressor->streamEnd - decompressor->writePos;
+	decompressor->copyLength = len;
+	decompressor->copyDistance = offs;
+}
+
+//advance the state machine by one input byte. There is room in the ring for at least one byte.
+static void decompressorConsume(DECOMPRESSOR *decompressor, unsigned char b) {
+	//a COMP segment's LZ stream may not run past the end of the segment
+	if (decompressor->segmentRemaining == 0) {
+		decompressor->state = DECOMPRESSOR_ERROR;
+		return;
+	}
+	if (decompressor->segmentRemaining > 0) decompressor->segmentRemaining--;
+
+	switch (decompressor->state) {
+		case DECOMPRESSOR_HEADER:
+			decompressor->buffer[decompressor->nBuffered++] = b;
+			if (decompressor->nBuffered == decompressor->nNeeded) decompressorReadHeader(decompressor);
+			break;
+		case DECOMPRESSOR_COMP_SIZES:
+			decompressor->buffer[decompressor->nBuffered++] = b;
+			if (decompressor->nBuffered == 4) {
+				decompressor->segmentSizes[decompressor->segment++] = *(int32_t *) decompressor->buffer;
+				decompressor->nBuffered = 0;
+				if (decompressor->segment == decompressor->nSegments) {
+					decompressor->segment = 0;
+					decompressorNextSegment(decompressor);
+				}
+			}
+			break;
+		case DECOMPRESSOR_RAW:
+			decompressorPut(decompressor, b);
+			if (decompressor->segmentRemaining == 0) decompressorNextSegment(decompressor);
+			break;
+		case DECOMPRESSOR_SKIP:
+			if (decompressor->segmentRemaining == 0) decompressorNextSegment(decompressor);
+			break;
+		case DECOMPRESSOR_LZ_HEADER:
+			decompressor->buffer[decompressor->nBuffered++] = b;
+			if (decompressor->nBuffered == 4) decompressorReadLzHeader(decompressor);
+			break;
+		case DECOMPRESSOR_LZ_FLAGS:
+			decompressor->flags = b;
+			decompressor->nFlags = 8;
+			decompressor->nBuffered = 0;
+			decompressor->state = DECOMPRESSOR_LZ_TOKEN;
+			break;
+		case DECOMPRESSOR_LZ_TOKEN:
+			if (!(decompressor->flags & 0x80)) {
+				decompressorPut(decompressor, b);
+				if (decompressor->writePos == decompressor->streamEnd) {
+					decompressorStreamFinished(decompressor);
+					break;
+				}
+			} else {
+				decompressor->buffer[decompressor->nBuffered++] = b;
+				if (decompressor->nBuffered == 1) {
+					int mode = b >> 4;
+					decompressor->nNeeded = 2;
+					if (decompressor->lz11 && mode == 0) decompressor->nNeeded = 3;
+					if (decompressor->lz11 && mode == 1) decompressor->nNeeded = 4;
+				}
+				if (decompressor->nBuffered < decompressor->nNeeded) break;
+
+				decompressorReadMatch(decompressor);
+				decompressor->nBuffered = 0;
+				if (decompressor->state == DECOMPRESSOR_ERROR) break;
+			}
+
+			decompressor->flags <<= 1;
+			if (--decompressor->nFlags == 0) decompressor->state = DECOMPRESSOR_LZ_FLAGS;
+			break;
+		case DECOMPRESSOR_HUFF_TREE:
+			if (decompressor->treeSize == 0) decompressor->nNeeded = (b + 1) << 1;
+			decompressor->tree[decompressor->treeSize++] = b;
+			if (decompressor->treeSize < decompressor->nNeeded) break;
+
+			decompressor->huffmanLookup = malloc((1 << HUFFMAN_LOOKUP_BITS) * sizeof(HUFFMAN_LOOKUP));
+			if (!huffmanBuildLookup(decompressor->tree, decompressor->treeSize, (HUFFMAN_LOOKUP *) decompressor->huffmanLookup)) {
+				decompressor->state = DECOMPRESSOR_ERROR;
+				break;
+			}
+			decompressor->trOffs = 1;
+			decompressor->nBuffered = 0;
+			decompressor->state = decompressor->size == 0 ? DECOMPRESSOR_DONE : DECOMPRESSOR_HUFF_DATA;
+			break;
+		case DECOMPRESSOR_HUFF_DATA:
+			decompressor->buffer[decompressor->nBuffered++] = b;
+			if (decompressor->nBuffered == 4) {
+				decompressor->bits = ((uint64_t) *(uint32_t *) decompressor->buffer) << 32;
+				decompressor->nBits = 32;
+				decompressor->nBuffered = 0;
+			}
+			break;
+	}
+}
+
+int decompressorFeed(DECOMPRESSOR *decompressor, unsigned char *data, int size) {
+	int consumed = 0;
+	while (1) {
+		int canConsume = decompressorFlush(decompressor);
+		if (decompressor->state == DECOMPRESSOR_ERROR) return -1;
+		if (decompressor->state == DECOMPRESSOR_DONE) return size; //trailing padding
+		if (!canConsume || consumed >= size) break;
+
+		decompressorConsume(decompressor, data[consumed++]);
+	}
+	return consumed;
+}
+
+int decompressorPull(DECOMPRESSOR *decompressor, unsigned char *dest, int size) {
+	int nPulled = 0;
+	while (nPulled < size && decompressor->readPos != decompressor->writePos) {
+		//copy up to the end of the ring, then wrap around
+		unsigned int start = decompressor->readPos & decompressor->ringMask;
+		unsigned int count = decompressor->writePos - decompressor->readPos;
+		if (count > decompressor->ringMask + 1 - start) count = decompressor->ringMask + 1 - start;
+		if (count > (unsigned int) (size - nPulled)) count = size - nPulled;
+
+		memcpy(dest + nPulled, decompressor->ring + start, count);
+		decompressor->readPos += count;
+		nPulled += count;
+	}
+
+	//the freed space lets pending output continue
+	if (decompressor->state != DECOMPRESSOR_ERROR) decompressorFlush(decompressor);
+	return nPulled;
+}
+
+int decompressorIsFinished(DECOMPRESSOR *decompressor) {
+	return decompressor->state == DECOMPRESSOR_DONE && decompressor->readPos == decompressor->writePos;
+}
+
+int decompressorHasError(DECOMPRESSOR *decompressor) {
+	return decompressor->state == DECOMPRESSOR_ERROR;
+}
+
 int getCompressionType(char *buffer, int size) {
 	if (lz77HeaderIsCompressed(buffer, size)) return COMPRESSION_LZ77_HEADER;
 	if (lz77IsCompressed(buffer, size)) return COMPRESSION_LZ77;
@@ -894,6 +1699,88 @@ char *decompress(char *buffer, int size, int *uncompressedSize) {
 	return NULL;
 }
 
+//compression types tried by compressAuto, in order of preference when sizes tie
+static const int compressionAutoCandidates[] = {
+	COMPRESSION_LZ77,
+	COMPRESSION_LZ11,
+	COMPRESSION_LZ77_OPTIMAL,
+	COMPRESSION_LZ11_OPTIMAL,
+	COMPRESSION_LZ11_COMP_HEADER,
+	COMPRESSION_LZ77_HEADER,
+	COMPRESSION_HUFFMAN_4,
+	COMPRESSION_HUFFMAN_8
+};
+
+#define COMPRESSION_AUTO_N_CANDIDATES ((int) (sizeof(compressionAutoCandidates) / sizeof(*compressionAutoCandidates)))
+
+typedef struct COMPRESSION_AUTO_RESULT_ {
+	char *buffer;       //source buffer
+	int size;           //source size
+	char *compressed;   //compressed buffer, NULL if not valid
+	int compressedSize;
+} COMPRESSION_AUTO_RESULT;
+
+static int compressAutoDetectedType(int compression) {
+	//getCompressionType can't tell optimally parsed streams from greedy ones
+	switch (compression) {
+		case COMPRESSION_LZ77_OPTIMAL:
+			return COMPRESSION_LZ77;
+		case COMPRESSION_LZ11_OPTIMAL:
+			return COMPRESSION_LZ11;
+	}
+	return compression;
+}
+
+static void compressAutoCandidate(void *param, int index, int threadIndex) {
+	COMPRESSION_AUTO_RESULT *result = ((COMPRESSION_AUTO_RESULT *) param) + index;
+	result->compressed = compress(result->buffer, result->size, compressionAutoCandidates[index], &result->compressedSize);
+	if (result->compressed == NULL) return;
+
+	//the result must be detected as the right type and decompress back to the input
+	int uncompressedSize = 0;
+	char *check = NULL;
+	int expectedType = compressAutoDetectedType(compressionAutoCandidates[index]);
+	if (getCompressionType(result->compressed, result->compressedSize) == expectedType) {
+		check = decompress(result->compressed, result->compressedSize, &uncompressedSize);
+	}
+	if (check == NULL || uncompressedSize != result->size || memcmp(check, result->buffer, result->size) != 0) {
+		free(result->compressed);
+		result->compressed = NULL;
+	}
+	if (check != NULL) free(check);
+}
+
+char *compressAuto(char *buffer, int size, int *compressedSize, int *compressionUsed) {
+	COMPRESSION_AUTO_RESULT results[COMPRESSION_AUTO_N_CANDIDATES];
+	for (int i = 0; i < COMPRESSION_AUTO_N_CANDIDATES; i++) {
+		results[i].buffer = buffer;
+		results[i].size = size;
+		results[i].compressed = NULL;
+		results[i].compressedSize = 0;
+	}
+	parallelFor(COMPRESSION_AUTO_N_CANDIDATES, compressAutoCandidate, results);
+
+	//keep the smallest, free the rest
+	int best = -1;
+	for (int i = 0; i < COMPRESSION_AUTO_N_CANDIDATES; i++) {
+		if (results[i].compressed == NULL) continue;
+		if (best == -1 || results[i].compressedSize < results[best].compressedSize) best = i;
+	}
+	for (int i = 0; i < COMPRESSION_AUTO_N_CANDIDATES; i++) {
+		if (i != best && results[i].compressed != NULL) free(results[i].compressed);
+	}
+
+	//nothing round trips, store uncompressed
+	if (best == -1) {
+		if (compressionUsed != NULL) *compressionUsed = COMPRESSION_NONE;
+		return compress(buffer, size, COMPRESSION_NONE, compressedSize);
+	}
+
+	if (compressionUsed != NULL) *compressionUsed = compressionAutoCandidates[best];
+	*compressedSize = results[best].compressedSize;
+	return results[best].compressed;
+}
+
 char *compress(char *buffer, int size, int compression, int *compressedSize) {
 	switch (compression) {
 		case COMPRESSION_NONE:
@@ -915,6 +1802,12 @@ char *compress(char *buffer, int size, int compression, int *compressedSize) {
 			return huffman8Compress(buffer, size, compressedSize);
 		case COMPRESSION_LZ77_HEADER:
 			return lz77HeaderCompress(buffer, size, compressedSize);
+		case COMPRESSION_LZ77_OPTIMAL:
+			return lz77compressOptimal(buffer, size, compressedSize);
+		case COMPRESSION_LZ11_OPTIMAL:
+			return lz11compressOptimal(buffer, size, compressedSize);
+		case COMPRESSION_AUTO:
+			return compressAuto(buffer, size, compressedSize, NULL);
 	}
 	return NULL;
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #pragma once
+#include <stdint.h>
 
 #define COMPRESSION_NONE             0
 #define COMPRESSION_LZ77             1
@@ -7,6 +8,14 @@
 #define COMPRESSION_HUFFMAN_4        4
 #define COMPRESSION_HUFFMAN_8        5
 #define COMPRESSION_LZ77_HEADER      6
+#define COMPRESSION_LZ77_OPTIMAL     7
+#define COMPRESSION_LZ11_OPTIMAL     8
+#define COMPRESSION_AUTO             9  //smallest of the compression types that round trip
+
+//effort levels for the LZ match finder
+#define LZ_EFFORT_FAST               0
+#define LZ_EFFORT_NORMAL             1
+#define LZ_EFFORT_MAX                2
 
 //----- LZ77 functions
 
@@ -44,6 +53,25 @@ char *lz77decompress(char *buffer, int size, unsigned int *uncompressedSize);
 char *lz77compress(char *buffer, int size, unsigned int *compressedSize);
 
 
+/******************************************************************************\
+*
+* Compresses a buffer with LZ77 using the specified match finder effort. At
+* LZ_EFFORT_MAX the whole window is searched, and the output is the same as
+* that of lz77compress. Lower effort levels test fewer candidate matches.
+*
+* Parameters:
+*	buffer					the buffer to compress
+*	size					size of the buffer
+*	compressedSize			pointer that receives the compressed size
+*	effort					one of the LZ_EFFORT_* constants
+*
+* Returns:
+*	A pointer to the compressed buffer on success, or NULL on failure.
+*
+\******************************************************************************/
+char *lz77compressEx(char *buffer, int size, unsigned int *compressedSize, int effort);
+
+
 /******************************************************************************\
 *
 * Determines whether the input buffer contains valid LZ77 compressed data.
@@ -59,6 +87,24 @@ char *lz77compress(char *buffer, int size, unsigned int *compressedSize);
 \******************************************************************************/
 int lz77IsCompressed(char *buffer, unsigned int size);
 
+
+/******************************************************************************\
+*
+* Compresses a buffer with LZ77, choosing the sequence of literals and matches
+* that gives the smallest output rather than always taking the longest match.
+* This is slower than lz77compress.
+*
+* Parameters:
+*	buffer					the buffer to compress
+*	size					size of the buffer
+*	compressedSize			pointer that receives the compressed size
+*
+* Returns:
+*	A pointer to the compressed buffer on success, or NULL on failure.
+*
+\******************************************************************************/
+char *lz77compressOptimal(char *buffer, int size, unsigned int *compressedSize);
+
 //----- LZ11 functions
 
 /******************************************************************************\
@@ -95,6 +141,25 @@ char *lz11decompress(char *buffer, int size, int *uncompressedSize);
 char *lz11compress(char *buffer, int size, int *compressedSize);
 
 
+/******************************************************************************\
+*
+* Compresses a buffer with LZ11 using the specified match finder effort. At
+* LZ_EFFORT_MAX the whole window is searched, and the output is the same as
+* that of lz11compress. Lower effort levels test fewer candidate matches.
+*
+* Parameters:
+*	buffer					the buffer to compress
+*	size					size of the buffer
+*	compressedSize			pointer that receives the compressed size
+*	effort					one of the LZ_EFFORT_* constants
+*
+* Returns:
+*	A pointer to the compressed buffer on success, or NULL on failure.
+*
+\******************************************************************************/
+char *lz11compressEx(char *buffer, int size, int *compressedSize, int effort);
+
+
 /******************************************************************************\
 *
 * Determines whether the input buffer contains valid LZ11 compressed data.
@@ -110,6 +175,24 @@ char *lz11compress(char *buffer, int size, int *compressedSize);
 \******************************************************************************/
 int lz11IsCompressed(char *buffer, unsigned size);
 
+
+/******************************************************************************\
+*
+* Compresses a buffer with LZ11, choosing the sequence of literals and matches
+* that gives the smallest output rather than always taking the longest match.
+* This is slower than lz11compress.
+*
+* Parameters:
+*	buffer					the buffer to compress
+*	size					size of the buffer
+*	compressedSize			pointer that receives the compressed size
+*
+* Returns:
+*	A pointer to the compressed buffer on success, or NULL on failure.
+*
+\******************************************************************************/
+char *lz11compressOptimal(char *buffer, int size, int *compressedSize);
+
 //----- LZ11 header functions
 
 /******************************************************************************\
@@ -269,6 +352,143 @@ char *lz77HeaderCompress(char *buffer, int size, int *compressedSize);
 \******************************************************************************/
 int lz77HeaderIsCompressed(unsigned char *buffer, unsigned size);
 
+//----- Streaming decompression
+
+//smallest ring buffer a decompressor can work with
+#define DECOMPRESSOR_MIN_RING_SIZE   0x2000
+
+//
+// State of an incremental decompression. Compressed input is passed in with
+// decompressorFeed as it becomes available, and decompressed output is taken
+// out with decompressorPull. Output is kept in a caller-supplied ring buffer,
+// so memory use does not depend on the size of the data.
+//
+typedef struct DECOMPRESSOR_ {
+	int type;                    //compression type being decoded
+	int state;
+	unsigned char *ring;         //caller-supplied output ring buffer
+	unsigned int ringMask;
+	unsigned int writePos;       //number of bytes decoded
+	unsigned int readPos;        //number of bytes pulled
+	unsigned int size;           //uncompressed size, valid when sizeKnown is set
+	int sizeKnown;
+	unsigned int streamStart;    //writePos at the start of the current LZ stream
+	unsigned int streamEnd;      //writePos at the end of the current LZ or Huffman stream
+	unsigned char buffer[16];    //header or token bytes being collected
+	int nBuffered;
+	int nNeeded;
+	int lz11;
+	unsigned char flags;         //LZ flag byte
+	int nFlags;
+	unsigned int copyLength;     //bytes of the current match left to copy
+	unsigned int copyDistance;
+	int32_t *segmentSizes;       //COMP segment sizes, negative for uncompressed segments
+	int nSegments;
+	int segment;
+	int segmentRemaining;        //input bytes left in the COMP segment, -1 outside of one
+	int symSize;                 //Huffman symbol size
+	int treeSize;
+	unsigned char tree[512];
+	void *huffmanLookup;
+	uint64_t bits;               //Huffman bits not yet decoded, from the top
+	int nBits;
+	int trOffs;                  //Huffman tree position
+	unsigned char nibble;        //first 4-bit symbol of an output byte
+	int nibbleFull;
+} DECOMPRESSOR;
+
+
+/******************************************************************************\
+*
+* Initializes a decompressor for the given compression type. LZ77, LZ11, LZ11
+* header, LZ77 header and Huffman compression are supported.
+*
+* Parameters:
+*	decompressor			the decompressor to initialize
+*	type					the type of compression to decode
+*	ring					buffer to hold decompressed output
+*	ringSize				size of the ring buffer. Must be a power of 2 and
+*							at least DECOMPRESSOR_MIN_RING_SIZE
+*
+* Returns:
+*	1 on success, or 0 if the type or ring size is not supported.
+*
+\******************************************************************************/
+int decompressorInit(DECOMPRESSOR *decompressor, int type, unsigned char *ring, int ringSize);
+
+
+/******************************************************************************\
+*
+* Frees the resources held by a decompressor. The ring buffer is not freed.
+*
+* Parameters:
+*	decompressor			the decompressor to free
+*
+\******************************************************************************/
+void decompressorFree(DECOMPRESSOR *decompressor);
+
+
+/******************************************************************************\
+*
+* Passes compressed input to a decompressor. Input is consumed until the ring
+* buffer fills up, so fewer bytes than given may be consumed; pull output and
+* feed the rest again. Feeding 0 bytes continues decoding buffered input.
+*
+* Parameters:
+*	decompressor			the decompressor
+*	data					the compressed input
+*	size					the size of the input
+*
+* Returns:
+*	The number of input bytes consumed, or -1 if the data is not valid.
+*
+\******************************************************************************/
+int decompressorFeed(DECOMPRESSOR *decompressor, unsigned char *data, int size);
+
+
+/******************************************************************************\
+*
+* Takes decompressed output out of a decompressor's ring buffer.
+*
+* Parameters:
+*	decompressor			the decompressor
+*	dest					buffer receiving the output
+*	size					the maximum number of bytes to pull
+*
+* Returns:
+*	The number of bytes written to dest.
+*
+\******************************************************************************/
+int decompressorPull(DECOMPRESSOR *decompressor, unsigned char *dest, int size);
+
+
+/******************************************************************************\
+*
+* Determines whether all output has been decoded and pulled.
+*
+* Parameters:
+*	decompressor			the decompressor
+*
+* Returns:
+*	1 if decompression is finished, 0 otherwise.
+*
+\******************************************************************************/
+int decompressorIsFinished(DECOMPRESSOR *decompressor);
+
+
+/******************************************************************************\
+*
+* Determines whether the decompressor has found invalid data.
+*
+* Parameters:
+*	decompressor			the decompressor
+*
+* Returns:
+*	1 if the input was not valid, 0 otherwise.
+*
+\******************************************************************************/
+int decompressorHasError(DECOMPRESSOR *decompressor);
+
 //----- Common functions
 
 /******************************************************************************\
@@ -317,3 +537,23 @@ char *decompress(char *buffer, int size, int *uncompressedSize);
 *
 \******************************************************************************/
 char *compress(char *buffer, int size, int compression, int *compressedSize);
+
+
+/******************************************************************************\
+*
+* Compresses a buffer with each of the compression types and keeps the smallest
+* result that is detected and decompressed correctly. If none are, the data is
+* left uncompressed.
+*
+* Parameters:
+*	buffer					the buffer to compress
+*	size					the size of the buffer
+*	compressedSize			pointer receiving the compressed size
+*	compressionUsed			pointer receiving the compression type chosen.
+*							May be NULL.
+*
+* Returns:
+*	A buffer containing the compressed data.
+*
+\******************************************************************************/
+char *compressAuto(char *buffer, int size, int *compressedSize, int *compressionUsed);
@@ -9,7 +9,7 @@
 #include "gdip.h"
 #include "g2dfile.h"
 
-LPCWSTR compressionNames[] = { L"None", L"LZ77", L"LZ11", L"LZ11 COMP", L"Huffman 4", L"Huffman 8", L"LZ77 Header", NULL };
+LPCWSTR compressionNames[] = { L"None", L"LZ77", L"LZ11", L"LZ11 COMP", L"Huffman 4", L"Huffman 8", L"LZ77 Header", L"LZ77 (Optimal)", L"LZ11 (Optimal)", L"Auto (Smallest)", NULL };
 
 int pathEndsWith(LPCWSTR str, LPCWSTR substr) {
 	if (wcslen(substr) > wcslen(str)) return 0;
@@ -202,10 +202,121 @@ int fileGuessPltChrScr(unsigned char *ptr, int size) {
 	return FILE_TYPE_CHAR;
 }
 
+static int fileGetG2dType(unsigned int magic) {
+	switch (magic) {
+		case 'NCLR':
+		case 'RLCN':
+		case 'NCCL':
+		case 'LCCN':
+		case 'NTPL':
+		case 'LPTN':
+		case 'NTPC':
+		case 'CPTN':
+			return FILE_TYPE_PALETTE;
+		case 'NCGR':
+		case 'RGCN':
+		case 'NCCG':
+		case 'GCCN':
+			return FILE_TYPE_CHARACTER;
+		case 'NSCR':
+		case 'RCSN':
+		case 'NCSC':
+		case 'CSCN':
+			return FILE_TYPE_SCREEN;
+		case 'NCER':
+		case 'RECN':
+			return FILE_TYPE_CELL;
+		case 'BTX0':
+		case '0XTB':
+		case 'BMD0':
+		case '0DMB':
+			return FILE_TYPE_NSBTX;
+		case 'NANR':
+		case 'RNAN':
+			return FILE_TYPE_NANR;
+		case 'NMCR':
+		case 'RCMN':
+			return FILE_TYPE_NMCR;
+	}
+	return FILE_TYPE_INVALID;
+}
+
+//
+// Read from a decompressor, feeding it compressed input as needed. If dest is
+// NULL, the output is skipped. Returns the number of bytes read.
+//
+static int fileDecompressorRead(DECOMPRESSOR *decompressor, char *file, int size, int *inPos, unsigned char *dest, int nBytes) {
+	unsigned char skipBuffer[0x400];
+	int nRead = 0;
+	while (nRead < nBytes) {
+		int nConsumed = decompressorFeed(decompressor, (unsigned char *) file + *inPos, size - *inPos);
+		if (nConsumed < 0) break;
+		*inPos += nConsumed;
+
+		int nWanted = nBytes - nRead;
+		if (dest == NULL && nWanted > (int) sizeof(skipBuffer)) nWanted = (int) sizeof(skipBuffer);
+		int nPulled = decompressorPull(decompressor, dest == NULL ? skipBuffer : dest + nRead, nWanted);
+		if (nPulled == 0 && nConsumed == 0) break;
+		nRead += nPulled;
+	}
+	return nRead;
+}
+
+//
+// Identify a compressed G2D file as it is decompressed. Only the file header
+// and section headers are kept, so the decompressed file is never held in
+// memory. Returns FILE_TYPE_INVALID if it is not a G2D file of a known type.
+//
+static int fileIdentifyCompressedG2d(char *file, int size, int compression) {
+	unsigned char ring[DECOMPRESSOR_MIN_RING_SIZE];
+	DECOMPRESSOR decompressor;
+	if (!decompressorInit(&decompressor, compression, ring, sizeof(ring))) return FILE_TYPE_INVALID;
+
+	int inPos = 0, type = FILE_TYPE_INVALID;
+	unsigned char header[0x10];
+	if (fileDecompressorRead(&decompressor, file, size, &inPos, header, sizeof(header)) == (int) sizeof(header)) {
+		//same checks as g2dIsValid
+		unsigned int totalSize = decompressor.size;
+		uint16_t endianness = *(uint16_t *) (header + 4);
+		uint32_t fileSize = *(uint32_t *) (header + 8);
+		uint16_t headerSize = *(uint16_t *) (header + 0xC);
+		int nSections = *(uint16_t *) (header + 0xE);
+		if ((endianness == 0xFFFE || endianness == 0xFEFF) && (fileSize == totalSize || ((fileSize + 3) & ~3) == totalSize)
+			&& headerSize >= 0x10) {
+			type = fileGetG2dType(*(unsigned int *) header);
+		}
+
+		//walk the section headers as they are decoded
+		unsigned int pos = sizeof(header), offset = headerSize;
+		for (int i = 0; i < nSections && type != FILE_TYPE_INVALID; i++) {
+			unsigned char sectionHeader[8];
+			if (offset + 8 > totalSize || offset < pos) {
+				type = FILE_TYPE_INVALID;
+				break;
+			}
+			if (fileDecompressorRead(&decompressor, file, size, &inPos, NULL, offset - pos) != (int) (offset - pos)
+				|| fileDecompressorRead(&decompressor, file, size, &inPos, sectionHeader, 8) != 8) {
+				type = FILE_TYPE_INVALID;
+				break;
+			}
+			pos = offset + 8;
+			offset += *(uint32_t *) (sectionHeader + 4);
+		}
+	}
+
+	decompressorFree(&decompressor);
+	return type;
+}
+
 int fileIdentify(char *file, int size, LPCWSTR path) {
 	char *buffer = file;
 	int bufferSize = size;
-	if (getCompressionType(file, size) != COMPRESSION_NONE) {
+	int compression = getCompressionType(file, size);
+	if (compression != COMPRESSION_NONE) {
+		//G2D files can be identified without decompressing them whole
+		int type = fileIdentifyCompressedG2d(file, size, compression);
+		if (type != FILE_TYPE_INVALID) return type;
+
 		buffer = decompress(file, size, &bufferSize);
 	}
 
@@ -213,49 +324,7 @@ int fileIdentify(char *file, int size, LPCWSTR path) {
 
 	//test Nitro formats
 	if (g2dIsValid(buffer, bufferSize)) {
-		unsigned int magic = *(unsigned int *) buffer;
-		switch (magic) {
-			case 'NCLR':
-			case 'RLCN':
-			case 'NCCL':
-			case 'LCCN':
-			case 'NTPL':
-			case 'LPTN':
-			case 'NTPC':
-			case 'CPTN':
-				type = FILE_TYPE_PALETTE;
-				break;
-			case 'NCGR':
-			case 'RGCN':
-			case 'NCCG':
-			case 'GCCN':
-				type = FILE_TYPE_CHARACTER;
-				break;
-			case 'NSCR':
-			case 'RCSN':
-			case 'NCSC':
-			case 'CSCN':
-				type = FILE_TYPE_SCREEN;
-				break;
-			case 'NCER':
-			case 'RECN':
-				type = FILE_TYPE_CELL;
-				break;
-			case 'BTX0':
-			case '0XTB':
-			case 'BMD0':
-			case '0DMB':
-				type = FILE_TYPE_NSBTX;
-				break;
-			case 'NANR':
-			case 'RNAN':
-				type = FILE_TYPE_NANR;
-				break;
-			case 'NMCR':
-			case 'RCMN':
-				type = FILE_TYPE_NMCR;
-				break;
-		}
+		type = fileGetG2dType(*(unsigned int *) buffer);
 	}
 	
 	//no matches?
@@ -390,6 +459,7 @@ int fileRead(LPCWSTR name, OBJECT_HEADER *object, OBJECT_READER reader) {
 		status = reader(object, decompressed, decompressedSize);
 		free(decompressed);
 		object->compression = compType;
+		object->compressionUsed = compType;
 	}
 
 	free(buffer);
@@ -402,8 +472,9 @@ int fileWrite(LPCWSTR name, OBJECT_HEADER *object, OBJECT_WRITER writer) {
 	int status = writer(object, &stream);
 
 	if (status == 0) {
+		object->compressionUsed = COMPRESSION_NONE;
 		if (object->compression != COMPRESSION_NONE) {
-			bstreamCompress(&stream, object->compression, 0, 0);
+			bstreamCompressEx(&stream, object->compression, 0, 0, &object->compressionUsed);
 		}
 
 		DWORD dwWritten;
@@ -21,6 +21,7 @@ typedef struct OBJECT_HEADER_ {
 	int type;
 	int format;
 	int compression;
+	int compressionUsed; //type the file was last read or written with, resolves COMPRESSION_AUTO
 	void (*dispose) (struct OBJECT_HEADER_ *);
 } OBJECT_HEADER;
 
@@ -1,9 +1,18 @@
 #include <math.h>
 #include <stdint.h>
+#include <stddef.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#define ISPLT_SSE2
+#include <intrin.h>
+#include <emmintrin.h>
+#endif
 
 #include "color.h"
 #include "palette.h"
 #include "analysis.h"
+#include "parallel.h"
+#include "palsearch.h"
 
 //struct for internal processing of color leaves
 typedef struct {
@@ -16,8 +25,7 @@ typedef struct {
 	double weight;
 } COLOR_INFO; 
 
-void initReduction(REDUCTION *reduction, int balance, int colorBalance, int optimization, int enhanceColors, unsigned int nColors) {
-	memset(reduction, 0, sizeof(REDUCTION));
+static void reductionSetParameters(REDUCTION *reduction, int balance, int colorBalance, int optimization, int enhanceColors, unsigned int nColors) {
 	reduction->yWeight = 60 - balance;
 	reduction->iWeight = colorBalance;
 	reduction->optimization = optimization;
@@ -27,74 +35,102 @@ void initReduction(REDUCTION *reduction, int balance, int colorBalance, int opti
 	reduction->nPaletteColors = nColors;
 	reduction->gamma = 1.27;
 	reduction->maskColors = TRUE;
+}
+
+void initReduction(REDUCTION *reduction, int balance, int colorBalance, int optimization, int enhanceColors, unsigned int nColors) {
+	memset(reduction, 0, sizeof(REDUCTION));
+	reductionSetParameters(reduction, balance, colorBalance, optimization, enhanceColors, nColors);
 
 	for (int i = 0; i < 512; i++) {
 		reduction->lumaTable[i] = pow((double) i / 511.0, 1.27) * 511.0;
 	}
 }
 
-void *allocateEntry(ALLOCATOR *allocator, int size) {
-	if (allocator->allocation == NULL) {
-		allocator->allocation = calloc(0x100000, 1);
-		allocator->nextEntryOffset = 0;
+static __inline uint32_t histogramHash(int y, int i, int q, int a) {
+	uint32_t key = y | ((i + 320) << 9) | ((q + 270) << 19);
+	uint32_t hash = key * 0x9E3779B1 ^ a * 0x85EBCA6B;
+	hash ^= hash >> 15;
+	hash *= 0x2C1B3C6D;
+	hash ^= hash >> 12;
+	return hash;
+}
+
+static HISTOGRAM *histogramCreate(int nExpectedEntries) {
+	HISTOGRAM *histogram = (HISTOGRAM *) calloc(1, sizeof(HISTOGRAM));
+
+	//size for the expected number of colors, within reason. It grows if needed.
+	nExpectedEntries = min(max(nExpectedEntries, 8), 0x8000);
+	histogram->tableSize = 16;
+	while (histogram->tableSize < nExpectedEntries * 2) histogram->tableSize <<= 1;
+	histogram->table = (int *) calloc(histogram->tableSize, sizeof(int));
+	histogram->maxEntries = nExpectedEntries;
+	histogram->entries = (HIST_ENTRY *) calloc(histogram->maxEntries, sizeof(HIST_ENTRY));
+	return histogram;
+}
+
+static void histogramGrowTable(HISTOGRAM *histogram) {
+	free(histogram->table);
+	histogram->tableSize <<= 1;
+	histogram->table = (int *) calloc(histogram->tableSize, sizeof(int));
+
+	int mask = histogram->tableSize - 1;
+	for (int i = 0; i < histogram->nEntries; i++) {
+		HIST_ENTRY *entry = histogram->entries + i;
+		int slot = histogramHash(entry->y, entry->i, entry->q, entry->a) & mask;
+		while (histogram->table[slot]) slot = (slot + 1) & mask;
+		histogram->table[slot] = i + 1;
 	}
-	while (allocator->nextEntryOffset + size > 0x100000) {
-		if (allocator->next == NULL) {
-			ALLOCATOR *next = calloc(1, sizeof(ALLOCATOR));
-			next->allocation = calloc(0x100000, 1);
-			next->nextEntryOffset = 0;
-			allocator->next = next;
-		}
-		allocator = allocator->next;
+}
+
+static void histogramClear(HISTOGRAM *histogram) {
+	//only clear slots in use. Going from the last entry back, every probe sequence stays intact.
+	int mask = histogram->tableSize - 1;
+	for (int i = histogram->nEntries - 1; i >= 0; i--) {
+		HIST_ENTRY *entry = histogram->entries + i;
+		int slot = histogramHash(entry->y, entry->i, entry->q, entry->a) & mask;
+		while (histogram->table[slot] != i + 1) slot = (slot + 1) & mask;
+		histogram->table[slot] = 0;
 	}
-	void *res = (void *) (((uintptr_t) allocator->allocation) + allocator->nextEntryOffset);
-	allocator->nextEntryOffset += size;
-	return res;
+	histogram->nEntries = 0;
+}
+
+static void histogramFree(HISTOGRAM *histogram) {
+	free(histogram->entries);
+	free(histogram->table);
+	free(histogram);
 }
 
 void histogramAddColor(HISTOGRAM *histogram, int y, int i, int q, int a, double weight) {
 	if (a == 0) return;
-	int slotIndex = (q + (y * 64 + i) * 4 + 0x60E + a) & 0x1FFFF;
-	if (slotIndex < histogram->firstSlot) histogram->firstSlot = slotIndex;
-
-	HIST_ENTRY *slot = histogram->entries[slotIndex];
+	if ((histogram->nEntries + 1) * 2 > histogram->tableSize) histogramGrowTable(histogram);
 
 	//find a slot with the same YIQA, or create a new one if none exists.
-	if (slot == NULL) {
-		slot = (HIST_ENTRY *) allocateEntry(&histogram->allocator, sizeof(HIST_ENTRY));
-		slot->y = y;
-		slot->i = i;
-		slot->q = q;
-		slot->a = a;
-		slot->weight = weight;
-		slot->next = NULL;
-		slot->value = 0.0;
-		histogram->entries[slotIndex] = slot;
-		histogram->nEntries++;
-		return;
-	}
-	while (1) {
-		if (slot->y == y && slot->i == i && slot->q == q && slot->a == a) {
-			slot->weight += weight;
-			return;
-		}
-
-		if (slot->next == NULL) {
-			slot->next = (HIST_ENTRY *) allocateEntry(&histogram->allocator, sizeof(HIST_ENTRY));
-			slot = slot->next;
-
-			slot->y = y;
-			slot->i = i;
-			slot->q = q;
-			slot->a = a;
-			slot->weight = weight;
-			slot->next = NULL;
-			slot->value = 0.0;
-			histogram->nEntries++;
+	int mask = histogram->tableSize - 1;
+	int slot = histogramHash(y, i, q, a) & mask;
+	while (histogram->table[slot]) {
+		HIST_ENTRY *entry = histogram->entries + histogram->table[slot] - 1;
+		if (entry->y == y && entry->i == i && entry->q == q && entry->a == a) {
+			entry->weight += weight;
 			return;
 		}
-		slot = slot->next;
-	}
+		slot = (slot + 1) & mask;
+	}
+
+	if (histogram->nEntries == histogram->maxEntries) {
+		histogram->maxEntries *= 2;
+		histogram->entries = (HIST_ENTRY *) realloc(histogram->entries, histogram->maxEntries * sizeof(HIST_ENTRY));
+	}
+	HIST_ENTRY *entry = histogram->entries + histogram->nEntries;
+	entry->y = y;
+	entry->i = i;
+	entry->q = q;
+	entry->a = a;
+	entry->slot = (q + (y * 64 + i) * 4 + 0x60E + a) & 0x1FFFF;
+	entry->entry = 0;
+	entry->weight = weight;
+	entry->value = 0.0;
+	histogram->nEntries++;
+	histogram->table[slot] = histogram->nEntries;
 }
 
 void rgbToYiq(COLOR32 rgb, int *yiq) {
@@ -187,6 +223,198 @@ void yiqToRgb(int *rgb, int *yiq) {
 	rgb[2] = b;
 }
 
+#ifdef ISPLT_SSE2
+
+//The SSE2 conversions run the same double arithmetic as rgbToYiq and yiqToRgb,
+//in the same order, two colors at a time. Branches become masked selects, and
+//the integer clamps are applied before truncation, which gives the same values
+//since every bound is a whole number.
+
+static __inline __m128d sse2Select(__m128d mask, __m128d a, __m128d b) {
+	return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+
+static __inline __m128d sse2RoundHalfAway(__m128d x) {
+	//adds half away from zero, so truncating afterwards rounds as rgbToYiq does
+	__m128d half = sse2Select(_mm_cmplt_pd(x, _mm_setzero_pd()), _mm_set1_pd(-0.5), _mm_set1_pd(0.5));
+	return _mm_add_pd(x, half);
+}
+
+static __inline __m128i sse2TruncateClamp(__m128d x, double low, double high) {
+	return _mm_cvttpd_epi32(_mm_min_pd(_mm_max_pd(x, _mm_set1_pd(low)), _mm_set1_pd(high)));
+}
+
+static void rgbToYiqSse2(const COLOR32 *rgb, int nColors, int *yiq, int *outY, int *outI, int *outQ, int *outA) {
+	//writes interleaved YIQA when yiq is not NULL, otherwise separate planes. nColors must be even.
+	__m128i byteMask = _mm_set1_epi32(0xFF);
+	__m128d zero = _mm_setzero_pd(), two = _mm_set1_pd(2.0), third = _mm_set1_pd(0.3333333);
+	__m128d c245 = _mm_set1_pd(245.0), c215 = _mm_set1_pd(215.0), c265 = _mm_set1_pd(265.0);
+
+	for (int n = 0; n < nColors; n += 2) {
+		__m128i px = _mm_loadl_epi64((const __m128i *) (rgb + n));
+		__m128d r = _mm_cvtepi32_pd(_mm_and_si128(px, byteMask));
+		__m128d g = _mm_cvtepi32_pd(_mm_and_si128(_mm_srli_epi32(px, 8), byteMask));
+		__m128d b = _mm_cvtepi32_pd(_mm_and_si128(_mm_srli_epi32(px, 16), byteMask));
+
+		__m128d y = _mm_mul_pd(two, _mm_add_pd(_mm_add_pd(_mm_mul_pd(r, _mm_set1_pd(0.29900)), _mm_mul_pd(g, _mm_set1_pd(0.58700))), _mm_mul_pd(b, _mm_set1_pd(0.11400))));
+		__m128d i = _mm_mul_pd(two, _mm_sub_pd(_mm_sub_pd(_mm_mul_pd(r, _mm_set1_pd(0.59604)), _mm_mul_pd(g, _mm_set1_pd(0.27402))), _mm_mul_pd(b, _mm_set1_pd(0.32203))));
+		__m128d q = _mm_mul_pd(two, _mm_add_pd(_mm_sub_pd(_mm_mul_pd(r, _mm_set1_pd(0.21102)), _mm_mul_pd(g, _mm_set1_pd(0.52204))), _mm_mul_pd(b, _mm_set1_pd(0.31103))));
+
+		__m128d iCopy = sse2Select(_mm_cmpgt_pd(i, c245), _mm_add_pd(_mm_mul_pd(_mm_mul_pd(two, _mm_sub_pd(i, c245)), third), c245), i);
+		q = sse2Select(_mm_cmplt_pd(q, _mm_set1_pd(-215.0)), _mm_sub_pd(_mm_mul_pd(_mm_mul_pd(two, _mm_add_pd(q, c215)), third), c215), q);
+
+		__m128d iqDiff = _mm_sub_pd(q, iCopy);
+		__m128d shiftMask = _mm_cmpgt_pd(iqDiff, c265);
+		__m128d iqDiffShifted = _mm_mul_pd(_mm_sub_pd(iqDiff, c265), _mm_set1_pd(0.25));
+		iCopy = sse2Select(shiftMask, _mm_add_pd(iCopy, iqDiffShifted), iCopy);
+		q = sse2Select(shiftMask, _mm_sub_pd(q, iqDiffShifted), q);
+
+		__m128d plainMask = _mm_or_pd(_mm_cmpge_pd(iCopy, zero), _mm_cmple_pd(q, zero));
+		__m128d negProd = _mm_xor_pd(_mm_mul_pd(q, iCopy), _mm_set1_pd(-0.0));
+		__m128d iqProd = sse2Select(plainMask, y, _mm_add_pd(_mm_mul_pd(negProd, _mm_set1_pd(0.00195313)), y));
+
+		__m128i yInt = sse2TruncateClamp(_mm_add_pd(iqProd, _mm_set1_pd(0.5)), 0.0, 511.0);
+		__m128i iInt = sse2TruncateClamp(sse2RoundHalfAway(i), -320.0, 319.0);
+		__m128i qInt = sse2TruncateClamp(sse2RoundHalfAway(q), -270.0, 269.0);
+		__m128i aInt = _mm_srli_epi32(px, 24);
+
+		if (yiq != NULL) {
+			__m128i yi = _mm_unpacklo_epi32(yInt, iInt);
+			__m128i qa = _mm_unpacklo_epi32(qInt, aInt);
+			_mm_storeu_si128((__m128i *) (yiq + n * 4), _mm_unpacklo_epi64(yi, qa));
+			_mm_storeu_si128((__m128i *) (yiq + n * 4 + 4), _mm_unpackhi_epi64(yi, qa));
+		} else {
+			_mm_storel_epi64((__m128i *) (outY + n), yInt);
+			_mm_storel_epi64((__m128i *) (outI + n), iInt);
+			_mm_storel_epi64((__m128i *) (outQ + n), qInt);
+			_mm_storel_epi64((__m128i *) (outA + n), aInt);
+		}
+	}
+}
+
+static void yiqToRgbSse2(const int *yiq, int nColors, COLOR32 *rgb) {
+	//nColors must be even
+	__m128d zero = _mm_setzero_pd(), half = _mm_set1_pd(0.5);
+	__m128d c215 = _mm_set1_pd(215.0), c265 = _mm_set1_pd(265.0);
+
+	for (int n = 0; n < nColors; n += 2) {
+		__m128i p0 = _mm_loadu_si128((const __m128i *) (yiq + n * 4));
+		__m128i p1 = _mm_loadu_si128((const __m128i *) (yiq + n * 4 + 4));
+		__m128i yi = _mm_unpacklo_epi32(p0, p1);
+		__m128i qa = _mm_unpackhi_epi32(p0, p1);
+		__m128d y = _mm_cvtepi32_pd(yi);
+		__m128d i = _mm_cvtepi32_pd(_mm_srli_si128(yi, 8));
+		__m128d q = _mm_cvtepi32_pd(qa);
+
+		__m128d plainMask = _mm_or_pd(_mm_cmpge_pd(i, zero), _mm_cmple_pd(q, zero));
+		y = sse2Select(plainMask, y, _mm_add_pd(y, _mm_mul_pd(_mm_mul_pd(q, i), _mm_set1_pd(0.00195313))));
+		y = _mm_min_pd(_mm_max_pd(y, zero), _mm_set1_pd(511.0));
+
+		__m128d iqDiff = _mm_sub_pd(q, i);
+		__m128d shiftMask = _mm_cmpgt_pd(iqDiff, c265);
+		iqDiff = _mm_mul_pd(_mm_sub_pd(iqDiff, c265), half);
+		i = sse2Select(shiftMask, _mm_sub_pd(i, iqDiff), i);
+		q = sse2Select(shiftMask, _mm_add_pd(q, iqDiff), q);
+		q = sse2Select(_mm_cmplt_pd(q, _mm_set1_pd(-215.0)), _mm_sub_pd(_mm_mul_pd(_mm_mul_pd(_mm_add_pd(q, c215), _mm_set1_pd(3.0)), half), c215), q);
+
+		__m128d yHalf = _mm_mul_pd(y, half);
+		__m128d r = _mm_add_pd(_mm_add_pd(_mm_add_pd(yHalf, _mm_mul_pd(i, _mm_set1_pd(0.477791))), _mm_mul_pd(q, _mm_set1_pd(0.311426))), half);
+		__m128d g = _mm_add_pd(_mm_sub_pd(_mm_sub_pd(yHalf, _mm_mul_pd(i, _mm_set1_pd(0.136066))), _mm_mul_pd(q, _mm_set1_pd(0.324141))), half);
+		__m128d b = _mm_add_pd(_mm_add_pd(_mm_sub_pd(yHalf, _mm_mul_pd(i, _mm_set1_pd(0.552535))), _mm_mul_pd(q, _mm_set1_pd(0.852230))), half);
+
+		__m128i rInt = sse2TruncateClamp(r, 0.0, 255.0);
+		__m128i gInt = sse2TruncateClamp(g, 0.0, 255.0);
+		__m128i bInt = sse2TruncateClamp(b, 0.0, 255.0);
+		_mm_storel_epi64((__m128i *) (rgb + n), _mm_or_si128(rInt, _mm_or_si128(_mm_slli_epi32(gInt, 8), _mm_slli_epi32(bInt, 16))));
+	}
+}
+
+static int cpuHasSse2(void) {
+#ifdef _M_X64
+	return 1;
+#else
+	static int hasSse2 = -1;
+	if (hasSse2 == -1) {
+		int info[4];
+		__cpuid(info, 1);
+		hasSse2 = (info[3] >> 26) & 1;
+	}
+	return hasSse2;
+#endif
+}
+
+#endif
+
+void rgbToYiqBatch(const COLOR32 *rgb, int nColors, int *yiq) {
+	int n = 0;
+#ifdef ISPLT_SSE2
+	if (cpuHasSse2()) {
+		n = nColors & ~1;
+		rgbToYiqSse2(rgb, n, yiq, NULL, NULL, NULL, NULL);
+	}
+#endif
+	for (; n < nColors; n++) {
+		rgbToYiq(rgb[n], yiq + n * 4);
+	}
+}
+
+void rgbToYiqPlanar(const COLOR32 *rgb, int nColors, int *y, int *i, int *q, int *a) {
+	int n = 0;
+#ifdef ISPLT_SSE2
+	if (cpuHasSse2()) {
+		n = nColors & ~1;
+		rgbToYiqSse2(rgb, n, NULL, y, i, q, a);
+	}
+#endif
+	for (; n < nColors; n++) {
+		int yiq[4];
+		rgbToYiq(rgb[n], yiq);
+		y[n] = yiq[0];
+		i[n] = yiq[1];
+		q[n] = yiq[2];
+		a[n] = yiq[3];
+	}
+}
+
+void yiqToRgbBatch(const int *yiq, int nColors, COLOR32 *rgb) {
+	int n = 0;
+#ifdef ISPLT_SSE2
+	if (cpuHasSse2()) {
+		n = nColors & ~1;
+		yiqToRgbSse2(yiq, n, rgb);
+	}
+#endif
+	for (; n < nColors; n++) {
+		int dest[3];
+		yiqToRgb(dest, (int *) yiq + n * 4);
+		rgb[n] = dest[0] | (dest[1] << 8) | (dest[2] << 16);
+	}
+}
+
+//slot keys are 17 bits, sorted 9 low bits then 8 high bits
+#define HIST_SLOT_LOW_BITS  9
+#define HIST_SLOT_HIGH_BITS 8
+
+static void histEntrySortPass(HIST_ENTRY **src, HIST_ENTRY **dest, int nEntries, int shift, int nBits) {
+	//stable counting sort on one digit of the slot
+	int starts[1 << HIST_SLOT_LOW_BITS] = { 0 };
+	int mask = (1 << nBits) - 1;
+	for (int i = 0; i < nEntries; i++) {
+		starts[(src[i]->slot >> shift) & mask]++;
+	}
+
+	int total = 0;
+	for (int i = 0; i <= mask; i++) {
+		int count = starts[i];
+		starts[i] = total;
+		total += count;
+	}
+
+	for (int i = 0; i < nEntries; i++) {
+		dest[starts[(src[i]->slot >> shift) & mask]++] = src[i];
+	}
+}
+
 void flattenHistogram(REDUCTION *reduction) {
 	if (reduction->histogramFlat != NULL) free(reduction->histogramFlat);
 
@@ -195,17 +423,39 @@ void flattenHistogram(REDUCTION *reduction) {
 		return;
 	}
 
-	reduction->histogramFlat = (HIST_ENTRY **) calloc(reduction->histogram->nEntries, sizeof(HIST_ENTRY *));
-	HIST_ENTRY **pos = reduction->histogramFlat;
+	int nEntries = reduction->histogram->nEntries;
+	reduction->histogramFlat = (HIST_ENTRY **) calloc(nEntries, sizeof(HIST_ENTRY *));
+	HIST_ENTRY **scratch = (HIST_ENTRY **) calloc(nEntries, sizeof(HIST_ENTRY *));
+	for (int i = 0; i < nEntries; i++) {
+		reduction->histogramFlat[i] = reduction->histogram->entries + i;
+	}
 
-	for (int i = reduction->histogram->firstSlot; i < 0x20000; i++) {
-		HIST_ENTRY *entry = reduction->histogram->entries[i];
+	//entries are in insertion order and both passes are stable, so insertion order
+	//breaks ties in slot order
+	histEntrySortPass(reduction->histogramFlat, scratch, nEntries, 0, HIST_SLOT_LOW_BITS);
+	histEntrySortPass(scratch, reduction->histogramFlat, nEntries, HIST_SLOT_LOW_BITS, HIST_SLOT_HIGH_BITS);
+	free(scratch);
+}
 
-		while (entry != NULL) {
-			*(pos++) = entry;
-			entry = entry->next;
-		}
-	}
+//8x8 Bayer matrix. Every value 0-63 appears once, and nearby cells are far apart
+//in value, so the cells below any value are spread evenly over the block. Used
+//as dithering thresholds and as the order pixels of a block are sampled in.
+static const uint8_t g_ditherBayer8x8[8][8] = {
+	{  0, 32,  8, 40,  2, 34, 10, 42 },
+	{ 48, 16, 56, 24, 50, 18, 58, 26 },
+	{ 12, 44,  4, 36, 14, 46,  6, 38 },
+	{ 60, 28, 52, 20, 62, 30, 54, 22 },
+	{  3, 35, 11, 43,  1, 33,  9, 41 },
+	{ 51, 19, 59, 27, 49, 17, 57, 25 },
+	{ 15, 47,  7, 39, 13, 45,  5, 37 },
+	{ 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+//weight of a histogram color by the change in luma from the pixel to its left
+static __inline double histogramEdgeWeight(int dy) {
+	double weight = (double) (16 - abs(16 - abs(dy)) / 8);
+	if (weight < 1.0) weight = 1.0;
+	return weight;
 }
 
 void computeHistogram(REDUCTION *reduction, COLOR32 *img, int width, int height) {
@@ -218,57 +468,145 @@ void computeHistogram(REDUCTION *reduction, COLOR32 *img, int width, int height)
 	}
 
 	if (reduction->histogram == NULL) {
-		reduction->histogram = (HISTOGRAM *) calloc(1, sizeof(HISTOGRAM));
-		reduction->histogram->firstSlot = 0x20000;
+		reduction->histogram = histogramCreate(width * height);
 	}
 
 	for (int y = 0; y < height; y++) {
-		int yiqLeft[4];
-		rgbToYiq(img[y * width], yiqLeft);
-		int yLeft = yiqLeft[0];
-
-		for (int x = 0; x < width; x++) {
-			int yiq[4];
-			rgbToYiq(img[x + y * width], yiq);
+		int yLeft = 0;
+
+		for (int x = 0; x < width; x += 64) {
+			//convert the row a run at a time
+			int runY[64], runI[64], runQ[64], runA[64];
+			int nRun = min(width - x, 64);
+			rgbToYiqPlanar(img + x + y * width, nRun, runY, runI, runQ, runA);
+			if (x == 0) yLeft = runY[0];
+
+			for (int j = 0; j < nRun; j++) {
+				double weight = histogramEdgeWeight(runY[j] - yLeft);
+				histogramAddColor(reduction->histogram, runY[j], runI[j] & iMask, runQ[j] & qMask, runA[j], weight);
+				yLeft = runY[j];
+			}
+		}
+	}
+}
 
-			int dy = yiq[0] - yLeft;
-			double weight = (double) (16 - abs(16 - abs(dy)) / 8);
-			if (weight < 1.0) weight = 1.0;
+void computeHistogramSampled(REDUCTION *reduction, COLOR32 *img, int width, int height, int nSamples) {
+	if (nSamples >= HISTOGRAM_SAMPLES_FULL) {
+		computeHistogram(reduction, img, width, height);
+		return;
+	}
+	if (nSamples < 1) nSamples = 1;
 
-			histogramAddColor(reduction->histogram, yiq[0], yiq[1] & iMask, yiq[2] & qMask, yiq[3], weight);
-			yLeft = yiq[0];
+	int iMask = 0xFFFFFFFF, qMask = 0xFFFFFFFF;
+	if (reduction->optimization < 5) {
+		qMask = 0xFFFFFFFE;
+		if (reduction->optimization < 2) {
+			iMask = 0xFFFFFFFE;
 		}
 	}
-}
 
-void freeColorTree(COLOR_NODE *colorBlock, int freeThis) {
-	if (colorBlock->left != NULL) {
-		freeColorTree(colorBlock->left, TRUE);
-		colorBlock->left = NULL;
+	if (reduction->histogram == NULL) {
+		reduction->histogram = histogramCreate(((width + 7) / 8) * ((height + 7) / 8) * nSamples);
 	}
-	if (colorBlock->right != NULL) {
-		freeColorTree(colorBlock->right, TRUE);
-		colorBlock->right = NULL;
+
+	//positions within a block in sampling order
+	int positions[64];
+	for (int y = 0; y < 8; y++) {
+		for (int x = 0; x < 8; x++) {
+			positions[g_ditherBayer8x8[y][x]] = x + y * 8;
+		}
 	}
-	if (freeThis) {
-		free(colorBlock);
+
+	for (int blockY = 0; blockY < height; blockY += 8) {
+		for (int blockX = 0; blockX < width; blockX += 8) {
+			int blockWidth = min(width - blockX, 8), blockHeight = min(height - blockY, 8);
+
+			//shift the pattern around per block so that samples don't line up with
+			//regular patterns in the image, such as dithering.
+			uint32_t hash = ((uint32_t) blockX * 0x9E3779B1) ^ ((uint32_t) blockY * 0x85EBCA77);
+			hash ^= hash >> 15;
+			int shiftX = hash & 7, shiftY = (hash >> 3) & 7;
+
+			int samples[64], nTaken = 0;
+			for (int i = 0; i < nSamples; i++) {
+				int x = ((positions[i] & 7) + shiftX) & 7;
+				int y = ((positions[i] >> 3) + shiftY) & 7;
+				if (x < blockWidth && y < blockHeight) samples[nTaken++] = x + y * width;
+			}
+			if (nTaken == 0) samples[nTaken++] = 0; //block on the edge of the image
+
+			//each sample stands for an equal share of the block
+			double scale = (double) (blockWidth * blockHeight) / nTaken;
+			COLOR32 *block = img + blockX + blockY * width;
+			for (int i = 0; i < nTaken; i++) {
+				COLOR32 *px = block + samples[i];
+				int yiq[4];
+				rgbToYiq(*px, yiq);
+
+				//the first pixel of a row has no pixel to its left, and counts as unchanged
+				int yLeft = yiq[0];
+				if (((px - img) % width) > 0) {
+					int yiqLeft[4];
+					rgbToYiq(px[-1], yiqLeft);
+					yLeft = yiqLeft[0];
+				}
+
+				double weight = histogramEdgeWeight(yiq[0] - yLeft) * scale;
+				histogramAddColor(reduction->histogram, yiq[0], yiq[1] & iMask, yiq[2] & qMask, yiq[3], weight);
+			}
+		}
 	}
 }
 
-int getNumberOfTreeLeaves(COLOR_NODE *tree) {
-	int count = 0;
-	if (tree->left == NULL && tree->right == NULL) return 1; //doesn't necessarily have to be a leaf
+int histogramSamplesForImage(int width, int height) {
+	//keep large histograms to about HISTOGRAM_FULL_PIXELS pixels, but no fewer
+	//samples than HISTOGRAM_SAMPLES_MIN, below which palettes lose noticeably more
+	double nPx = (double) width * height;
+	if (nPx <= HISTOGRAM_FULL_PIXELS) return HISTOGRAM_SAMPLES_FULL;
+	int nSamples = (int) (HISTOGRAM_SAMPLES_FULL * HISTOGRAM_FULL_PIXELS / nPx);
+	return max(nSamples, HISTOGRAM_SAMPLES_MIN);
+}
 
-	if (tree->left != NULL) {
-		count = getNumberOfTreeLeaves(tree->left);
+static COLOR_NODE *colorNodeAlloc(REDUCTION *reduction) {
+	COLOR_NODE_BLOCK *block = reduction->nodeBlockCurrent;
+	if (block == NULL || reduction->nNodeBlockUsed == COLOR_NODE_BLOCK_SIZE) {
+		//move on to the next block, adding one to the end of the list if needed
+		COLOR_NODE_BLOCK *next = (block == NULL) ? reduction->nodeBlocks : block->next;
+		if (next == NULL) {
+			next = (COLOR_NODE_BLOCK *) calloc(1, sizeof(COLOR_NODE_BLOCK));
+			if (block == NULL) reduction->nodeBlocks = next;
+			else block->next = next;
+		}
+		reduction->nodeBlockCurrent = next;
+		reduction->nNodeBlockUsed = 0;
+		block = next;
 	}
-	if (tree->right != NULL) {
-		count += getNumberOfTreeLeaves(tree->right);
+
+	COLOR_NODE *node = block->nodes + reduction->nNodeBlockUsed++;
+	memset(node, 0, sizeof(COLOR_NODE));
+	node->heapIndex = -1;
+	return node;
+}
+
+static void colorTreeDiscard(REDUCTION *reduction) {
+	reduction->colorTreeHead = NULL;
+	reduction->nodeBlockCurrent = NULL;
+	reduction->nNodeBlockUsed = 0;
+	reduction->nSplitHeap = 0;
+}
+
+static void colorNodeBlocksFree(REDUCTION *reduction) {
+	COLOR_NODE_BLOCK *block = reduction->nodeBlocks;
+	while (block != NULL) {
+		COLOR_NODE_BLOCK *next = block->next;
+		free(block);
+		block = next;
 	}
-	return count;
+	reduction->nodeBlocks = NULL;
+	colorTreeDiscard(reduction);
 }
 
-void createLeaves(COLOR_NODE *tree, int pivotIndex) {
+void createLeaves(REDUCTION *reduction, COLOR_NODE *tree, int pivotIndex) {
 	if (tree->left == NULL && tree->right == NULL) {
 		if (pivotIndex > tree->startIndex && pivotIndex >= tree->endIndex) {
 			pivotIndex = tree->endIndex - 1;
@@ -278,45 +616,119 @@ void createLeaves(COLOR_NODE *tree, int pivotIndex) {
 		}
 
 		if (pivotIndex > tree->startIndex && pivotIndex < tree->endIndex) {
-			COLOR_NODE *newNode = (COLOR_NODE *) calloc(1, sizeof(COLOR_NODE));
+			COLOR_NODE *newNode = colorNodeAlloc(reduction);
 			
 			newNode->a = 0xFF;
 			newNode->isLeaf = TRUE;
 			newNode->startIndex = tree->startIndex;
 			newNode->endIndex = pivotIndex;
+			newNode->parent = tree;
 			tree->left = newNode;
 
-			newNode = (COLOR_NODE *) calloc(1, sizeof(COLOR_NODE));
+			newNode = colorNodeAlloc(reduction);
 			newNode->a = 0xFF;
 			newNode->isLeaf = TRUE;
 			newNode->startIndex = pivotIndex;
 			newNode->endIndex = tree->endIndex;
+			newNode->parent = tree;
 			tree->right = newNode;
 		}
 	}
 	tree->isLeaf = FALSE;
 }
 
-COLOR_NODE *getLeaf(COLOR_NODE *tree) {
-	if (tree->left == NULL && tree->right == NULL) {
-		if (tree->isLeaf) return tree;
-		return NULL;
+static int colorNodeDepth(COLOR_NODE *node) {
+	int depth = 0;
+	while (node->parent != NULL) {
+		node = node->parent;
+		depth++;
 	}
-	COLOR_NODE *leafLeft = NULL, *leafRight = NULL;
-	if (tree->left != NULL) {
-		leafLeft = getLeaf(tree->left);
+	return depth;
+}
+
+//whether n1 comes after n2 in the tree's leaf order. Neither may contain the other.
+static int colorNodeIsRightOf(COLOR_NODE *n1, COLOR_NODE *n2) {
+	int depth1 = colorNodeDepth(n1), depth2 = colorNodeDepth(n2);
+	for (; depth1 > depth2; depth1--) n1 = n1->parent;
+	for (; depth2 > depth1; depth2--) n2 = n2->parent;
+	while (n1->parent != n2->parent) {
+		n1 = n1->parent;
+		n2 = n2->parent;
 	}
-	if (tree->right != NULL) {
-		leafRight = getLeaf(tree->right);
+	return n1->parent->right == n1;
+}
+
+//Leaves are split greatest priority first. Of equal priorities the rightmost
+//leaf goes first, which is the one a walk of the whole tree used to find.
+static int colorNodeSplitsBefore(COLOR_NODE *n1, COLOR_NODE *n2) {
+	if (n1->priority != n2->priority) return n1->priority > n2->priority;
+	return colorNodeIsRightOf(n1, n2);
+}
+
+static void splitHeapSet(REDUCTION *reduction, int index, COLOR_NODE *node) {
+	reduction->splitHeap[index] = node;
+	node->heapIndex = index;
+}
+
+static void splitHeapSiftUp(REDUCTION *reduction, int index) {
+	COLOR_NODE **heap = reduction->splitHeap;
+	COLOR_NODE *node = heap[index];
+	while (index > 0) {
+		int parent = (index - 1) / 2;
+		if (!colorNodeSplitsBefore(node, heap[parent])) break;
+		splitHeapSet(reduction, index, heap[parent]);
+		index = parent;
 	}
-	
-	if (leafLeft != NULL && leafRight == NULL) return leafLeft;
-	if (leafRight != NULL && leafLeft == NULL) return leafRight;
-	if (leafLeft == NULL && leafRight == NULL) return NULL;
+	splitHeapSet(reduction, index, node);
+}
 
-	if (leafRight->priority >= leafLeft->priority) return leafRight;
-	return leafLeft;
+static void splitHeapSiftDown(REDUCTION *reduction, int index) {
+	COLOR_NODE **heap = reduction->splitHeap;
+	int nNodes = reduction->nSplitHeap;
+	COLOR_NODE *node = heap[index];
+	while (1) {
+		int child = index * 2 + 1;
+		if (child >= nNodes) break;
+		if (child + 1 < nNodes && colorNodeSplitsBefore(heap[child + 1], heap[child])) child++;
+		if (!colorNodeSplitsBefore(heap[child], node)) break;
+		splitHeapSet(reduction, index, heap[child]);
+		index = child;
+	}
+	splitHeapSet(reduction, index, node);
+}
+
+static void splitHeapPush(REDUCTION *reduction, COLOR_NODE *node) {
+	if (reduction->nSplitHeap == reduction->splitHeapCapacity) {
+		reduction->splitHeapCapacity = reduction->splitHeapCapacity ? (reduction->splitHeapCapacity * 2) : 256;
+		reduction->splitHeap = (COLOR_NODE **) realloc(reduction->splitHeap, reduction->splitHeapCapacity * sizeof(COLOR_NODE *));
+	}
+	reduction->splitHeap[reduction->nSplitHeap] = node;
+	splitHeapSiftUp(reduction, reduction->nSplitHeap++);
+}
+
+static void splitHeapRemove(REDUCTION *reduction, COLOR_NODE *node) {
+	int index = node->heapIndex;
+	if (index < 0) return;
+	node->heapIndex = -1;
+
+	COLOR_NODE *last = reduction->splitHeap[--reduction->nSplitHeap];
+	if (last == node) return;
+	splitHeapSet(reduction, index, last);
+	splitHeapSiftUp(reduction, index);
+	splitHeapSiftDown(reduction, last->heapIndex);
+}
+
+static void splitHeapUpdate(REDUCTION *reduction, COLOR_NODE *node) {
+	if (node->heapIndex < 0) return;
+	splitHeapSiftUp(reduction, node->heapIndex);
+	splitHeapSiftDown(reduction, node->heapIndex);
+}
 
+static COLOR_NODE *splitHeapPop(REDUCTION *reduction) {
+	if (reduction->nSplitHeap == 0) return NULL;
+	COLOR_NODE *node = reduction->splitHeap[0];
+	splitHeapRemove(reduction, node);
+	return node;
 }
 
 double approximatePrincipalComponent(REDUCTION *reduction, int startIndex, int endIndex, double *axis) {
@@ -648,65 +1060,27 @@ double addPriorities(COLOR_NODE *n1, COLOR_NODE *n2, REDUCTION *reduction) {
 	return (p1 + p2) / adjustedWeight;
 }
 
-COLOR_NODE *findNodeByColor(COLOR_NODE *treeHead, COLOR_NODE *src, int maskColors) {
-	if (treeHead == NULL || treeHead == src) return NULL;
-
-	if (treeHead->left != NULL || treeHead->right != NULL) {
-		COLOR_NODE *foundLeft = findNodeByColor(treeHead->left, src, maskColors);
-		if (foundLeft != NULL) return foundLeft;
-
-		COLOR_NODE *foundRight = findNodeByColor(treeHead->right, src, maskColors);
-		return foundRight;
-	}
-
-	//is leaf, does this match?
+static COLOR32 colorNodeGetRgb(COLOR_NODE *node, int maskColors) {
 	int rgb[4];
-	int yiq[] = { src->y, src->i, src->q, 0 };
-	yiqToRgb(rgb, yiq);
-	COLOR32 compare = rgb[0] | (rgb[1] << 8) | (rgb[2] << 16);
-	if (maskColors) compare = ColorRoundToDS15(compare);
-
-	yiq[0] = treeHead->y;
-	yiq[1] = treeHead->i;
-	yiq[2] = treeHead->q;
+	int yiq[] = { node->y, node->i, node->q, 0 };
 	yiqToRgb(rgb, yiq);
-	COLOR32 thisRgb = rgb[0] | (rgb[1] << 8) | (rgb[2] << 16);
-	if (maskColors) thisRgb = ColorRoundToDS15(thisRgb);
-
-	return (compare == thisRgb) ? treeHead : NULL;
-}
-
-COLOR_NODE *findNodeByChild(COLOR_NODE *treeHead, COLOR_NODE *child) {
-	if (treeHead == NULL) return NULL;
-	if (treeHead->left == child || treeHead->right == child) return treeHead;
-
-	COLOR_NODE *foundLeft = findNodeByChild(treeHead->left, child);
-	if (foundLeft != NULL) return foundLeft;
-
-	return findNodeByChild(treeHead->right, child);
-}
-
-COLOR_NODE *findNodeByIndex(COLOR_NODE *treeHead, int index) {
-	if (treeHead == NULL) return NULL;
-	if (treeHead->left == NULL && treeHead->right == NULL) return treeHead;
-	if (treeHead->left == NULL) return findNodeByIndex(treeHead->right, index);
-	if (treeHead->right == NULL) return findNodeByIndex(treeHead->left, index);
-
-	//count nodes left. If greater than index, search left, else search right
-	int nodesLeft = getNumberOfTreeLeaves(treeHead->left);
-	if (nodesLeft > index) return findNodeByIndex(treeHead->left, index);
-	return findNodeByIndex(treeHead->right, index - nodesLeft);
+	COLOR32 col = rgb[0] | (rgb[1] << 8) | (rgb[2] << 16);
+	if (maskColors) col = ColorRoundToDS15(col);
+	return col;
 }
 
-void cleanEmptyNode(COLOR_NODE *treeHead, COLOR_NODE *node) {
-	//trace up the tree clearing out empty non-leaf nodes
-	COLOR_NODE *parent = findNodeByChild(treeHead, node);
-	if (parent != NULL) {
+//detach a node with no children from the tree, along with any parents left without children
+static void colorTreeRemoveNode(REDUCTION *reduction, COLOR_NODE *node) {
+	splitHeapRemove(reduction, node);
+	COLOR_NODE *parent = node->parent;
+	while (parent != NULL) {
 		if (parent->left == node) parent->left = NULL;
 		if (parent->right == node) parent->right = NULL;
-		if (parent->left == NULL && parent->right == NULL) cleanEmptyNode(treeHead, parent);
+		if (parent->left != NULL || parent->right != NULL) break;
+
+		node = parent;
+		parent = node->parent;
 	}
-	freeColorTree(node, TRUE);
 }
 
 COLOR_NODE **addColorBlocks(COLOR_NODE *colorBlock, COLOR_NODE **colorBlockList) {
@@ -763,6 +1137,33 @@ double __inline computeColorDifferenceYiq(REDUCTION *reduction, int *yiq1, int *
 	return yw2 * dy * dy + iw2 * di * di + qw2 * dq * dq;
 }
 
+//Distance between two colors as used for reclustering. The square root of this is
+//a Euclidean distance over weighted Y, I and Q, so it obeys the triangle inequality.
+static __inline double reclusterDistance(double yw2, double iw2, double qw2, int *yiq1, int *yiq2) {
+	double dy = yiq1[0] - yiq2[0];
+	double di = yiq1[1] - yiq2[1];
+	double dq = yiq1[2] - yiq2[2];
+	return yw2 * dy * dy + iw2 * di * di + qw2 * dq * dq;
+}
+
+//slack for rounding in square roots when comparing bounds. Distances themselves
+//are sums of products of small integers, so they are exact.
+#define RECLUSTER_BOUND_SLACK 1e-6
+
+//another palette color and its distance from a palette color, for reclustering
+typedef struct RECLUSTER_NEIGHBOR_ {
+	double gap;
+	int index;
+} RECLUSTER_NEIGHBOR;
+
+static int reclusterNeighborComparator(const void *p1, const void *p2) {
+	const RECLUSTER_NEIGHBOR *n1 = (const RECLUSTER_NEIGHBOR *) p1;
+	const RECLUSTER_NEIGHBOR *n2 = (const RECLUSTER_NEIGHBOR *) p2;
+	if (n1->gap < n2->gap) return -1;
+	if (n1->gap > n2->gap) return 1;
+	return n1->index - n2->index;
+}
+
 void iterateRecluster(REDUCTION *reduction) {
 	//simple termination conditions
 	int nIterations = reduction->nReclusters;
@@ -771,6 +1172,7 @@ void iterateRecluster(REDUCTION *reduction) {
 	if (reduction->nUsedColors >= reduction->histogram->nEntries) return;
 
 	int nHistEntries = reduction->histogram->nEntries;
+	int nUsedColors = reduction->nUsedColors;
 	double yw2 = reduction->yWeight * reduction->yWeight;
 	double iw2 = reduction->iWeight * reduction->iWeight;
 	double qw2 = reduction->qWeight * reduction->qWeight;
@@ -782,6 +1184,18 @@ void iterateRecluster(REDUCTION *reduction) {
 	memcpy(reduction->paletteYiqCopy, reduction->paletteYiq, sizeof(reduction->paletteYiq));
 	memcpy(reduction->paletteRgbCopy, reduction->paletteRgb, sizeof(reduction->paletteRgb));
 
+	//Most entries keep their bucket from one pass to the next. Each entry keeps a
+	//lower bound on its distance to every center but its own, lowered each pass
+	//by how far the centers moved. An entry keeps its bucket without a search
+	//when it is closer to its own center than that bound, or than half the gap
+	//from its center to the nearest other center. Otherwise other centers are
+	//tried nearest to its old center first, stopping once the rest are too far
+	//from that center to be closer. Ties still go to the lowest index.
+	double *lowerBounds = (double *) calloc(nHistEntries, sizeof(double));
+	RECLUSTER_NEIGHBOR *neighbors = (RECLUSTER_NEIGHBOR *) calloc(nUsedColors * nUsedColors, sizeof(RECLUSTER_NEIGHBOR));
+	int boundCenters[256][4]; //centers the bounds were last updated against
+	int boundsValid = 0;
+
 	//iterate up to n times
 	int nRecomputes = 0;
 	TOTAL_BUFFER *totalsBuffer = reduction->blockTotals;
@@ -789,25 +1203,81 @@ void iterateRecluster(REDUCTION *reduction) {
 		//reset block totals
 		memset(totalsBuffer, 0, sizeof(reduction->blockTotals));
 
+		//find how far the centers moved since the last pass
+		double largestMove = 0.0, secondLargestMove = 0.0;
+		int largestMoveIndex = -1;
+		for (int j = 0; j < nUsedColors; j++) {
+			int *yiq = &reduction->paletteYiqCopy[j][0];
+			double move = boundsValid ? sqrt(reclusterDistance(yw2, iw2, qw2, boundCenters[j], yiq)) : 0.0;
+			if (move > largestMove) {
+				secondLargestMove = largestMove;
+				largestMove = move;
+				largestMoveIndex = j;
+			} else if (move > secondLargestMove) {
+				secondLargestMove = move;
+			}
+			memcpy(boundCenters[j], yiq, sizeof(boundCenters[j]));
+		}
+
+		//list the other centers by distance from each center
+		for (int j = 0; j < nUsedColors; j++) {
+			RECLUSTER_NEIGHBOR *list = neighbors + j * nUsedColors;
+			int nNeighbors = 0;
+			for (int l = 0; l < nUsedColors; l++) {
+				if (l == j) continue;
+				list[nNeighbors].gap = sqrt(reclusterDistance(yw2, iw2, qw2, boundCenters[j], boundCenters[l]));
+				list[nNeighbors].index = l;
+				nNeighbors++;
+			}
+			qsort(list, nNeighbors, sizeof(RECLUSTER_NEIGHBOR), reclusterNeighborComparator);
+			list[nNeighbors].gap = 1e32; //end marker
+			list[nNeighbors].index = -1;
+		}
+
 		//voronoi iteration
 		for (int i = 0; i < nHistEntries; i++) {
 			HIST_ENTRY *entry = reduction->histogramFlat[i];
 			double weight = entry->weight;
 			int hy = entry->y, hi = entry->i, hq = entry->q, ha = entry->a;
+			int hyiq[] = { hy, hi, hq, ha };
+
+			//start from the entry's bucket in the last pass
+			int anchor = boundsValid ? entry->entry : 0;
+			RECLUSTER_NEIGHBOR *list = neighbors + anchor * nUsedColors;
+			double bestDistance = reclusterDistance(yw2, iw2, qw2, hyiq, boundCenters[anchor]);
+			int bestIndex = anchor;
+			double anchorRadius = sqrt(bestDistance);
+
+			int keep = 0;
+			if (boundsValid) {
+				lowerBounds[i] -= (anchor == largestMoveIndex) ? secondLargestMove : largestMove;
+				double bound = max(lowerBounds[i], 0.5 * list[0].gap);
+				if (anchorRadius + RECLUSTER_BOUND_SLACK < bound) keep = 1;
+			}
 
-			double bestDistance = 1e30;
-			int bestIndex = 0;
-			for (int j = 0; j < reduction->nUsedColors; j++) {
-				int *pyiq = &reduction->paletteYiqCopy[j][0];
-
-				double dy = hy - pyiq[0];
-				double di = hi - pyiq[1];
-				double dq = hq - pyiq[2];
-				double diff = yw2 * dy * dy + iw2 * di * di + qw2 * dq * dq;
-				if (diff < bestDistance) {
-					bestDistance = diff;
-					bestIndex = j;
+			if (!keep) {
+				double bestRadius = anchorRadius;
+				double secondDistance = 1e30, farBound = 1e30;
+				for (int n = 0; n < nUsedColors; n++) {
+					//every center from here on is at least this far from the entry
+					double gapBound = list[n].gap - anchorRadius;
+					if (gapBound > bestRadius + RECLUSTER_BOUND_SLACK) {
+						farBound = gapBound;
+						break;
+					}
+
+					int j = list[n].index;
+					double diff = reclusterDistance(yw2, iw2, qw2, hyiq, boundCenters[j]);
+					if (diff < bestDistance || (diff == bestDistance && j < bestIndex)) {
+						if (bestDistance < secondDistance) secondDistance = bestDistance;
+						bestDistance = diff;
+						bestIndex = j;
+						bestRadius = sqrt(diff);
+					} else if (diff < secondDistance) {
+						secondDistance = diff;
+					}
 				}
+				lowerBounds[i] = min(sqrt(secondDistance), farBound);
 			}
 
 			//add to total
@@ -821,6 +1291,7 @@ void iterateRecluster(REDUCTION *reduction) {
 
 			error += bestDistance * weight;
 		}
+		boundsValid = 1;
 
 		//quick sanity check of bucket weights (if any are 0, find another color for it.)
 		int doRecompute = 0;
@@ -873,18 +1344,18 @@ void iterateRecluster(REDUCTION *reduction) {
 
 		//after recomputing bounds, now let's see if we're wasting any slots.
 		for (int i = 0; i < reduction->nUsedColors; i++) {
-			if (totalsBuffer[i].weight <= 0.0) return;
+			if (totalsBuffer[i].weight <= 0.0) goto done;
 		}
 
 		//also check palette error; if we've started rising, we passed our locally optimal palette
 		if (error > lastError) {
-			return;
+			goto done;
 		}
 
 		//check: is the palette the same after this iteration as lst?
 		if (error == lastError)
 			if (memcmp(reduction->paletteRgb, reduction->paletteRgbCopy, sizeof(reduction->paletteRgb)) == 0)
-				return;
+				goto done;
 
 		//weight check succeeded, copy this palette to the main palette.
 		memcpy(reduction->paletteYiq, reduction->paletteYiqCopy, sizeof(reduction->paletteYiqCopy));
@@ -926,6 +1397,10 @@ void iterateRecluster(REDUCTION *reduction) {
 		lastError = error;
 		error = 0.0;
 	}
+
+done:
+	free(lowerBounds);
+	free(neighbors);
 }
 
 void optimizePalette(REDUCTION *reduction) {
@@ -935,7 +1410,8 @@ void optimizePalette(REDUCTION *reduction) {
 	}
 
 	//do it
-	COLOR_NODE *treeHead = (COLOR_NODE *) calloc(1, sizeof(COLOR_NODE));
+	colorTreeDiscard(reduction);
+	COLOR_NODE *treeHead = colorNodeAlloc(reduction);
 	treeHead->isLeaf = TRUE;
 	treeHead->a = 0xFF;
 	treeHead->endIndex = reduction->histogram->nEntries;
@@ -946,58 +1422,30 @@ void optimizePalette(REDUCTION *reduction) {
 		return;
 	}
 	setupLeaf(reduction, treeHead);
+	if (treeHead->isLeaf) splitHeapPush(reduction, treeHead);
 
-	int numberOfTreeElements = 0;
-	if (treeHead->left == NULL && treeHead->right == NULL) {
-		numberOfTreeElements = 1;
-	} else {
-		if (treeHead->left != NULL) {
-			numberOfTreeElements = getNumberOfTreeLeaves(treeHead->left);
-		}
-		if (treeHead->right != NULL) {
-			numberOfTreeElements = getNumberOfTreeLeaves(treeHead->right);
-		}
-	}
+	//nodes without children, each of which becomes a palette color
+	int numberOfTreeElements = 1;
 
 	reduction->nUsedColors = 1;
 	if (numberOfTreeElements < reduction->nPaletteColors) {
 		COLOR_NODE *colorBlock;
-		while ((colorBlock = getLeaf(treeHead)) != NULL) {
-			createLeaves(colorBlock, colorBlock->pivotIndex);
+		while ((colorBlock = splitHeapPop(reduction)) != NULL) {
+			createLeaves(reduction, colorBlock, colorBlock->pivotIndex);
 
 			COLOR_NODE *leftBlock = colorBlock->left, *rightBlock = colorBlock->right;
 			if (leftBlock != NULL) {
 				setupLeaf(reduction, leftBlock);
 
 				//destroy this node?
-				if (leftBlock->weight < 1.0) {
-					if (leftBlock->left != NULL) {
-						freeColorTree(leftBlock->left, TRUE);
-						leftBlock->left = NULL;
-					}
-					if (leftBlock->right != NULL) {
-						freeColorTree(leftBlock->right, TRUE);
-						leftBlock->right = NULL;
-					}
-					colorBlock->left = NULL;
-				}
+				if (leftBlock->weight < 1.0) colorBlock->left = NULL;
 			}
 
 			if (rightBlock != NULL) {
 				setupLeaf(reduction, rightBlock);
 
 				//destroy this node?
-				if (rightBlock->weight < 1.0) {
-					if (rightBlock->left != NULL) {
-						freeColorTree(rightBlock->left, TRUE);
-						rightBlock->left = NULL;
-					}
-					if (rightBlock->right != NULL) {
-						freeColorTree(rightBlock->right, TRUE);
-						rightBlock->right = NULL;
-					}
-					colorBlock->right = NULL;
-				}
+				if (rightBlock->weight < 1.0) colorBlock->right = NULL;
 			}
 			//it is possible to end up with a branch with no leaves, if they all die :(
 
@@ -1014,86 +1462,58 @@ void optimizePalette(REDUCTION *reduction) {
 					rightRgb = ColorRoundToDS15(rightRgb);
 				}
 
+				//prune both
 				if (leftRgb == rightRgb && leftAlpha == rightAlpha) {
-					leftBlock = colorBlock->left, rightBlock = colorBlock->right;
-
-					//prune left
-					if (leftBlock != NULL) {
-						if (leftBlock->left != NULL) {
-							freeColorTree(leftBlock->left, TRUE);
-							leftBlock->left = NULL;
-						}
-						if (leftBlock->right != NULL) {
-							freeColorTree(leftBlock->right, TRUE);
-							leftBlock->right = NULL;
-						}
-						free(leftBlock);
-						leftBlock = NULL;
-					}
 					colorBlock->left = NULL;
-
-					//prune right
-					if (rightBlock != NULL) {
-						if (rightBlock->left != NULL) {
-							freeColorTree(rightBlock->left, TRUE);
-							rightBlock->left = NULL;
-						}
-						if (rightBlock->right != NULL) {
-							freeColorTree(rightBlock->right, TRUE);
-							rightBlock->right = NULL;
-						}
-						free(rightBlock);
-						rightBlock = NULL;
-					}
 					colorBlock->right = NULL;
 				}
 			}
 
-			//count number of leaves
-			numberOfTreeElements = 0;
-			if (treeHead->left == NULL && treeHead->right == NULL) {
-				numberOfTreeElements = 1;
-			} else {
-				if (treeHead->left != NULL) {
-					numberOfTreeElements += getNumberOfTreeLeaves(treeHead->left);
-				}
-				if (treeHead->right != NULL) {
-					numberOfTreeElements += getNumberOfTreeLeaves(treeHead->right);
-				}
-			}
+			//the split node is replaced by its remaining children, if any
+			int nChildren = (colorBlock->left != NULL) + (colorBlock->right != NULL);
+			if (nChildren > 0) numberOfTreeElements += nChildren - 1;
+			if (colorBlock->left != NULL && colorBlock->left->isLeaf) splitHeapPush(reduction, colorBlock->left);
+			if (colorBlock->right != NULL && colorBlock->right->isLeaf) splitHeapPush(reduction, colorBlock->right);
 
 			if (numberOfTreeElements >= reduction->nPaletteColors) {
 
-				//duplicate color test
-				int prunedNode = 0;
+				//duplicate color test. Find the first color in tree order that appears
+				//again, and its next appearance.
+				COLOR_NODE **leaves = reduction->colorBlocks;
+				COLOR32 leafColors[0x2000];
+				addColorBlocks(treeHead, leaves);
 				for (int i = 0; i < numberOfTreeElements; i++) {
-					COLOR_NODE *node = findNodeByIndex(treeHead, i);
-					COLOR_NODE *dup = findNodeByColor(treeHead, node, reduction->maskColors);
-					if (dup != NULL) {
-						double p1 = node->priority, p2 = dup->priority;
-						double total = addPriorities(node, dup, reduction);
-						COLOR_NODE *toDelete = dup, *toKeep = node, *parent = NULL;
-
-						//find which node should keep, which to remove using priority
-						if (p1 < p2) {
-							toDelete = node;
-							toKeep = dup;
+					leafColors[i] = colorNodeGetRgb(leaves[i], reduction->maskColors);
+				}
+
+				COLOR_NODE *node = NULL, *dup = NULL;
+				for (int i = 0; i < numberOfTreeElements && dup == NULL; i++) {
+					for (int j = i + 1; j < numberOfTreeElements; j++) {
+						if (leafColors[j] == leafColors[i]) {
+							node = leaves[i];
+							dup = leaves[j];
+							break;
 						}
-						parent = findNodeByChild(treeHead, toDelete);
-						toKeep->priority = total;
-
-						//remove node from existence
-						freeColorTree(toDelete, TRUE);
-						if (parent->left == toDelete) parent->left = NULL;
-						if (parent->right == toDelete) parent->right = NULL;
-						if (parent->right == NULL && parent->left == NULL) cleanEmptyNode(treeHead, parent);
-						numberOfTreeElements--;
-						prunedNode = 1;
-						break;
 					}
 				}
 
-				if(!prunedNode) break;
+				if (dup == NULL) break;
+
+				double p1 = node->priority, p2 = dup->priority;
+				double total = addPriorities(node, dup, reduction);
+				COLOR_NODE *toDelete = dup, *toKeep = node;
+
+				//find which node should keep, which to remove using priority
+				if (p1 < p2) {
+					toDelete = node;
+					toKeep = dup;
+				}
+				toKeep->priority = total;
+				splitHeapUpdate(reduction, toKeep);
+
+				//remove node from existence
+				colorTreeRemoveNode(reduction, toDelete);
+				numberOfTreeElements--;
 			}
 		}
 	}
@@ -1112,45 +1532,100 @@ void optimizePalette(REDUCTION *reduction) {
 	iterateRecluster(reduction);
 }
 
-void freeAllocations(ALLOCATOR *allocator) {
-	if (allocator->allocation != NULL) free(allocator->allocation);
-	allocator->allocation = NULL;
-	if (allocator->next != NULL) {
-		freeAllocations(allocator->next);
-		allocator->next = NULL;
-	}
-}
-
 void destroyReduction(REDUCTION *reduction) {
 	if(reduction->histogramFlat != NULL) free(reduction->histogramFlat);
-	if (reduction->histogram != NULL) {
-		freeAllocations(&reduction->histogram->allocator);
-		free(reduction->histogram);
-	}
-	if(reduction->colorTreeHead != NULL) freeColorTree(reduction->colorTreeHead, FALSE);
-	free(reduction->colorTreeHead);
+	if (reduction->histogram != NULL) histogramFree(reduction->histogram);
+	colorNodeBlocksFree(reduction);
+	free(reduction->splitHeap);
 }
 
 void resetHistogram(REDUCTION *reduction) {
 	if (reduction->histogramFlat != NULL) free(reduction->histogramFlat);
 	reduction->histogramFlat = NULL;
-	if (reduction->histogram != NULL) {
-		freeAllocations(&reduction->histogram->allocator);
-		free(reduction->histogram);
-		reduction->histogram = NULL;
-	}
-	if (reduction->colorTreeHead != NULL) freeColorTree(reduction->colorTreeHead, FALSE);
-	free(reduction->colorTreeHead);
-	reduction->colorTreeHead = NULL;
+	if (reduction->histogram != NULL) histogramClear(reduction->histogram);
+	colorTreeDiscard(reduction);
 	reduction->nUsedColors = 0;
 	memset(reduction->paletteRgb, 0, sizeof(reduction->paletteRgb));
 }
 
+//pool of released workspaces, guarded by a spin lock
+#define REDUCTION_POOL_SIZE 32
+
+//largest histogram a pooled workspace keeps, the size histogramCreate caps to
+#define REDUCTION_POOL_MAX_HISTOGRAM 0x8000
+
+static REDUCTION *g_reductionPool[REDUCTION_POOL_SIZE];
+static int g_reductionPoolCount = 0;
+static volatile LONG g_reductionPoolLock = 0;
+
+static void reductionPoolLock(void) {
+	while (InterlockedCompareExchange(&g_reductionPoolLock, 1, 0) != 0) {
+		YieldProcessor();
+	}
+}
+
+static void reductionPoolUnlock(void) {
+	InterlockedExchange(&g_reductionPoolLock, 0);
+}
+
+REDUCTION *reductionAcquire(int balance, int colorBalance, int optimization, int enhanceColors, unsigned int nColors) {
+	REDUCTION *reduction = NULL;
+	reductionPoolLock();
+	if (g_reductionPoolCount > 0) reduction = g_reductionPool[--g_reductionPoolCount];
+	reductionPoolUnlock();
+
+	if (reduction == NULL) {
+		reduction = (REDUCTION *) calloc(1, sizeof(REDUCTION));
+		initReduction(reduction, balance, colorBalance, optimization, enhanceColors, nColors);
+		return reduction;
+	}
+
+	//reset to the state initReduction leaves, keeping the histogram's memory, the luma table,
+	//and the color tree's node blocks and split heap
+	HISTOGRAM *histogram = reduction->histogram;
+	memset(reduction, 0, offsetof(REDUCTION, lumaTable));
+	reduction->histogram = histogram;
+	reductionSetParameters(reduction, balance, colorBalance, optimization, enhanceColors, nColors);
+	return reduction;
+}
+
+void reductionRelease(REDUCTION *reduction) {
+	resetHistogram(reduction);
+
+	//don't hold memory sized for the largest image ever processed while pooled
+	if (reduction->histogram != NULL && reduction->histogram->maxEntries > REDUCTION_POOL_MAX_HISTOGRAM) {
+		histogramFree(reduction->histogram);
+		reduction->histogram = NULL;
+	}
+
+	reductionPoolLock();
+	if (g_reductionPoolCount < REDUCTION_POOL_SIZE) {
+		g_reductionPool[g_reductionPoolCount++] = reduction;
+		reduction = NULL;
+	}
+	reductionPoolUnlock();
+
+	//pool is full
+	if (reduction != NULL) {
+		destroyReduction(reduction);
+		free(reduction);
+	}
+}
+
+void reductionPoolFree(void) {
+	reductionPoolLock();
+	for (int i = 0; i < g_reductionPoolCount; i++) {
+		destroyReduction(g_reductionPool[i]);
+		free(g_reductionPool[i]);
+	}
+	g_reductionPoolCount = 0;
+	reductionPoolUnlock();
+}
+
 extern int lightnessCompare(const void *d1, const void *d2);
 
 int createPaletteSlow(COLOR32 *img, int width, int height, COLOR32 *pal, unsigned int nColors) {
-	REDUCTION *reduction = (REDUCTION *) calloc(1, sizeof(REDUCTION));
-	initReduction(reduction, 20, 20, 15, FALSE, nColors);
+	REDUCTION *reduction = reductionAcquire(20, 20, 15, FALSE, nColors);
 	computeHistogram(reduction, img, width, height);
 	flattenHistogram(reduction);
 	optimizePalette(reduction);
@@ -1162,8 +1637,7 @@ int createPaletteSlow(COLOR32 *img, int width, int height, COLOR32 *pal, unsigne
 		pal[i] = r | (g << 8) | (b << 16);
 	}
 
-	destroyReduction(reduction);
-	free(reduction);
+	reductionRelease(reduction);
 	qsort(pal, nColors, 4, lightnessCompare);
 	return 0;
 }
@@ -1185,7 +1659,10 @@ void copyTile(TILE *dest, COLOR32 *pxOrigin, int width) {
 }
 
 int findClosestPaletteColorRGB(int *palette, int nColors, COLOR32 col, int *outDiff) {
-	int rgb[4];
+	//tile palettes hold at most 16 colors
+	COLOR32 paletteRgb[16];
+	yiqToRgbBatch(palette, nColors, paletteRgb);
+
 	int y, u, v;
 	convertRGBToYUV(col & 0xFF, (col >> 8) & 0xFF, (col >> 16) & 0xFF, &y, &u, &v);
 
@@ -1193,8 +1670,8 @@ int findClosestPaletteColorRGB(int *palette, int nColors, COLOR32 col, int *outD
 	int leastIndex = 0;
 	for (int i = 0; i < nColors; i++) {
 		int y2, u2, v2;
-		yiqToRgb(rgb, palette + i * 4);
-		convertRGBToYUV(rgb[0], rgb[1], rgb[2], &y2, &u2, &v2);
+		COLOR32 c = paletteRgb[i];
+		convertRGBToYUV(c & 0xFF, (c >> 8) & 0xFF, (c >> 16) & 0xFF, &y2, &u2, &v2);
 
 		int dy = y2 - y, du = u2 - u, dv = v2 - v;
 		int diff = dy * dy * 2 + du * du + dv * dv;
@@ -1288,24 +1765,27 @@ int computeTilePaletteDifference(REDUCTION *reduction, TILE *tile1, TILE *tile2)
 	return (int) totalDiff;
 }
 
-int findSimilarTiles(TILE *tiles, int *similarities, int nTiles, int *i1, int *i2) {
-	//find a pair of tiles. Both must be representative tiles.
+int findSimilarTiles(TILE *tiles, int *similarities, int nTiles, int *reps, int *i1, int *i2) {
+	//find a pair of tiles. Both must be representative tiles, so gather those first
+	//into reps (room for nTiles) rather than testing every entry of the matrix.
+	int nReps = 0;
+	for (int i = 0; i < nTiles; i++) {
+		if (tiles[i].palIndex == i) reps[nReps++] = i;
+	}
 
 	int leastDiff = 0x7FFFFFFF;
 	int best1 = 0, best2 = 1;
-	for (int i = 0; i < nTiles; i++) {
-		TILE *tile1 = tiles + i;
-		if (tile1->palIndex != i) continue;
+	for (int ii = 0; ii < nReps; ii++) {
+		int i = reps[ii];
+		int *row = similarities + i * nTiles;
 
-		for (int j = 0; j < nTiles; j++) {
-			TILE *tile2 = tiles + j;
-
-			if (tile2->palIndex != j) continue;
+		for (int jj = 0; jj < nReps; jj++) {
+			int j = reps[jj];
 			if (i == j) continue;
 
 			//test difference
-			if (similarities[i * nTiles + j] <= leastDiff) {
-				leastDiff = similarities[i * nTiles + j];
+			if (row[j] <= leastDiff) {
+				leastDiff = row[j];
 				best1 = i;
 				best2 = j;
 				if (!leastDiff) goto done;
@@ -1319,15 +1799,90 @@ done:
 	return leastDiff;
 }
 
+typedef struct {
+	COLOR32 *imgBits;
+	int tilesX;
+	TILE *tiles;
+	int nTiles;
+	int *diffBuff;
+	REDUCTION **reductions; //one per worker thread
+	int balance;
+	int colorBalance;
+	int enhanceColors;
+	int nColsPerPalette;
+	volatile LONG *progress;
+} MULTIPALETTE_CONTEXT;
+
+static void multiPaletteCreateTile(void *param, int index, int threadIndex) {
+	MULTIPALETTE_CONTEXT *context = (MULTIPALETTE_CONTEXT *) param;
+	int tilesX = context->tilesX;
+	int x = index % tilesX, y = index / tilesX;
+
+	REDUCTION *reduction = context->reductions[threadIndex];
+	if (reduction == NULL) {
+		reduction = reductionAcquire(context->balance, context->colorBalance, 15, context->enhanceColors, context->nColsPerPalette);
+		reduction->maskColors = FALSE;
+		context->reductions[threadIndex] = reduction;
+	}
+
+	TILE *tile = context->tiles + index;
+	COLOR32 *pxOrigin = context->imgBits + x * 8 + (y * 8 * tilesX * 8);
+	copyTile(tile, pxOrigin, tilesX * 8);
+
+	resetHistogram(reduction);
+	computeHistogram(reduction, tile->rgb, 8, 8);
+	flattenHistogram(reduction);
+	optimizePalette(reduction);
+
+	for (int i = 0; i < 16; i++) {
+		uint8_t *col = &reduction->paletteRgb[i][0];
+		int yiq[4];
+		rgbToYiq(col[0] | (col[1] << 8) | (col[2] << 16), yiq);
+		tile->palette[i][0] = yiq[0];
+		tile->palette[i][1] = yiq[1];
+		tile->palette[i][2] = yiq[2];
+	}
+	tile->nUsedColors = reduction->nUsedColors;
+
+	//match pixels to palette indices
+	for (int i = 0; i < 64; i++) {
+		int closest = findClosestPaletteColorRGB(&tile->palette[0][0], tile->nUsedColors, tile->rgb[i], NULL);
+		if ((tile->rgb[i] >> 24) == 0) closest = 15;
+		tile->indices[i] = closest;
+		tile->useCounts[closest]++;
+	}
+	tile->palIndex = index;
+	tile->nSwallowed = 1;
+}
+
+static void multiPaletteComputeDifferences(void *param, int index, int threadIndex) {
+	MULTIPALETTE_CONTEXT *context = (MULTIPALETTE_CONTEXT *) param;
+	int nTiles = context->nTiles;
+	int *row = context->diffBuff + index * nTiles;
+	TILE *tile2 = context->tiles + index;
+
+	//row i holds the differences of tile i's colors mapped to each other tile's palette
+	for (int j = 0; j < nTiles; j++) {
+		TILE *tile1 = context->tiles + j;
+
+		//write difference
+		if (index == j) row[j] = 0;
+		else row[j] = computeTilePaletteDifference(context->reductions[0], tile1, tile2);
+	}
+
+	//progress is polled by the UI thread while rows finish out of order
+	InterlockedIncrement(context->progress);
+}
+
 void createMultiplePalettes(COLOR32 *imgBits, int tilesX, int tilesY, COLOR32 *dest, int paletteBase, int nPalettes,
-							int paletteSize, int nColsPerPalette, int paletteOffset, int *progress) {
+							int paletteSize, int nColsPerPalette, int paletteOffset, volatile LONG *progress) {
 	createMultiplePalettesEx(imgBits, tilesX, tilesY, dest, paletteBase, nPalettes, paletteSize, nColsPerPalette, 
 							 paletteOffset, BALANCE_DEFAULT, BALANCE_DEFAULT, 0, progress);
 }
 
 void createMultiplePalettesEx(COLOR32 *imgBits, int tilesX, int tilesY, COLOR32 *dest, int paletteBase, int nPalettes,
 							  int paletteSize, int nColsPerPalette, int paletteOffset, int balance, 
-							  int colorBalance, int enhanceColors, int *progress) {
+							  int colorBalance, int enhanceColors, volatile LONG *progress) {
 	if (nPalettes == 0) return;
 	if (nPalettes == 1) {
 		if (paletteOffset) {
@@ -1356,69 +1911,47 @@ void createMultiplePalettesEx(COLOR32 *imgBits, int tilesX, int tilesY, COLOR32
 	//------------STAGE 1
 	int nTiles = tilesX * tilesY;
 	TILE *tiles = (TILE *) calloc(nTiles, sizeof(TILE));
-	REDUCTION *reduction = (REDUCTION *) calloc(1, sizeof(REDUCTION));
-	initReduction(reduction, balance, colorBalance, 15, enhanceColors, nColsPerPalette);
+	REDUCTION *reduction = reductionAcquire(balance, colorBalance, 15, enhanceColors, nColsPerPalette);
 	reduction->maskColors = FALSE;
-	COLOR32 palBuf[16];
-	for (int y = 0; y < tilesY; y++) {
-		for (int x = 0; x < tilesX; x++) {
-			TILE *tile = tiles + x + (y * tilesX);
-			COLOR32 *pxOrigin = imgBits + x * 8 + (y * 8 * tilesX * 8);
-			copyTile(tile, pxOrigin, tilesX * 8);
-
-			//createPaletteSlow(tile->rgb, 8, 8, palBuf + 1, 15);
-			resetHistogram(reduction);
-			computeHistogram(reduction, tile->rgb, 8, 8);
-			flattenHistogram(reduction);
-			optimizePalette(reduction);
-			for (int i = 0; i < 16; i++) {
-				uint8_t *col = &reduction->paletteRgb[i][0];
-				palBuf[i] = col[0] | (col[1] << 8) | (col[2] << 16);
-			}
 
-			for (int i = 0; i < 16; i++) {
-				int yiq[4];
-				rgbToYiq(palBuf[i], yiq);
-				tile->palette[i][0] = yiq[0];
-				tile->palette[i][1] = yiq[1];
-				tile->palette[i][2] = yiq[2];
-			}
-			tile->nUsedColors = reduction->nUsedColors;
-
-			//match pixels to palette indices
-			for (int i = 0; i < 64; i++) {
-				int index = findClosestPaletteColorRGB(&tile->palette[0][0], tile->nUsedColors, tile->rgb[i], NULL);
-				if ((tile->rgb[i] >> 24) == 0) index = 15;
-				tile->indices[i] = index;
-				tile->useCounts[index]++;
-			}
-			tile->palIndex = x + y * tilesX;
-			tile->nSwallowed = 1;
-		}
-	}
+	//each worker thread gets its own reduction, the calling thread uses the main one
+	int nThreads = parallelGetThreadCount();
+	REDUCTION **reductions = (REDUCTION **) calloc(nThreads, sizeof(REDUCTION *));
+	reductions[0] = reduction;
+
+	MULTIPALETTE_CONTEXT context;
+	context.imgBits = imgBits;
+	context.tilesX = tilesX;
+	context.tiles = tiles;
+	context.nTiles = nTiles;
+	context.diffBuff = NULL;
+	context.reductions = reductions;
+	context.balance = balance;
+	context.colorBalance = colorBalance;
+	context.enhanceColors = enhanceColors;
+	context.nColsPerPalette = nColsPerPalette;
+	context.progress = progress;
+	parallelFor(nTiles, multiPaletteCreateTile, &context);
+
+	for (int i = 1; i < nThreads; i++) {
+		if (reductions[i] != NULL) reductionRelease(reductions[i]);
+	}
+	free(reductions);
 
 	//-------------STAGE 2
+	//rows of the matrix are independent, and the reduction is only read from here.
 	int *diffBuff = (int *) calloc(nTiles * nTiles, sizeof(int));
-	for (int i = 0; i < nTiles; i++) {
-		TILE *tile1 = tiles + i;
-		for (int j = 0; j < nTiles; j++) {
-			TILE *tile2 = tiles + j;
-
-			//write difference
-			if (i == j) diffBuff[i + j * nTiles] = 0;
-			else {
-				diffBuff[i + j * nTiles] = computeTilePaletteDifference(reduction, tile1, tile2);
-			}
-		}
-		(*progress)++;
-	}
+	context.diffBuff = diffBuff;
+	context.reductions = &reduction;
+	parallelFor(nTiles, multiPaletteComputeDifferences, &context);
 
 	//-----------STAGE 3
 	int nCurrentPalettes = nTiles;
+	int *reps = (int *) calloc(nTiles, sizeof(int));
 	while (nCurrentPalettes > nPalettes) {
 
 		int index1, index2;
-		int diff = findSimilarTiles(tiles, diffBuff, nTiles, &index1, &index2);
+		int diff = findSimilarTiles(tiles, diffBuff, nTiles, reps, &index1, &index2);
 
 		//find all  instances of index2, replace with index1
 		int nSwitched = 0;
@@ -1479,8 +2012,9 @@ void createMultiplePalettesEx(COLOR32 *imgBits, int tilesX, int tilesY, COLOR32
 		}
 
 		nCurrentPalettes--;
-		(*progress)++;
+		InterlockedIncrement(progress);
 	}
+	free(reps);
 
 	//get palette output from previous step
 	int nPalettesWritten = 0;
@@ -1508,7 +2042,7 @@ void createMultiplePalettesEx(COLOR32 *imgBits, int tilesX, int tilesY, COLOR32
 		}
 		paletteIndices[nPalettesWritten] = i;
 		nPalettesWritten++;
-		(*progress)++;
+		InterlockedIncrement(progress);
 	}
 
 	//palette refinement
@@ -1598,17 +2132,18 @@ void createMultiplePalettesEx(COLOR32 *imgBits, int tilesX, int tilesY, COLOR32
 	}
 
 	free(bestPalettes);
-	destroyReduction(reduction);
-	free(reduction);
+	reductionRelease(reduction);
 	free(tiles);
 	free(diffBuff);
 }
 
 int createPaletteSlowEx(COLOR32 *img, int width, int height, COLOR32 *pal, unsigned int nColors, int balance, int colorBalance, int enhanceColors, int sortOnlyUsed) {
-	REDUCTION *reduction = (REDUCTION *) calloc(sizeof(REDUCTION), 1);
+	return createPaletteSampledEx(img, width, height, pal, nColors, balance, colorBalance, enhanceColors, sortOnlyUsed, HISTOGRAM_SAMPLES_FULL);
+}
 
-	initReduction(reduction, balance, colorBalance, 15, enhanceColors, nColors);
-	computeHistogram(reduction, img, width, height);
+int createPaletteSampledEx(COLOR32 *img, int width, int height, COLOR32 *pal, unsigned int nColors, int balance, int colorBalance, int enhanceColors, int sortOnlyUsed, int nSamples) {
+	REDUCTION *reduction = reductionAcquire(balance, colorBalance, 15, enhanceColors, nColors);
+	computeHistogramSampled(reduction, img, width, height, nSamples);
 	flattenHistogram(reduction);
 	optimizePalette(reduction);
 
@@ -1618,10 +2153,9 @@ int createPaletteSlowEx(COLOR32 *img, int width, int height, COLOR32 *pal, unsig
 		uint8_t b = reduction->paletteRgb[i][2];
 		pal[i] = r | (g << 8) | (b << 16);
 	}
-	destroyReduction(reduction);
 
 	int nProduced = reduction->nUsedColors;
-	free(reduction);
+	reductionRelease(reduction);
 
 	if (sortOnlyUsed) {
 		qsort(pal, nProduced, sizeof(COLOR32), lightnessCompare);
@@ -1650,6 +2184,32 @@ int diffuseCurveQ(int x) {
 	return (int) (8.5f + pow(x - 8, 0.85) * 0.89453125);
 }
 
+//the curves are tabulated over the range diffusion normally stays in, since
+//applying them is a large part of the work that can't be spread over threads.
+#define DIFFUSE_CURVE_RANGE 1024
+
+static int g_diffuseCurveTable[3][DIFFUSE_CURVE_RANGE * 2 + 1];
+static volatile LONG g_diffuseCurveState = 0; //0 - not built, 1 - being built, 2 - ready
+
+static void diffuseCurveInit(void) {
+	if (g_diffuseCurveState == 2) return;
+	if (InterlockedCompareExchange(&g_diffuseCurveState, 1, 0) == 0) {
+		for (int i = -DIFFUSE_CURVE_RANGE; i <= DIFFUSE_CURVE_RANGE; i++) {
+			g_diffuseCurveTable[0][i + DIFFUSE_CURVE_RANGE] = diffuseCurveY(i);
+			g_diffuseCurveTable[1][i + DIFFUSE_CURVE_RANGE] = diffuseCurveI(i);
+			g_diffuseCurveTable[2][i + DIFFUSE_CURVE_RANGE] = diffuseCurveQ(i);
+		}
+		InterlockedExchange(&g_diffuseCurveState, 2);
+	} else {
+		while (g_diffuseCurveState != 2) YieldProcessor();
+	}
+}
+
+static __inline int diffuseCurveLookup(int *table, int (*curve) (int), int x) {
+	if (x < -DIFFUSE_CURVE_RANGE || x > DIFFUSE_CURVE_RANGE) return curve(x);
+	return table[x + DIFFUSE_CURVE_RANGE];
+}
+
 int closestPaletteYiq(REDUCTION *reduction, int *yiqColor, int *palette, int nColors) {
 	double yw2 = reduction->yWeight * reduction->yWeight;
 	double iw2 = reduction->iWeight * reduction->iWeight;
@@ -1678,201 +2238,551 @@ void ditherImagePalette(COLOR32 *img, int width, int height, COLOR32 *palette, i
 	ditherImagePaletteEx(img, NULL, width, height, palette, nColors, touchAlpha, binaryAlpha, c0xp, diffuse, BALANCE_DEFAULT, BALANCE_DEFAULT, FALSE);
 }
 
-void ditherImagePaletteEx(COLOR32 *img, int *indices, int width, int height, COLOR32 *palette, int nColors, int touchAlpha, int binaryAlpha, int c0xp, float diffuse, int balance, int colorBalance, int enhanceColors) {
-	REDUCTION *reduction = (REDUCTION *) calloc(1, sizeof(REDUCTION));
-	initReduction(reduction, balance, colorBalance, 15, enhanceColors, nColors);
-
-	//convert palette to YIQ
-	int *yiqPalette = (int *) calloc(nColors, 4 * sizeof(int));
-	for (int i = 0; i < nColors; i++) {
-		rgbToYiq(palette[i], yiqPalette + i * 4);
-	}
-
-	//allocate row buffers for color and diffuse.
-	int *thisRow = (int *) calloc(width + 2, 16);
-	int *lastRow = (int *) calloc(width + 2, 16);
-	int *thisDiffuse = (int *) calloc(width + 2, 16);
-	int *nextDiffuse = (int *) calloc(width + 2, 16);
+//images smaller than this are dithered on the calling thread only
+#define DITHER_PARALLEL_MIN_PIXELS 0x10000
+
+//Dithering is split in two. Whether a pixel is diffused, and the color of each
+//pixel that isn't, depends only on the source image, so rows of that are worked
+//out ahead by any thread. The error diffusion itself has to follow the
+//serpentine path, so one thread carries it out row by row as rows become ready.
+//Rows are written back to the image once the row below has read them.
+
+typedef struct DITHER_ROW_ {
+	int *color;                //averaged YIQA of diffused pixels, or the matched index and alpha
+	uint8_t *diffuse;          //whether each pixel takes part in error diffusion
+	volatile LONG row;         //row held, or -1
+} DITHER_ROW;
+
+typedef struct DITHER_CONTEXT_ {
+	COLOR32 *img;
+	int *indices;
+	int width;
+	int height;
+	COLOR32 *palette;
+	int *yiqPalette;
+	int nColors;
+	int touchAlpha;
+	int binaryAlpha;
+	int c0xp;
+	float diffuse;
+	REDUCTION *reduction;
+	DITHER_ROW *rows;          //ring of rows in flight
+	int nRows;
+	volatile LONG nextRow;     //next row to be averaged
+	volatile LONG nRowsDone;   //rows written back to the image
+} DITHER_CONTEXT;
+
+typedef struct DITHER_THREAD_ {
+	PALETTE_SEARCH_YIQ search;
+	int *lastRow;              //YIQA of the source rows, padded by a pixel each side
+	int *thisRow;
+	int thisRowIndex;          //row held in thisRow, or -1
+} DITHER_THREAD;
+
+static void ditherThreadInit(DITHER_CONTEXT *context, DITHER_THREAD *thread, int nQueries) {
+	int c0xp = context->c0xp;
+	paletteSearchInitYiq(&thread->search, context->reduction, context->yiqPalette + c0xp * 4, context->nColors - c0xp, nQueries);
+	thread->lastRow = (int *) calloc(context->width + 2, 16);
+	thread->thisRow = (int *) calloc(context->width + 2, 16);
+	thread->thisRowIndex = -1;
+}
 
-	//fill the last row with the first row, just to make sure we don't run out of bounds
-	for (int i = 0; i < width; i++) {
-		rgbToYiq(img[i], lastRow + 4 * (i + 1));
-	}
-	memcpy(lastRow, lastRow + 4, 16);
-	memcpy(lastRow + 4 * (width + 1), lastRow + 4 * width, 16);
+static void ditherThreadFree(DITHER_THREAD *thread) {
+	paletteSearchFreeYiq(&thread->search);
+	free(thread->lastRow);
+	free(thread->thisRow);
+}
 
-	//start dithering, do so in a serpentine path.
-	for (int y = 0; y < height; y++) {
+static void ditherConvertRow(DITHER_CONTEXT *context, int y, int *dest) {
+	int width = context->width;
+	rgbToYiqBatch(context->img + y * width, width, dest + 4);
+	memcpy(dest, dest + 4, 16);
+	memcpy(dest + 4 * (width + 1), dest + 4 * width, 16);
+}
 
-		//which direction?
-		int hDirection = (y & 1) ? -1 : 1;
-		COLOR32 *rgbRow = img + y * width;
-		for (int x = 0; x < width; x++) {
-			rgbToYiq(rgbRow[x], thisRow + 4 * (x + 1));
+static void ditherAverageRow(DITHER_CONTEXT *context, DITHER_THREAD *thread, int y) {
+	REDUCTION *reduction = context->reduction;
+	int width = context->width;
+	int c0xp = context->c0xp;
+	int *yiqPalette = context->yiqPalette;
+
+	//the first row uses itself as the row above. Reuse the row converted last when possible.
+	int lastIndex = y == 0 ? 0 : y - 1;
+	if (thread->thisRowIndex == lastIndex) {
+		int *temp = thread->lastRow;
+		thread->lastRow = thread->thisRow;
+		thread->thisRow = temp;
+	} else {
+		ditherConvertRow(context, lastIndex, thread->lastRow);
+	}
+	ditherConvertRow(context, y, thread->thisRow);
+	thread->thisRowIndex = y;
+	int *thisRow = thread->thisRow;
+	int *lastRow = thread->lastRow;
+
+	DITHER_ROW *row = context->rows + (y % context->nRows);
+	for (int x = 0; x < width; x++) {
+		//take a sample of pixels nearby. This will be a gauge of variance around this pixel, and help
+		//determine if dithering should happen. Weight the sampled pixels with respect to distance from center.
+
+		int colorY = (thisRow[(x + 1) * 4 + 0] * 3 + thisRow[(x + 2) * 4 + 0] * 3 + thisRow[x * 4 + 0] * 3 + lastRow[(x + 1) * 4 + 0] * 3
+					  + lastRow[x * 4 + 0] * 2 + lastRow[(x + 2) * 4 + 0] * 2) / 16;
+		int colorI = (thisRow[(x + 1) * 4 + 1] * 3 + thisRow[(x + 2) * 4 + 1] * 3 + thisRow[x * 4 + 1] * 3 + lastRow[(x + 1) * 4 + 1] * 3
+					  + lastRow[x * 4 + 1] * 2 + lastRow[(x + 2) * 4 + 1] * 2) / 16;
+		int colorQ = (thisRow[(x + 1) * 4 + 2] * 3 + thisRow[(x + 2) * 4 + 2] * 3 + thisRow[x * 4 + 2] * 3 + lastRow[(x + 1) * 4 + 2] * 3
+					  + lastRow[x * 4 + 2] * 2 + lastRow[(x + 2) * 4 + 2] * 2) / 16;
+		int colorA = thisRow[(x + 1) * 4 + 3];
+
+		if (context->touchAlpha && context->binaryAlpha) {
+			if (colorA < 128) {
+				colorY = 0;
+				colorI = 0;
+				colorQ = 0;
+				colorA = 0;
+			}
 		}
-		memcpy(thisRow, thisRow + 4, 16);
-		memcpy(thisRow + 4 * (width + 1), thisRow + 4 * width, 16);
-
-		//scan across
-		int startPos = (hDirection == 1) ? 0 : (width - 1);
-		int x = startPos;
-		for (int xPx = 0; xPx < width; xPx++) {
-			//take a sample of pixels nearby. This will be a gauge of variance around this pixel, and help
-			//determine if dithering should happen. Weight the sampled pixels with respect to distance from center.
-
-			int colorY = (thisRow[(x + 1) * 4 + 0] * 3 + thisRow[(x + 2) * 4 + 0] * 3 + thisRow[x * 4 + 0] * 3 + lastRow[(x + 1) * 4 + 0] * 3
-						  + lastRow[x * 4 + 0] * 2 + lastRow[(x + 2) * 4 + 0] * 2) / 16;
-			int colorI = (thisRow[(x + 1) * 4 + 1] * 3 + thisRow[(x + 2) * 4 + 1] * 3 + thisRow[x * 4 + 1] * 3 + lastRow[(x + 1) * 4 + 1] * 3
-						  + lastRow[x * 4 + 1] * 2 + lastRow[(x + 2) * 4 + 1] * 2) / 16;
-			int colorQ = (thisRow[(x + 1) * 4 + 2] * 3 + thisRow[(x + 2) * 4 + 2] * 3 + thisRow[x * 4 + 2] * 3 + lastRow[(x + 1) * 4 + 2] * 3
-						  + lastRow[x * 4 + 2] * 2 + lastRow[(x + 2) * 4 + 2] * 2) / 16;
-			int colorA = thisRow[(x + 1) * 4 + 3];
-
-			if (touchAlpha && binaryAlpha) {
-				if (colorA < 128) {
-					colorY = 0;
-					colorI = 0;
-					colorQ = 0;
-					colorA = 0;
+
+		//match it to a palette color. We'll measure distance to it as well.
+		int colorYiq[] = { colorY, colorI, colorQ, colorA };
+		int matched = c0xp + paletteSearchClosestYiq(&thread->search, colorYiq);
+		if (colorA == 0 && c0xp) matched = 0;
+
+		//measure distance. From middle color to sampled color, and from palette color to sampled color.
+		int *matchedYiq = yiqPalette + matched * 4;
+		double paletteDy = reduction->lumaTable[matchedYiq[0]] - reduction->lumaTable[colorY];
+		int paletteDi = matchedYiq[1] - colorI;
+		int paletteDq = matchedYiq[2] - colorQ;
+		double paletteDistance = paletteDy * paletteDy * reduction->yWeight * reduction->yWeight +
+			paletteDi * paletteDi * reduction->iWeight * reduction->iWeight +
+			paletteDq * paletteDq * reduction->qWeight * reduction->qWeight;
+
+		//now measure distance from the actual color to its average surroundings
+		int centerY = thisRow[(x + 1) * 4 + 0];
+		int centerI = thisRow[(x + 1) * 4 + 1];
+		int centerQ = thisRow[(x + 1) * 4 + 2];
+		int centerA = thisRow[(x + 1) * 4 + 3];
+		int centerYiq[] = { centerY, centerI, centerQ, centerA };
+
+		double centerDy = reduction->lumaTable[centerY] - reduction->lumaTable[colorY];
+		int centerDi = centerI - colorI;
+		int centerDq = centerQ - colorQ;
+		double centerDistance = centerDy * centerDy * reduction->yWeight * reduction->yWeight +
+			centerDi * centerDi * reduction->iWeight * reduction->iWeight +
+			centerDq * centerDq * reduction->qWeight * reduction->qWeight;
+
+		//now test: Should we dither?
+		int *dest = row->color + x * 4;
+		double balanceSquare = reduction->yWeight * reduction->yWeight;
+		if (centerDistance < 110.0 * balanceSquare && paletteDistance >  2.0 * balanceSquare && context->diffuse > 0.0f) {
+			//Yes, we should dither :) That happens in order, in ditherDiffuseRow.
+			row->diffuse[x] = 1;
+			dest[0] = colorY;
+			dest[1] = colorI;
+			dest[2] = colorQ;
+			dest[3] = colorA;
+		} else {
+			//anomaly in the picture, just match the original color. Don't diffuse, it'll cause issues.
+			//That or the color is pretty homogeneous here, so dithering is bad anyway.
+			if (c0xp && context->touchAlpha) {
+				if (centerYiq[3] < 128) {
+					centerYiq[0] = 0;
+					centerYiq[1] = 0;
+					centerYiq[2] = 0;
+					centerYiq[3] = 0;
 				}
 			}
 
-			//match it to a palette color. We'll measure distance to it as well.
-			int colorYiq[] = { colorY, colorI, colorQ, colorA };
-			int matched = c0xp + closestPaletteYiq(reduction, colorYiq, yiqPalette + c0xp * 4, nColors - c0xp);
-			if (colorA == 0 && c0xp) matched = 0;
-
-			//measure distance. From middle color to sampled color, and from palette color to sampled color.
-			int *matchedYiq = yiqPalette + matched * 4;
-			double paletteDy = reduction->lumaTable[matchedYiq[0]] - reduction->lumaTable[colorY];
-			int paletteDi = matchedYiq[1] - colorI;
-			int paletteDq = matchedYiq[2] - colorQ;
-			double paletteDistance = paletteDy * paletteDy * reduction->yWeight * reduction->yWeight +
-				paletteDi * paletteDi * reduction->iWeight * reduction->iWeight +
-				paletteDq * paletteDq * reduction->qWeight * reduction->qWeight;
-
-			//now measure distance from the actual color to its average surroundings
-			int centerY = thisRow[(x + 1) * 4 + 0];
-			int centerI = thisRow[(x + 1) * 4 + 1];
-			int centerQ = thisRow[(x + 1) * 4 + 2];
-			int centerA = thisRow[(x + 1) * 4 + 3];
-			int centerYiq[] = { centerY, centerI, centerQ, centerA };
-
-			double centerDy = reduction->lumaTable[centerY] - reduction->lumaTable[colorY];
-			int centerDi = centerI - colorI;
-			int centerDq = centerQ - colorQ;
-			double centerDistance = centerDy * centerDy * reduction->yWeight * reduction->yWeight +
-				centerDi * centerDi * reduction->iWeight * reduction->iWeight +
-				centerDq * centerDq * reduction->qWeight * reduction->qWeight;
-
-			//now test: Should we dither?
-			double balanceSquare = reduction->yWeight * reduction->yWeight;
-			if (centerDistance < 110.0 * balanceSquare && paletteDistance >  2.0 * balanceSquare && diffuse > 0.0f) {
-				//Yes, we should dither :)
-
-				int diffuseY = (int) (thisDiffuse[(x + 1) * 4 + 0] * diffuse / 16); //correct for Floyd-Steinberg coefficients
-				int diffuseI = (int) (thisDiffuse[(x + 1) * 4 + 1] * diffuse / 16);
-				int diffuseQ = (int) (thisDiffuse[(x + 1) * 4 + 2] * diffuse / 16);
-				int diffuseA = (int) (thisDiffuse[(x + 1) * 4 + 3] * diffuse / 16);
-
-				if (!touchAlpha || binaryAlpha) diffuseA = 0; //don't diffuse alpha if no alpha channel, or we're told not to
-
-				colorY += diffuseCurveY(diffuseY);
-				colorI += diffuseCurveI(diffuseI);
-				colorQ += diffuseCurveQ(diffuseQ);
-				colorA += diffuseA;
-				if (colorY < 0) { //clamp just in case
-					colorY = 0;
-					colorI = 0;
-					colorQ = 0;
-				} else if (colorY > 511) {
-					colorY = 511;
-					colorI = 0;
-					colorQ = 0;
-				}
+			matched = c0xp + paletteSearchClosestYiq(&thread->search, centerYiq);
+			if (c0xp && centerYiq[3] < 128) matched = 0;
+			row->diffuse[x] = 0;
+			dest[0] = matched;
+			dest[1] = centerYiq[3];
+		}
+	}
 
-				if (colorA < 0) colorA = 0;
-				else if (colorA > 255) colorA = 255;
-
-				//match to palette color
-				int diffusedYiq[] = { colorY, colorI, colorQ, colorA };
-				matched = c0xp + closestPaletteYiq(reduction, diffusedYiq, yiqPalette + c0xp * 4, nColors - c0xp);
-				if (diffusedYiq[3] < 128 && c0xp) matched = 0;
-				COLOR32 chosen = (palette[matched] & 0xFFFFFF) | (colorA << 24);
-				img[x + y * width] = chosen;
-				if (indices != NULL) indices[x + y * width] = matched;
-
-				int *chosenYiq = yiqPalette + matched * 4;
-				int offY = colorY - chosenYiq[0];
-				int offI = colorI - chosenYiq[1];
-				int offQ = colorQ - chosenYiq[2];
-				int offA = colorA - chosenYiq[3];
-
-				//now diffuse to neighbors
-				int *diffNextPixel = thisDiffuse + (x + 1 + hDirection) * 4 + 0;
-				int *diffDownPixel = nextDiffuse + (x + 1) * 4 + 0;
-				int *diffNextDownPixel = nextDiffuse + (x + 1 + hDirection) * 4 + 0;
-				int *diffBackDownPixel = nextDiffuse + (x + 1 - hDirection) * 4 + 0;
-
-				if (colorA >= 128 || !binaryAlpha) { //don't dither if there's no alpha channel and this is transparent!
-					diffNextPixel[0] += offY * 7;
-					diffNextPixel[1] += offI * 7;
-					diffNextPixel[2] += offQ * 7;
-					diffNextPixel[3] += offA * 7;
-					diffDownPixel[0] += offY * 5;
-					diffDownPixel[1] += offI * 5;
-					diffDownPixel[2] += offQ * 5;
-					diffDownPixel[3] += offA * 5;
-					diffBackDownPixel[0] += offY * 3;
-					diffBackDownPixel[1] += offI * 3;
-					diffBackDownPixel[2] += offQ * 3;
-					diffBackDownPixel[3] += offA * 3;
-					diffNextDownPixel[0] += offY * 1;
-					diffNextDownPixel[1] += offI * 1;
-					diffNextDownPixel[2] += offQ * 1;
-					diffNextDownPixel[3] += offA * 1;
-				}
+	//publish the row to the diffusing thread
+	InterlockedExchange(&row->row, y);
+}
 
-			} else {
-				//anomaly in the picture, just match the original color. Don't diffuse, it'll cause issues.
-				//That or the color is pretty homogeneous here, so dithering is bad anyway.
-				if (c0xp && touchAlpha) {
-					if (centerYiq[3] < 128) {
-						centerYiq[0] = 0;
-						centerYiq[1] = 0;
-						centerYiq[2] = 0;
-						centerYiq[3] = 0;
-					}
-				}
+static void ditherDiffuseRow(DITHER_CONTEXT *context, DITHER_THREAD *thread, int y, int *thisDiffuse, int *nextDiffuse) {
+	int width = context->width;
+	int c0xp = context->c0xp;
+	int touchAlpha = context->touchAlpha, binaryAlpha = context->binaryAlpha;
+	float diffuse = context->diffuse;
+	int *yiqPalette = context->yiqPalette;
+	DITHER_ROW *row = context->rows + (y % context->nRows);
+
+	//which direction?
+	int hDirection = (y & 1) ? -1 : 1;
+
+	//scan across
+	int startPos = (hDirection == 1) ? 0 : (width - 1);
+	int x = startPos;
+	for (int xPx = 0; xPx < width; xPx++) {
+		if (row->diffuse[x]) {
+			int *color = row->color + x * 4;
+			int colorY = color[0], colorI = color[1], colorQ = color[2], colorA = color[3];
+
+			int diffuseY = (int) (thisDiffuse[(x + 1) * 4 + 0] * diffuse / 16); //correct for Floyd-Steinberg coefficients
+			int diffuseI = (int) (thisDiffuse[(x + 1) * 4 + 1] * diffuse / 16);
+			int diffuseQ = (int) (thisDiffuse[(x + 1) * 4 + 2] * diffuse / 16);
+			int diffuseA = (int) (thisDiffuse[(x + 1) * 4 + 3] * diffuse / 16);
+
+			if (!touchAlpha || binaryAlpha) diffuseA = 0; //don't diffuse alpha if no alpha channel, or we're told not to
+
+			colorY += diffuseCurveLookup(g_diffuseCurveTable[0], diffuseCurveY, diffuseY);
+			colorI += diffuseCurveLookup(g_diffuseCurveTable[1], diffuseCurveI, diffuseI);
+			colorQ += diffuseCurveLookup(g_diffuseCurveTable[2], diffuseCurveQ, diffuseQ);
+			colorA += diffuseA;
+			if (colorY < 0) { //clamp just in case
+				colorY = 0;
+				colorI = 0;
+				colorQ = 0;
+			} else if (colorY > 511) {
+				colorY = 511;
+				colorI = 0;
+				colorQ = 0;
+			}
 
-				matched = c0xp + closestPaletteYiq(reduction, centerYiq, yiqPalette + c0xp * 4, nColors - c0xp);
-				if (c0xp && centerYiq[3] < 128) matched = 0;
-				COLOR32 chosen = (palette[matched] & 0xFFFFFF) | (centerYiq[3] << 24);
-				img[x + y * width] = chosen;
-				if (indices != NULL) indices[x + y * width] = matched;
+			if (colorA < 0) colorA = 0;
+			else if (colorA > 255) colorA = 255;
+
+			//match to palette color
+			int diffusedYiq[] = { colorY, colorI, colorQ, colorA };
+			int matched = c0xp + paletteSearchClosestYiq(&thread->search, diffusedYiq);
+			if (diffusedYiq[3] < 128 && c0xp) matched = 0;
+			color[0] = matched;
+			color[1] = colorA;
+
+			int *chosenYiq = yiqPalette + matched * 4;
+			int offY = colorY - chosenYiq[0];
+			int offI = colorI - chosenYiq[1];
+			int offQ = colorQ - chosenYiq[2];
+			int offA = colorA - chosenYiq[3];
+
+			//now diffuse to neighbors
+			int *diffNextPixel = thisDiffuse + (x + 1 + hDirection) * 4 + 0;
+			int *diffDownPixel = nextDiffuse + (x + 1) * 4 + 0;
+			int *diffNextDownPixel = nextDiffuse + (x + 1 + hDirection) * 4 + 0;
+			int *diffBackDownPixel = nextDiffuse + (x + 1 - hDirection) * 4 + 0;
+
+			if (colorA >= 128 || !binaryAlpha) { //don't dither if there's no alpha channel and this is transparent!
+				diffNextPixel[0] += offY * 7;
+				diffNextPixel[1] += offI * 7;
+				diffNextPixel[2] += offQ * 7;
+				diffNextPixel[3] += offA * 7;
+				diffDownPixel[0] += offY * 5;
+				diffDownPixel[1] += offI * 5;
+				diffDownPixel[2] += offQ * 5;
+				diffDownPixel[3] += offA * 5;
+				diffBackDownPixel[0] += offY * 3;
+				diffBackDownPixel[1] += offI * 3;
+				diffBackDownPixel[2] += offQ * 3;
+				diffBackDownPixel[3] += offA * 3;
+				diffNextDownPixel[0] += offY * 1;
+				diffNextDownPixel[1] += offI * 1;
+				diffNextDownPixel[2] += offQ * 1;
+				diffNextDownPixel[3] += offA * 1;
 			}
+		}
+
+		x += hDirection;
+	}
+}
+
+static void ditherWriteRow(DITHER_CONTEXT *context, int y) {
+	int width = context->width;
+	DITHER_ROW *row = context->rows + (y % context->nRows);
+	COLOR32 *img = context->img + y * width;
+	for (int x = 0; x < width; x++) {
+		int matched = row->color[x * 4 + 0];
+		img[x] = (context->palette[matched] & 0xFFFFFF) | (row->color[x * 4 + 1] << 24);
+		if (context->indices != NULL) context->indices[x + y * width] = matched;
+	}
+	InterlockedExchange(&context->nRowsDone, y + 1);
+}
 
-			x += hDirection;
+static void ditherRunDiffusion(DITHER_CONTEXT *context, DITHER_THREAD *thread) {
+	int width = context->width, height = context->height;
+	int *thisDiffuse = (int *) calloc(width + 2, 16);
+	int *nextDiffuse = (int *) calloc(width + 2, 16);
+
+	for (int y = 0; y < height; y++) {
+		//wait for the row, averaging it here if no other thread has taken it yet.
+		DITHER_ROW *row = context->rows + (y % context->nRows);
+		while (row->row != y) {
+			if (InterlockedCompareExchange(&context->nextRow, y + 1, y) == y) {
+				ditherAverageRow(context, thread, y);
+			} else {
+				Sleep(0);
+			}
 		}
 
+		ditherDiffuseRow(context, thread, y, thisDiffuse, nextDiffuse);
+
+		//the row above has now been read by every row that needs it
+		if (y > 0) ditherWriteRow(context, y - 1);
+
 		//swap row buffers
-		int *temp = thisRow;
-		thisRow = lastRow;
-		lastRow = temp;
-		temp = nextDiffuse;
+		int *temp = nextDiffuse;
 		nextDiffuse = thisDiffuse;
 		thisDiffuse = temp;
 		memset(nextDiffuse, 0, 16 * (width + 2));
 	}
+	if (height > 0) ditherWriteRow(context, height - 1);
 
-	free(yiqPalette);
-	free(thisRow);
-	free(lastRow);
 	free(thisDiffuse);
 	free(nextDiffuse);
+}
+
+static void ditherWorker(void *param, int index, int threadIndex) {
+	DITHER_CONTEXT *context = (DITHER_CONTEXT *) param;
+	DITHER_THREAD thread;
+	ditherThreadInit(context, &thread, context->width * context->height);
 
-	destroyReduction(reduction);
-	free(reduction);
+	if (index == 0) {
+		ditherRunDiffusion(context, &thread);
+	} else {
+		while (1) {
+			int y = InterlockedIncrement(&context->nextRow) - 1;
+			if (y >= context->height) break;
+
+			//the row's slot is free once the row nRows above it is written back
+			while (y >= context->nRowsDone + context->nRows) {
+				Sleep(0);
+			}
+			ditherAverageRow(context, &thread, y);
+		}
+	}
+	ditherThreadFree(&thread);
+}
+
+void ditherImagePaletteEx(COLOR32 *img, int *indices, int width, int height, COLOR32 *palette, int nColors, int touchAlpha, int binaryAlpha, int c0xp, float diffuse, int balance, int colorBalance, int enhanceColors) {
+	REDUCTION *reduction = reductionAcquire(balance, colorBalance, 15, enhanceColors, nColors);
+
+	//convert palette to YIQ
+	int *yiqPalette = (int *) calloc(nColors, 4 * sizeof(int));
+	rgbToYiqBatch(palette, nColors, yiqPalette);
+
+	if (diffuse > 0.0f) diffuseCurveInit();
+
+	DITHER_CONTEXT context;
+	context.img = img;
+	context.indices = indices;
+	context.width = width;
+	context.height = height;
+	context.palette = palette;
+	context.yiqPalette = yiqPalette;
+	context.nColors = nColors;
+	context.touchAlpha = touchAlpha;
+	context.binaryAlpha = binaryAlpha;
+	context.c0xp = c0xp;
+	context.diffuse = diffuse;
+	context.reduction = reduction;
+	context.nextRow = 0;
+	context.nRowsDone = 0;
+
+	int nThreads = 1;
+	if (width * height >= DITHER_PARALLEL_MIN_PIXELS) nThreads = min(parallelGetThreadCount(), height);
+
+	//enough rows in flight to keep the averaging threads ahead of the diffusion
+	context.nRows = nThreads == 1 ? 2 : (nThreads * 4);
+	context.rows = (DITHER_ROW *) calloc(context.nRows, sizeof(DITHER_ROW));
+	int *colors = (int *) calloc(context.nRows * width, 4 * sizeof(int));
+	uint8_t *diffuseFlags = (uint8_t *) calloc(context.nRows, width);
+	for (int i = 0; i < context.nRows; i++) {
+		context.rows[i].color = colors + i * width * 4;
+		context.rows[i].diffuse = diffuseFlags + i * width;
+		context.rows[i].row = -1;
+	}
+
+	if (nThreads == 1) {
+		ditherWorker(&context, 0, 0);
+	} else {
+		parallelFor(nThreads, ditherWorker, &context);
+	}
+
+	free(colors);
+	free(diffuseFlags);
+	free(context.rows);
+	free(yiqPalette);
+
+	reductionRelease(reduction);
+}
+
+typedef struct ORDERED_DITHER_CONTEXT_ {
+	COLOR32 *img;
+	int *indices;
+	int width;
+	COLOR32 *palette;
+	int *yiqPalette;
+	int nColors;
+	int touchAlpha;
+	int binaryAlpha;
+	int c0xp;
+	int nQueries;
+	REDUCTION *reduction;
+	const DITHER_OFFSETS *offsets;
+	PALETTE_SEARCH_YIQ *searches;  //one per worker thread, set up on first use
+	int **rowBuffers;              //one per worker thread, allocated on first use
+} ORDERED_DITHER_CONTEXT;
+
+void ditherOrderedComputeOffsets(REDUCTION *reduction, COLOR32 *palette, int nColors, float amount, int matrixSize, DITHER_OFFSETS *offsets) {
+	int yiqPaletteStack[16 * 4]; //small palettes
+	int *yiqPalette = yiqPaletteStack;
+	if (nColors > 16) {
+		yiqPalette = (int *) calloc(nColors, 4 * sizeof(int));
+	}
+	rgbToYiqBatch(palette, nColors, yiqPalette);
+
+	//the threshold should span the gap between neighboring palette colors. Take
+	//the average distance from each color to its closest other color per channel.
+	double spreadY = 0.0, spreadI = 0.0, spreadQ = 0.0;
+	if (nColors > 1) {
+		for (int i = 0; i < nColors; i++) {
+			int *yiq1 = yiqPalette + i * 4;
+			int *best = yiq1;
+			double bestDistance = 1e32;
+			for (int j = 0; j < nColors; j++) {
+				int *yiq2 = yiqPalette + j * 4;
+				if (j == i) continue;
+
+				double dst = computeColorDifferenceYiq(reduction, yiq1, yiq2);
+				if (dst < bestDistance) {
+					bestDistance = dst;
+					best = yiq2;
+				}
+			}
+			spreadY += abs(best[0] - yiq1[0]);
+			spreadI += abs(best[1] - yiq1[1]);
+			spreadQ += abs(best[2] - yiq1[2]);
+		}
+		spreadY /= nColors;
+		spreadI /= nColors;
+		spreadQ /= nColors;
+	}
+	if (yiqPalette != yiqPaletteStack) free(yiqPalette);
+
+	//the top-left 4x4 of the 8x8 matrix is the 4x4 Bayer matrix times 4. Images too
+	//small for the whole 8x8 matrix repeat that 4x4 over the table, with thresholds
+	//centered on its 16 levels, so they aren't biased by reading one quadrant only.
+	//I and Q read the matrix half a period over from Y, so the chroma offsets
+	//don't all rise and fall together with luma.
+	int mask = matrixSize - 1, half = matrixSize / 2, shift = matrixSize == 4 ? 2 : 0;
+	int nLevels = matrixSize * matrixSize;
+	for (int y = 0; y < 8; y++) {
+		for (int x = 0; x < 8; x++) {
+			int x2 = x & mask, y2 = y & mask;
+			double tY = ((g_ditherBayer8x8[y2][x2] >> shift) * 2 + 1 - nLevels) / (2.0 * nLevels) * amount;
+			double tI = ((g_ditherBayer8x8[y2][(x2 + half) & mask] >> shift) * 2 + 1 - nLevels) / (2.0 * nLevels) * amount;
+			double tQ = ((g_ditherBayer8x8[(y2 + half) & mask][x2] >> shift) * 2 + 1 - nLevels) / (2.0 * nLevels) * amount;
+			offsets->offsets[y][x][0] = (int) floor(spreadY * tY + 0.5);
+			offsets->offsets[y][x][1] = (int) floor(spreadI * tI + 0.5);
+			offsets->offsets[y][x][2] = (int) floor(spreadQ * tQ + 0.5);
+		}
+	}
+}
+
+static void ditherOrderedRow(void *param, int y, int threadIndex) {
+	ORDERED_DITHER_CONTEXT *context = (ORDERED_DITHER_CONTEXT *) param;
+	int width = context->width, c0xp = context->c0xp;
+	int touchAlpha = context->touchAlpha, binaryAlpha = context->binaryAlpha;
+
+	PALETTE_SEARCH_YIQ *search = context->searches + threadIndex;
+	int *yiqRow = context->rowBuffers[threadIndex];
+	if (yiqRow == NULL) {
+		paletteSearchInitYiq(search, context->reduction, context->yiqPalette + c0xp * 4, context->nColors - c0xp, context->nQueries);
+		yiqRow = (int *) calloc(width, 4 * sizeof(int));
+		context->rowBuffers[threadIndex] = yiqRow;
+	}
+
+	COLOR32 *img = context->img + y * width;
+	rgbToYiqBatch(img, width, yiqRow);
+	for (int x = 0; x < width; x++) {
+		int *yiq = yiqRow + x * 4;
+		const int *offset = context->offsets->offsets[y & 7][x & 7];
+
+		int colorY = min(max(yiq[0] + offset[0], 0), 511);
+		int colorI = min(max(yiq[1] + offset[1], -320), 319);
+		int colorQ = min(max(yiq[2] + offset[2], -270), 269);
+		int colorA = yiq[3];
+		if (touchAlpha && binaryAlpha && colorA < 128) {
+			colorY = 0;
+			colorI = 0;
+			colorQ = 0;
+			colorA = 0;
+		}
+
+		int colorYiq[] = { colorY, colorI, colorQ, colorA };
+		int matched = c0xp + paletteSearchClosestYiq(search, colorYiq);
+		if (c0xp && colorA < 128) matched = 0;
+
+		img[x] = (context->palette[matched] & 0xFFFFFF) | (colorA << 24);
+		if (context->indices != NULL) context->indices[x + y * width] = matched;
+	}
+}
+
+void ditherImagePaletteOrdered(COLOR32 *img, int *indices, int width, int height, COLOR32 *palette, int nColors, int touchAlpha, int binaryAlpha, int c0xp, float amount, int balance, int colorBalance, int enhanceColors) {
+	ditherImagePaletteOrderedEx(img, indices, width, height, palette, nColors, touchAlpha, binaryAlpha, c0xp, amount, NULL, balance, colorBalance, enhanceColors);
+}
+
+void ditherImagePaletteOrderedEx(COLOR32 *img, int *indices, int width, int height, COLOR32 *palette, int nColors, int touchAlpha, int binaryAlpha, int c0xp, float amount, const DITHER_OFFSETS *offsets, int balance, int colorBalance, int enhanceColors) {
+	REDUCTION *reduction = reductionAcquire(balance, colorBalance, 15, enhanceColors, nColors);
+
+	DITHER_OFFSETS computed;
+	if (offsets == NULL) {
+		ditherOrderedComputeOffsets(reduction, palette + c0xp, nColors - c0xp, amount, DITHER_MATRIX_SIZE(width, height), &computed);
+		offsets = &computed;
+	}
+
+	int *yiqPalette = (int *) calloc(nColors, 4 * sizeof(int));
+	rgbToYiqBatch(palette, nColors, yiqPalette);
+
+	ORDERED_DITHER_CONTEXT context;
+	context.img = img;
+	context.indices = indices;
+	context.width = width;
+	context.palette = palette;
+	context.yiqPalette = yiqPalette;
+	context.nColors = nColors;
+	context.touchAlpha = touchAlpha;
+	context.binaryAlpha = binaryAlpha;
+	context.c0xp = c0xp;
+	context.nQueries = width * height;
+	context.reduction = reduction;
+	context.offsets = offsets;
+
+	//rows don't depend on each other. Small images, such as single tiles dithered
+	//from inside other parallel loops, stay on the calling thread.
+	int nThreads = width * height >= DITHER_PARALLEL_MIN_PIXELS ? parallelGetThreadCount() : 1;
+	context.searches = (PALETTE_SEARCH_YIQ *) calloc(nThreads, sizeof(PALETTE_SEARCH_YIQ));
+	context.rowBuffers = (int **) calloc(nThreads, sizeof(int *));
+	if (nThreads == 1) {
+		for (int y = 0; y < height; y++) {
+			ditherOrderedRow(&context, y, 0);
+		}
+	} else {
+		parallelFor(height, ditherOrderedRow, &context);
+	}
+
+	for (int i = 0; i < nThreads; i++) {
+		if (context.rowBuffers[i] == NULL) continue;
+		paletteSearchFreeYiq(context.searches + i);
+		free(context.rowBuffers[i]);
+	}
+	free(context.searches);
+	free(context.rowBuffers);
+	free(yiqPalette);
+
+	reductionRelease(reduction);
+}
+
+void ditherImagePaletteMode(COLOR32 *img, int *indices, int width, int height, COLOR32 *palette, int nColors, int touchAlpha, int binaryAlpha, int c0xp, int dither, float amount, int balance, int colorBalance, int enhanceColors, const DITHER_OFFSETS *offsets) {
+	if (dither == DITHER_ORDERED) {
+		ditherImagePaletteOrderedEx(img, indices, width, height, palette, nColors, touchAlpha, binaryAlpha, c0xp, amount, offsets, balance, colorBalance, enhanceColors);
+	} else {
+		ditherImagePaletteEx(img, indices, width, height, palette, nColors, touchAlpha, binaryAlpha, c0xp, dither ? amount : 0.0f, balance, colorBalance, enhanceColors);
+	}
 }
 
 double computePaletteErrorYiq(REDUCTION *reduction, COLOR32 *px, int nPx, COLOR32 *pal, int nColors, int alphaThreshold, double nMaxError) {
@@ -1886,9 +2796,7 @@ double computePaletteErrorYiq(REDUCTION *reduction, COLOR32 *px, int nPx, COLOR3
 	}
 
 	//palette to YIQ
-	for (int i = 0; i < nColors; i++) {
-		rgbToYiq(pal[i], paletteYiq + i * 4);
-	}
+	rgbToYiqBatch(pal, nColors, paletteYiq);
 
 	double yw2 = reduction->yWeight * reduction->yWeight;
 	double iw2 = reduction->iWeight * reduction->iWeight;
@@ -1908,10 +2816,11 @@ double computePaletteErrorYiq(REDUCTION *reduction, COLOR32 *px, int nPx, COLOR3
 		double dq = yiq[2] - chosen[2];
 
 		error += dy * dy * yw2;
-		if (error >= nMaxError) return nMaxError;
+		if (error >= nMaxError) break;
 		error += di * di * iw2 + dq * dq * qw2;
-		if (error >= nMaxError) return nMaxError;
+		if (error >= nMaxError) break;
 	}
+	if (error >= nMaxError) error = nMaxError;
 
 	if (paletteYiq != paletteYiqStack) free(paletteYiq);
 	return error;
@@ -179,6 +179,7 @@ typedef struct CHARIMPORTDATA_ {
 	HWND hWndBalance;
 	HWND hWndColorBalance;
 	HWND hWndEnhanceColors;
+	HWND hWndSampleHistogram;
 } CHARIMPORTDATA;
 
 LRESULT WINAPI NcgrViewerWndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam) {
@@ -978,6 +979,7 @@ typedef struct {
 	int balance;
 	int colorBalance;
 	int enhanceColors;
+	int sampleHistogram;
 	NCLR *nclr;
 	NCGR *ncgr;
 	HWND hWndMain;
@@ -1000,7 +1002,7 @@ int charImportCallback(void *data) {
 
 void charImport(NCLR *nclr, NCGR *ncgr, LPCWSTR imgPath, BOOL createPalette, int paletteNumber, int paletteSize, int paletteBase, 
 	BOOL dither, float diffuse, BOOL import1D, BOOL charCompression, int nMaxChars, int originX, int originY, 
-	int balance, int colorBalance, int enhanceColors, int *progress) {
+	int balance, int colorBalance, int enhanceColors, BOOL sampleHistogram, volatile LONG *progress) {
 	int maxPaletteSize = 1 << ncgr->nBits;
 
 	//if we start at base 0, increment by 1. We'll put a placeholder color in slot 0.
@@ -1032,7 +1034,8 @@ void charImport(NCLR *nclr, NCGR *ncgr, LPCWSTR imgPath, BOOL createPalette, int
 		}
 	} else {
 		//create a palette, then encode them to the nclr
-		createPaletteSlowEx(pixels, width, height, palette, paletteSize, balance, colorBalance, enhanceColors, 0);
+		int histogramSamples = sampleHistogram ? histogramSamplesForImage(width, height) : HISTOGRAM_SAMPLES_FULL;
+		createPaletteSampledEx(pixels, width, height, palette, paletteSize, balance, colorBalance, enhanceColors, 0, histogramSamples);
 		for (int i = 0; i < paletteSize; i++) {
 			COLOR32 d = palette[i];
 			COLOR ds = ColorConvertToDS(d);
@@ -1162,7 +1165,7 @@ DWORD WINAPI charImportInternal(LPVOID lpParameter) {
 	progress->progress2Max = 1000;
 	charImport(cim->nclr, cim->ncgr, cim->imgPath, cim->createPalette, cim->paletteNumber, cim->paletteSize, cim->paletteBase, 
 			   cim->dither, cim->diffuse, cim->import1D, cim->charCompression, cim->nMaxChars, cim->originX, cim->originY, 
-			   cim->balance, cim->colorBalance, cim->enhanceColors, &progress->progress2);
+			   cim->balance, cim->colorBalance, cim->enhanceColors, cim->sampleHistogram, &progress->progress2);
 	progress->waitOn = 1;
 	return 0;
 }
@@ -1211,6 +1214,7 @@ LRESULT CALLBACK CharImportProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lPara
 			CreateStatic(hWnd, L"Balance:", leftX, bottomY, 100, 22);
 			CreateStatic(hWnd, L"Color Balance:", leftX, bottomY + 27, 100, 22);
 			data->hWndEnhanceColors = CreateCheckbox(hWnd, L"Enhance Colors", leftX, bottomY + 27 * 2, 200, 22, FALSE);
+			data->hWndSampleHistogram = CreateCheckbox(hWnd, L"Sample Large Images", leftX + 210, bottomY + 27 * 2, 200, 22, FALSE);
 			CreateStaticAligned(hWnd, L"Lightness", leftX + 110, bottomY, 50, 22, SCA_RIGHT);
 			CreateStaticAligned(hWnd, L"Color", leftX + 110 + 50 + 200, bottomY, 50, 22, SCA_LEFT);
 			CreateStaticAligned(hWnd, L"Green", leftX + 110, bottomY + 27, 50, 22, SCA_RIGHT);
@@ -1270,6 +1274,7 @@ LRESULT CALLBACK CharImportProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lPara
 					int balance = GetTrackbarPosition(data->hWndBalance);
 					int colorBalance = GetTrackbarPosition(data->hWndColorBalance);
 					BOOL enhanceColors = GetCheckboxChecked(data->hWndEnhanceColors);
+					BOOL sampleHistogram = GetCheckboxChecked(data->hWndSampleHistogram);
 
 					NCLR *nclr = data->nclr;
 					NCGR *ncgr = data->ncgr;
@@ -1293,6 +1298,7 @@ LRESULT CALLBACK CharImportProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lPara
 					cimport->balance = balance;
 					cimport->colorBalance = colorBalance;
 					cimport->enhanceColors = enhanceColors;
+					cimport->sampleHistogram = sampleHistogram;
 					cimport->hWndMain = hWndMain;
 					memcpy(cimport->imgPath, data->path, 2 * (wcslen(data->path) + 1));
 					progressData->data = cimport;
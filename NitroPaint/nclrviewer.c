@@ -1116,8 +1116,7 @@ LRESULT CALLBACK PaletteGeneratorDialogProc(HWND hWnd, UINT msg, WPARAM wParam,
 				COLOR32 *paletteCopy = (COLOR32 *) calloc(nColors, sizeof(COLOR32));
 
 				//compute histogram
-				REDUCTION *reduction = (REDUCTION *) calloc(1, sizeof(REDUCTION));
-				initReduction(reduction, balance, colorBalance, 15, enhanceColors, nColors - reserveFirst);
+				REDUCTION *reduction = reductionAcquire(balance, colorBalance, 15, enhanceColors, nColors - reserveFirst);
 				for (int i = 0; i < nPaths; i++) {
 					getPathFromPaths(paths, i, bf);
 					COLOR32 *bits = gdipReadImage(bf, &width, &height);
@@ -1134,8 +1133,7 @@ LRESULT CALLBACK PaletteGeneratorDialogProc(HWND hWnd, UINT msg, WPARAM wParam,
 					(paletteCopy + reserveFirst)[i] = c;
 				}
 				qsort(paletteCopy + reserveFirst, nColors - reserveFirst, sizeof(COLOR32), lightnessCompare);
-				destroyReduction(reduction);
-				free(reduction);
+				reductionRelease(reduction);
 
 				//write back
 				for (int i = 0; i < nColors; i++) {
@@ -24,6 +24,7 @@
 #include "colorchooser.h"
 #include "ui.h"
 #include "texconv.h"
+#include "parallel.h"
 
 #pragma comment(linker, "\"/manifestdependency:type='win32' \
 name='Microsoft.Windows.Common-Controls' version='6.0.0.0' \
@@ -1221,6 +1222,7 @@ typedef struct {
 	HWND hWndBalance;
 	HWND hWndColorBalance;
 	HWND hWndEnhanceColors;
+	HWND hWndSampleHistogram;
 	HWND hWndColor0Setting;
 	HWND hWndAlignmentCheckbox;
 	HWND hWndAlignment;
@@ -1298,6 +1300,7 @@ typedef struct {
 	int balance;
 	int colorBalance;
 	int enhanceColors;
+	int histogramSamples;
 } THREADEDNSCRCREATEPARAMS;
 
 DWORD WINAPI threadedNscrCreateInternal(LPVOID lpParameter) {
@@ -1305,7 +1308,7 @@ DWORD WINAPI threadedNscrCreateInternal(LPVOID lpParameter) {
 	nscrCreate(params->bbits, params->width, params->height, params->bits, params->dither, params->diffuse,
 			   params->palette, params->nPalettes, params->fmt, params->tileBase, params->mergeTiles, params->alignment,
 			   params->paletteSize, params->paletteOffset, params->rowLimit, params->nMaxChars,
-			   params->color0Setting, params->balance, params->colorBalance, params->enhanceColors,
+			   params->color0Setting, params->balance, params->colorBalance, params->enhanceColors, params->histogramSamples,
 			   &params->data->progress1, &params->data->progress1Max, &params->data->progress2, &params->data->progress2Max,
 			   &params->createData->nclr, &params->createData->ncgr, &params->createData->nscr);
 	params->data->waitOn = 1;
@@ -1315,7 +1318,7 @@ DWORD WINAPI threadedNscrCreateInternal(LPVOID lpParameter) {
 void threadedNscrCreate(PROGRESSDATA *data, DWORD *bbits, int width, int height, int bits, int dither, float diffuse, 
 						CREATENSCRDATA *createData, int palette, int nPalettes, int fmt, int tileBase, int mergeTiles,
 						int alignment, int paletteSize, int paletteOffset, int rowLimit, int nMaxChars, int color0Setting,
-						int balance, int colorBalance, int enhanceColors) {
+						int balance, int colorBalance, int enhanceColors, int histogramSamples) {
 	THREADEDNSCRCREATEPARAMS *params = calloc(1, sizeof(*params));
 	params->data = data;
 	params->bbits = bbits;
@@ -1339,6 +1342,7 @@ void threadedNscrCreate(PROGRESSDATA *data, DWORD *bbits, int width, int height,
 	params->balance = balance;
 	params->colorBalance = colorBalance;
 	params->enhanceColors = enhanceColors;
+	params->histogramSamples = histogramSamples;
 	CreateThread(NULL, 0, threadedNscrCreateInternal, (LPVOID) params, 0, NULL);
 }
 
@@ -1407,6 +1411,7 @@ LRESULT WINAPI CreateDialogWndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lP
 			CreateStatic(hWnd, L"Balance:", leftX, bottomY, 100, 22);
 			CreateStatic(hWnd, L"Color Balance:", leftX, bottomY + 27, 100, 22);
 			data->hWndEnhanceColors = CreateCheckbox(hWnd, L"Enhance Colors", leftX, bottomY + 27 * 2, 200, 22, FALSE);
+			data->hWndSampleHistogram = CreateCheckbox(hWnd, L"Sample Large Images", leftX + 210, bottomY + 27 * 2, 200, 22, FALSE);
 
 			CreateStaticAligned(hWnd, L"Lightness", leftX + 110, bottomY, 50, 22, SCA_RIGHT);
 			CreateStaticAligned(hWnd, L"Color", leftX + 110 + 50 + 200, bottomY, 50, 22, SCA_LEFT);
@@ -1464,6 +1469,7 @@ LRESULT WINAPI CreateDialogWndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lP
 					int balance = GetTrackbarPosition(data->hWndBalance);
 					int colorBalance = GetTrackbarPosition(data->hWndColorBalance);
 					int enhanceColors = GetCheckboxChecked(data->hWndEnhanceColors);
+					int sampleHistogram = GetCheckboxChecked(data->hWndSampleHistogram);
 					int color0Setting = SendMessage(data->hWndColor0Setting, CB_GETCURSEL, 0, 0);
 
 					if (*location == L'\0') {
@@ -1473,6 +1479,7 @@ LRESULT WINAPI CreateDialogWndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lP
 
 					int width, height;
 					DWORD * bbits = gdipReadImage(location, &width, &height);
+					int histogramSamples = sampleHistogram ? histogramSamplesForImage(width, height) : HISTOGRAM_SAMPLES_FULL;
 
 					HWND hWndMain = (HWND) GetWindowLong(hWnd, GWL_HWNDPARENT);
 					NITROPAINTSTRUCT *nitroPaintStruct = (NITROPAINTSTRUCT *) GetWindowLongPtr(hWndMain, 0);
@@ -1490,7 +1497,7 @@ LRESULT WINAPI CreateDialogWndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lP
 
 					threadedNscrCreate(progressData, bbits, width, height, bits, dither, diffuse, createData, palette,
 						nPalettes, fmt, tileBase, merge, alignment, paletteSize, paletteOffset, rowLimit, nMaxChars,
-						color0Setting, balance, colorBalance, enhanceColors);
+						color0Setting, balance, colorBalance, enhanceColors, histogramSamples);
 
 					SendMessage(hWnd, WM_CLOSE, 0, 0);
 					SetActiveWindow(hWndProgress);
@@ -1838,7 +1845,7 @@ LRESULT CALLBACK ConvertFormatDialogProc(HWND hWnd, UINT msg, WPARAM wParam, LPA
 	switch (msg) {
 		case WM_CREATE:
 		{
-			SetWindowSize(hWnd, 230, 96);
+			SetWindowSize(hWnd, 230, 123);
 			break;
 		}
 		case NV_SETDATA:
@@ -1848,9 +1855,11 @@ LRESULT CALLBACK ConvertFormatDialogProc(HWND hWnd, UINT msg, WPARAM wParam, LPA
 
 			CreateStatic(hWnd, L"Format:", 10, 10, 100, 22);
 			CreateStatic(hWnd, L"Compression:", 10, 37, 100, 22);
+			CreateStatic(hWnd, L"Stored As:", 10, 64, 100, 22);
+			CreateStatic(hWnd, compressionNames[editorData->objectHeader.compressionUsed], 120, 64, 100, 22);
 			HWND hWndFormatCombobox = CreateWindow(WC_COMBOBOXW, L"", WS_VISIBLE | WS_CHILD | CBS_DROPDOWNLIST | CBS_HASSTRINGS, 120, 10, 100, 100, hWnd, NULL, NULL, NULL);
 			HWND hWndCompressionCombobox = CreateWindow(WC_COMBOBOX, L"", WS_VISIBLE | WS_CHILD | CBS_DROPDOWNLIST | CBS_HASSTRINGS, 120, 37, 100, 100, hWnd, NULL, NULL, NULL);
-			CreateWindow(L"BUTTON", L"Set", WS_VISIBLE | WS_CHILD | BS_DEFPUSHBUTTON, 120, 64, 100, 22, hWnd, NULL, NULL, NULL);
+			CreateWindow(L"BUTTON", L"Set", WS_VISIBLE | WS_CHILD | BS_DEFPUSHBUTTON, 120, 91, 100, 22, hWnd, NULL, NULL, NULL);
 
 			LPCWSTR *formats = getFormatNamesFromType(editorData->objectHeader.type);
 			formats++; //skip invalid
@@ -2272,6 +2281,7 @@ VOID ReadConfiguration(LPWSTR lpszPath) {
 		result = result && WritePrivateProfileString(L"NitroPaint", L"RenderTransparent", L"1", lpszPath);
 		result = result && WritePrivateProfileStringW(L"NitroPaint", L"DPIAware", L"1", lpszPath);
 		result = result && WritePrivateProfileStringW(L"NitroPaint", L"AllowMultiple", L"0", lpszPath);
+		result = result && WritePrivateProfileStringW(L"NitroPaint", L"Threads", L"0", lpszPath);
 	}
 	g_configuration.nclrViewerConfiguration.useDSColorPicker = GetPrivateProfileInt(L"NclrViewer", L"UseDSColorPicker", 0, lpszPath);
 	g_configuration.ncgrViewerConfiguration.gridlines = GetPrivateProfileInt(L"NcgrViewer", L"Gridlines", 1, lpszPath);
@@ -2281,6 +2291,8 @@ VOID ReadConfiguration(LPWSTR lpszPath) {
 	g_configuration.backgroundPath = (LPWSTR) calloc(MAX_PATH, sizeof(WCHAR));
 	g_configuration.dpiAware = GetPrivateProfileInt(L"NitroPaint", L"DPIAware", 1, lpszPath);
 	g_configuration.allowMultipleInstances = GetPrivateProfileInt(L"NitroPaint", L"AllowMultiple", 0, lpszPath);
+	g_configuration.threadCount = GetPrivateProfileInt(L"NitroPaint", L"Threads", 0, lpszPath);
+	parallelSetThreadCount(g_configuration.threadCount);
 	GetPrivateProfileString(L"NitroPaint", L"Background", L"", g_configuration.backgroundPath, MAX_PATH, lpszPath);
 
 	//load background image
@@ -2385,6 +2397,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 			DispatchMessage(&msg);
 		}
 	}
+	reductionPoolFree();
 	return msg.wParam;
 }
 
@@ -9,6 +9,7 @@ typedef struct {
 	BOOL renderTransparent;
 	BOOL dpiAware;
 	BOOL allowMultipleInstances;
+	int threadCount; //worker threads for parallel work, 0 for one per processor
 	HBRUSH hbrBackground;
 	LPWSTR backgroundPath;
 	struct {
@@ -39,9 +40,9 @@ typedef struct {
 	int waitOn;
 	void *data; //data passed to callback once the progress has finished
 	void (*callback) (void *data); //function called once the wait is finished
-	int progress1;
+	volatile LONG progress1; //polled by the UI thread while work runs
 	int progress1Max;
-	int progress2;
+	volatile LONG progress2;
 	int progress2Max;
 
 	HWND hWndProgress1;
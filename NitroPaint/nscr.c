@@ -2,6 +2,9 @@
 #include "palette.h"
 #include "ncgr.h"
 #include "g2dfile.h"
+#include "parallel.h"
+#include "tilediff.h"
+#include "palsearch.h"
 
 #include <Windows.h>
 #include <stdio.h>
@@ -569,72 +572,24 @@ int nscrWriteFile(NSCR *nscr, LPCWSTR name) {
 	return fileWrite(name, (OBJECT_HEADER *) nscr, (OBJECT_WRITER) nscrWrite);
 }
 
-float tileDifferenceFlip(REDUCTION *reduction, BGTILE *t1, BGTILE *t2, unsigned char mode) {
-	double err = 0.0;
-	COLOR32 *px1 = t1->px;
-	double yw2 = reduction->yWeight * reduction->yWeight;
-	double iw2 = reduction->iWeight * reduction->iWeight;
-	double qw2 = reduction->qWeight * reduction->qWeight;
-
-	for (int y = 0; y < 8; y++) {
-		for (int x = 0; x < 8; x++) {
-
-			int x2 = (mode & TILE_FLIPX) ? (7 - x) : x;
-			int y2 = (mode & TILE_FLIPY) ? (7 - y) : y;
-
-			int *yiq1 = &t1->pxYiq[x + y * 8][0];
-			int *yiq2 = &t2->pxYiq[x2 + y2 * 8][0];
-			double dy = reduction->lumaTable[yiq1[0]] - reduction->lumaTable[yiq2[0]];
-			double di = yiq1[1] - yiq2[1];
-			double dq = yiq1[2] - yiq2[2];
-			double da = yiq1[3] - yiq2[3];
-			err += yw2 * dy * dy + iw2 * di * di + qw2 * dq * dq + 1600 * da * da;
+float tileDifference(const double *weights, const TILE_PLANAR *t1, const TILE_PLANAR *t2, unsigned char *flipMode, double maxDiff) {
+	//when the search gives up, every flip is worse than maxDiff and the lowest partial sum is
+	//returned, which is enough for the caller to reject the pair.
+	double diffs[4];
+	tileDifferenceFlipsBounded(weights, t1, t2, diffs, maxDiff);
+
+	//take the first of the lowest differences in the order none, X, Y, XY
+	int bestFlip = TILE_FLIPNONE;
+	float bestDiff = (float) diffs[TILE_FLIPNONE];
+	for (int flip = TILE_FLIPX; flip <= TILE_FLIPXY; flip++) {
+		float diff = (float) diffs[flip];
+		if (diff < bestDiff) {
+			bestDiff = diff;
+			bestFlip = flip;
 		}
 	}
-
-	return (float) err;
-}
-
-float tileDifference(REDUCTION *reduction, BGTILE *t1, BGTILE *t2, unsigned char *flipMode) {
-	float err = tileDifferenceFlip(reduction, t1, t2, 0);
-	if (err == 0) {
-		*flipMode = 0;
-		return err;
-	}
-	float err2 = tileDifferenceFlip(reduction, t1, t2, TILE_FLIPX);
-	if (err2 == 0) {
-		*flipMode = TILE_FLIPX;
-		return err2;
-	}
-	float err3 = tileDifferenceFlip(reduction, t1, t2, TILE_FLIPY);
-	if (err3 == 0) {
-		*flipMode = TILE_FLIPY;
-		return err3;
-	}
-	float err4 = tileDifferenceFlip(reduction, t1, t2, TILE_FLIPXY);
-	if (err4 == 0) {
-		*flipMode = TILE_FLIPXY;
-		return err4;
-	}
-
-	if (err <= err2 && err <= err3 && err <= err4) {
-		*flipMode = 0;
-		return err;
-	}
-	if (err2 <= err && err2 <= err3 && err2 <= err4) {
-		*flipMode = TILE_FLIPX;
-		return err2;
-	}
-	if (err3 <= err && err3 <= err2 && err3 <= err4) {
-		*flipMode = TILE_FLIPY;
-		return err3;
-	}
-	if (err4 <= err && err4 <= err2 && err4 <= err3) {
-		*flipMode = TILE_FLIPXY;
-		return err4;
-	}
-	*flipMode = 0;
-	return err;
+	*flipMode = bestFlip;
+	return bestDiff;
 }
 
 void bgAddTileToTotal(REDUCTION *reduction, int *pxBlock, BGTILE *tile) {
@@ -660,186 +615,326 @@ typedef struct TILE_DIFF_ {
 	int tile1;
 	int tile2;
 	double diff;		//post-biased
+	float baseDiff;		//pre-biased
+	unsigned char flip;	//how tile2 must be flipped to match tile1
+	int generation1;	//generations of tile1 and tile2 when the bias was computed
+	int generation2;
 } TILE_DIFF;
 
-typedef struct TILE_DIFF_LIST_ {
-	TILE_DIFF *diffBuff;
-	int diffBuffSize;
-	int diffBuffLength;
-	double minDiff;
-	double maxDiff;
-} TILE_DIFF_LIST;
-
-void tdlInit(TILE_DIFF_LIST *list, int nEntries) {
-	list->diffBuffSize = nEntries;
-	list->diffBuffLength = 0;
-	list->minDiff = 1e32;
-	list->maxDiff = 0;
-	list->diffBuff = (TILE_DIFF *) calloc(list->diffBuffSize, sizeof(TILE_DIFF));
+typedef struct TILE_DIFF_HEAP_ {
+	TILE_DIFF *entries;
+	int nEntries;
+	int maxEntries;
+} TILE_DIFF_HEAP;
+
+void tdhInit(TILE_DIFF_HEAP *heap, int nEntries) {
+	if (nEntries < 16) nEntries = 16;
+	heap->maxEntries = nEntries;
+	heap->nEntries = 0;
+	heap->entries = (TILE_DIFF *) calloc(heap->maxEntries, sizeof(TILE_DIFF));
 }
 
-void tdlFree(TILE_DIFF_LIST *list) {
-	free(list->diffBuff);
-	list->diffBuff = NULL;
-	list->diffBuffLength = 0;
-	list->diffBuffSize = 0;
+void tdhFree(TILE_DIFF_HEAP *heap) {
+	free(heap->entries);
+	heap->entries = NULL;
+	heap->nEntries = 0;
+	heap->maxEntries = 0;
 }
 
-void tdlAdd(TILE_DIFF_LIST *list, int tile1, int tile2, double diff) {
-	if (list->diffBuffLength == list->diffBuffSize && diff >= list->maxDiff) return;
+static int tdLessThan(TILE_DIFF *td1, TILE_DIFF *td2) {
+	//ties are broken by tile index so that the merge order does not depend on heap layout
+	if (td1->diff != td2->diff) return td1->diff < td2->diff;
+	if (td1->tile1 != td2->tile1) return td1->tile1 < td2->tile1;
+	return td1->tile2 < td2->tile2;
+}
 
-	//find an insertion point
-	//TODO: binary search
-	int destIndex = list->diffBuffLength;
-	if (diff < list->minDiff) {
-		destIndex = 0;
-	} else {
-		for (int i = 0; i < list->diffBuffLength; i++) {
-			if (diff < list->diffBuff[i].diff) {
-				destIndex = i;
-				break;
-			}
-		}
+void tdhPush(TILE_DIFF_HEAP *heap, TILE_DIFF *td) {
+	if (heap->nEntries == heap->maxEntries) {
+		heap->maxEntries *= 2;
+		heap->entries = (TILE_DIFF *) realloc(heap->entries, heap->maxEntries * sizeof(TILE_DIFF));
+	}
+
+	//sift up
+	int index = heap->nEntries++;
+	while (index > 0) {
+		int parent = (index - 1) / 2;
+		if (!tdLessThan(td, heap->entries + parent)) break;
+		heap->entries[index] = heap->entries[parent];
+		index = parent;
+	}
+	heap->entries[index] = *td;
+}
+
+void tdhPop(TILE_DIFF_HEAP *heap, TILE_DIFF *out) {
+	*out = heap->entries[0];
+	TILE_DIFF *last = heap->entries + --heap->nEntries;
+
+	//sift down the last entry from the root
+	int index = 0;
+	while (1) {
+		int child = index * 2 + 1;
+		if (child >= heap->nEntries) break;
+		if (child + 1 < heap->nEntries && tdLessThan(heap->entries + child + 1, heap->entries + child)) child++;
+		if (!tdLessThan(heap->entries + child, last)) break;
+		heap->entries[index] = heap->entries[child];
+		index = child;
+	}
+	heap->entries[index] = *last;
+}
+
+//number of most similar tiles remembered for each tile during character compression
+#define BG_TILE_CANDIDATES 32
+
+typedef struct BG_TILE_CANDIDATE_ {
+	int tile;
+	float diff;
+	unsigned char flip;
+} BG_TILE_CANDIDATE;
+
+static void bgCandidateAdd(BG_TILE_CANDIDATE *list, int *nCandidates, int tile, float diff, unsigned char flip) {
+	//the list is kept sorted by difference, ties broken by tile index
+	int n = *nCandidates;
+	if (n == BG_TILE_CANDIDATES) {
+		BG_TILE_CANDIDATE *last = list + n - 1;
+		if (diff > last->diff || (diff == last->diff && tile > last->tile)) return;
+		n--;
+	}
+
+	int destIndex = n;
+	while (destIndex > 0 && (list[destIndex - 1].diff > diff || (list[destIndex - 1].diff == diff && list[destIndex - 1].tile > tile))) {
+		list[destIndex] = list[destIndex - 1];
+		destIndex--;
+	}
+	list[destIndex].tile = tile;
+	list[destIndex].diff = diff;
+	list[destIndex].flip = flip;
+	*nCandidates = n + 1;
+}
+
+static double bgCandidateBound(BG_TILE_CANDIDATE *list, int nCandidates) {
+	//differences above this can't make it into the list. Leave a step of float rounding
+	//as headroom, so that anything tying with the last entry is still measured in full.
+	if (nCandidates < BG_TILE_CANDIDATES) return HUGE_VAL;
+	return list[nCandidates - 1].diff * (1.0 + 1.0 / (1 << 22));
+}
+
+static int bgCandidateContains(BG_TILE_CANDIDATE *list, int nCandidates, int tile) {
+	for (int i = 0; i < nCandidates; i++) {
+		if (list[i].tile == tile) return 1;
 	}
+	return 0;
+}
 
-	//insert
-	int nEntriesToMove = list->diffBuffLength - destIndex;
-	int added = 1; //was a new entry created?
-	if (destIndex + 1 + nEntriesToMove > list->diffBuffSize) {
-		nEntriesToMove = list->diffBuffSize - destIndex - 1;
-		added = 0;
+static float bgTileDifference(const double *weights, const TILE_PLANAR *planar, int i, int j, unsigned char *flip, double maxDiff) {
+	//always measure with the higher index first so both directions agree exactly
+	if (i < j) {
+		int t = i;
+		i = j;
+		j = t;
 	}
-	memmove(list->diffBuff + destIndex + 1, list->diffBuff + destIndex, nEntriesToMove * sizeof(TILE_DIFF));
-	list->diffBuff[destIndex].tile1 = tile1;
-	list->diffBuff[destIndex].tile2 = tile2;
-	list->diffBuff[destIndex].diff = diff;
-	if (added) {
-		list->diffBuffLength++;
+	return tileDifference(weights, planar + i, planar + j, flip, maxDiff);
+}
+
+static void bgCandidateRefresh(const double *weights, const TILE_PLANAR *planar, BGTILE *tiles, int nTiles, int i, BG_TILE_CANDIDATE *list, int *nCandidates) {
+	//rebuild a tile's list from the master tiles that remain
+	*nCandidates = 0;
+	for (int j = 0; j < nTiles; j++) {
+		if (j == i || tiles[j].masterTile != j) continue;
+
+		unsigned char flip;
+		float diff = bgTileDifference(weights, planar, i, j, &flip, bgCandidateBound(list, *nCandidates));
+		bgCandidateAdd(list, nCandidates, j, diff, flip);
 	}
-	list->minDiff = list->diffBuff[0].diff;
-	list->maxDiff = list->diffBuff[list->diffBuffLength - 1].diff;
 }
 
-void tdlRemoveAll(TILE_DIFF_LIST *list, int tile1, int tile2) {
-	//remove all diffs involving tile1 and tile2
-	for (int i = 0; i < list->diffBuffLength; i++) {
-		TILE_DIFF *td = list->diffBuff + i;
-		if (td->tile1 == tile1 || td->tile2 == tile1 || td->tile1 == tile2 || td->tile2 == tile2) {
-			memmove(td, td + 1, (list->diffBuffLength - i - 1) * sizeof(TILE_DIFF));
-			list->diffBuffLength--;
-			i--;
+static void bgFlipIndices(BYTE *src, BYTE *dest, int flip) {
+	for (int y = 0; y < 8; y++) {
+		for (int x = 0; x < 8; x++) {
+			int x2 = (flip & TILE_FLIPX) ? (7 - x) : x;
+			int y2 = (flip & TILE_FLIPY) ? (7 - y) : y;
+			dest[x + y * 8] = src[x2 + y2 * 8];
 		}
 	}
-	if (list->diffBuffLength > 0) {
-		list->minDiff = list->diffBuff[0].diff;
-		list->maxDiff = list->diffBuff[list->diffBuffLength - 1].diff;
-	}
 }
 
-void tdlPop(TILE_DIFF_LIST *list, TILE_DIFF *out) {
-	if (list->diffBuffLength > 0) {
-		memcpy(out, list->diffBuff, sizeof(TILE_DIFF));
-		memmove(list->diffBuff, list->diffBuff + 1, (list->diffBuffLength - 1) * sizeof(TILE_DIFF));
-		list->diffBuffLength--;
-		if (list->diffBuffLength > 0) {
-			list->minDiff = list->diffBuff[0].diff;
+static int bgCanonicalIndices(BGTILE *tile, BYTE *canonical) {
+	//of the four orientations, the one that sorts lowest stands in for all of them
+	int canonicalFlip = TILE_FLIPNONE;
+	memcpy(canonical, tile->indices, 64);
+	for (int flip = TILE_FLIPX; flip <= TILE_FLIPXY; flip++) {
+		BYTE flipped[64];
+		bgFlipIndices(tile->indices, flipped, flip);
+		if (memcmp(flipped, canonical, 64) < 0) {
+			memcpy(canonical, flipped, 64);
+			canonicalFlip = flip;
 		}
 	}
+	return canonicalFlip;
 }
 
-void tdlReset(TILE_DIFF_LIST *list) {
-	list->diffBuffLength = 0;
-	list->maxDiff = 0;
-	list->minDiff = 1e32;
+static uint32_t bgHashIndices(BYTE *indices, int palette) {
+	//FNV-1a
+	uint32_t hash = 2166136261u ^ (uint32_t) palette;
+	for (int i = 0; i < 64; i++) {
+		hash ^= indices[i];
+		hash *= 16777619u;
+	}
+	return hash;
 }
 
-int performCharacterCompression(BGTILE *tiles, int nTiles, int nBits, int nMaxChars, COLOR32 *palette, int paletteSize, int nPalettes,
-								int paletteBase, int paletteOffset, int balance, int colorBalance, int *progress) {
-	int nChars = nTiles;
-	float *diffBuff = (float *) calloc(nTiles * nTiles, sizeof(float));
-	unsigned char *flips = (unsigned char *) calloc(nTiles * nTiles, 1); //how must each tile be manipulated to best match its partner
+int performCharacterDeduplication(BGTILE *tiles, int nTiles) {
+	BYTE *canonical = (BYTE *) calloc(nTiles, 64);
+	unsigned char *canonicalFlips = (unsigned char *) calloc(nTiles, 1);
 
-	REDUCTION *reduction = (REDUCTION *) calloc(1, sizeof(REDUCTION));
-	initReduction(reduction, balance, colorBalance, 15, 0, 255);
-	for (int i = 0; i < nTiles; i++) {
-		BGTILE *t1 = tiles + i;
-		for (int j = 0; j < i; j++) {
-			BGTILE *t2 = tiles + j;
+	//open addressing table of master tiles, kept at most half full
+	int tableSize = 16;
+	while (tableSize < nTiles * 2) tableSize <<= 1;
+	int *table = (int *) malloc(tableSize * sizeof(int));
+	memset(table, 0xFF, tableSize * sizeof(int));
 
-			diffBuff[i + j * nTiles] = tileDifference(reduction, t1, t2, &flips[i + j * nTiles]);
-			diffBuff[j + i * nTiles] = diffBuff[i + j * nTiles];
-			flips[j + i * nTiles] = flips[i + j * nTiles];
+	int nChars = nTiles;
+	for (int i = 0; i < nTiles; i++) {
+		BGTILE *tile = tiles + i;
+		BYTE *key = canonical + i * 64;
+		canonicalFlips[i] = bgCanonicalIndices(tile, key);
+
+		int slot = bgHashIndices(key, tile->palette) & (tableSize - 1);
+		while (table[slot] != -1) {
+			int j = table[slot];
+			if (tiles[j].palette == tile->palette && memcmp(canonical + j * 64, key, 64) == 0) break;
+			slot = (slot + 1) & (tableSize - 1);
 		}
-		*progress = (i * i) / nTiles * 500 / nTiles;
+		if (table[slot] == -1) {
+			table[slot] = i;
+			continue;
+		}
+
+		//an identical character came earlier, so it becomes this tile's master. Both tiles
+		//flip to the same canonical form, so the flips combine to map one onto the other.
+		int j = table[slot];
+		tile->masterTile = j;
+		tile->flipMode ^= canonicalFlips[i] ^ canonicalFlips[j];
+		tile->nRepresents = 0;
+		tiles[j].nRepresents++;
+		nChars--;
 	}
 
-	//first, combine tiles with a difference of 0.
+	free(table);
+	free(canonical);
+	free(canonicalFlips);
+	return nChars;
+}
+
+static void bgPushPair(TILE_DIFF_HEAP *heap, BGTILE *tiles, int *generations, int *nPairs, int i, int j, float diff, unsigned char flip) {
+	//bias against tiles that already represent many others
+	double bias = tiles[i].nRepresents + tiles[j].nRepresents;
+	bias *= bias;
+
+	TILE_DIFF td;
+	td.tile1 = min(i, j);
+	td.tile2 = max(i, j);
+	td.baseDiff = diff;
+	td.diff = diff * bias;
+	td.flip = flip;
+	td.generation1 = generations[td.tile1];
+	td.generation2 = generations[td.tile2];
+	tdhPush(heap, &td);
+	nPairs[i]++;
+	nPairs[j]++;
+}
 
+int performCharacterCompression(BGTILE *tiles, int nTiles, int nBits, int nMaxChars, COLOR32 *palette, int paletteSize, int nPalettes,
+								int paletteBase, int paletteOffset, int balance, int colorBalance, volatile LONG *progress) {
+	REDUCTION *reduction = reductionAcquire(balance, colorBalance, 15, 0, 255);
+
+	//first, combine tiles that are identical.
+	int nChars = performCharacterDeduplication(tiles, nTiles);
+
+	//link each master tile to the tiles it represents, so merges only visit the tiles involved
+	int *memberNext = (int *) calloc(nTiles, sizeof(int));
 	for (int i = 0; i < nTiles; i++) {
-		BGTILE *t1 = tiles + i;
-		if (t1->masterTile != i) continue;
-
-		for (int j = 0; j < i; j++) {
-			BGTILE *t2 = tiles + j;
-			if (t2->masterTile != j) continue;
-
-			if (diffBuff[i + j * nTiles] == 0) {
-				//merge all tiles with master index i to j
-				for (int k = 0; k < nTiles; k++) {
-					if (tiles[k].masterTile == i) {
-						tiles[k].masterTile = j;
-						tiles[k].flipMode ^= flips[i + j * nTiles];
-						tiles[k].nRepresents = 0;
-						tiles[j].nRepresents++;
-					}
-				}
-				nChars--;
-				if(nTiles > nMaxChars) *progress = 500 + (int) (500 * sqrt((float) (nTiles - nChars) / (nTiles - nMaxChars)));
-			}
-		}
+		memberNext[i] = -1;
+	}
+	for (int i = 0; i < nTiles; i++) {
+		int master = tiles[i].masterTile;
+		if (master == i) continue;
+		memberNext[i] = memberNext[master];
+		memberNext[master] = i;
 	}
 
 	//still too many? 
 	if (nChars > nMaxChars) {
 		//damn
 
-		//create a rolling buffer of similar tiles. 
-		//when tiles are combined, combinations that involve affected tiles in the array are removed.
-		//fill it to capacity initially, then keep using it until it's empty, then fill again.
-		TILE_DIFF_LIST tdl;
-		tdlInit(&tdl, 64);
-
-		//keep finding the most similar tile until we get character count down
-		int direction = 0;
-		while (nChars > nMaxChars) {
-			for (int iOuter = 0; iOuter < nTiles; iOuter++) {
-				int i = direction ? (nTiles - 1 - iOuter) : iOuter; //criss cross the direction
-				BGTILE *t1 = tiles + i;
-				if (t1->masterTile != i) continue;
-
-				for (int j = 0; j < i; j++) {
-					BGTILE *t2 = tiles + j;
-					if (t2->masterTile != j) continue;
-
-					double thisErrorEntry = diffBuff[i + j * nTiles];
-					double thisError = thisErrorEntry;
-					double bias = t1->nRepresents + t2->nRepresents;
-					bias *= bias;
-
-					thisError = thisErrorEntry * bias;
-					tdlAdd(&tdl, j, i, thisError);
-				}
+		//rather than a full nTiles*nTiles matrix, only the most similar tiles to each tile are kept,
+		//so memory use grows linearly with the tile count.
+		BG_TILE_CANDIDATE *candidates = (BG_TILE_CANDIDATE *) calloc(nTiles * BG_TILE_CANDIDATES, sizeof(BG_TILE_CANDIDATE));
+		int *nCandidates = (int *) calloc(nTiles, sizeof(int));
+
+		//master tiles in planar form for the difference kernels
+		double weights[4];
+		TILE_PLANAR *planar = (TILE_PLANAR *) calloc(nTiles, sizeof(TILE_PLANAR));
+		tileDifferenceWeights(reduction, weights);
+		for (int i = 0; i < nTiles; i++) {
+			if (tiles[i].masterTile == i) tilePlanarInit(planar + i, reduction, tiles[i].pxYiq);
+		}
+
+		for (int i = 0; i < nTiles; i++) {
+			BGTILE *t1 = tiles + i;
+			if (t1->masterTile != i) continue;
+
+			for (int j = 0; j < i; j++) {
+				BGTILE *t2 = tiles + j;
+				if (t2->masterTile != j) continue;
+
+				//only measure as far as needed to get into either tile's list
+				unsigned char flip;
+				double bound1 = bgCandidateBound(candidates + i * BG_TILE_CANDIDATES, nCandidates[i]);
+				double bound2 = bgCandidateBound(candidates + j * BG_TILE_CANDIDATES, nCandidates[j]);
+				float diff = tileDifference(weights, planar + i, planar + j, &flip, max(bound1, bound2));
+				bgCandidateAdd(candidates + i * BG_TILE_CANDIDATES, &nCandidates[i], j, diff, flip);
+				bgCandidateAdd(candidates + j * BG_TILE_CANDIDATES, &nCandidates[j], i, diff, flip);
 			}
-			
-			//now merge tiles while we can
-			int tile1, tile2;
-			while (tdl.diffBuffLength > 0 && nChars > nMaxChars) {
-				TILE_DIFF td;
-				tdlPop(&tdl, &td);
+			*progress = (int) (500.0 * i / nTiles * i / nTiles);
+		}
 
-				//tile merging
-				tile1 = td.tile1;
-				tile2 = td.tile2;
+		//every candidate pair goes into a heap ordered by biased difference. Merging a tile bumps
+		//its generation, and entries made under an older generation are re-biased when popped.
+		//Biases only grow, so a stale entry never sorts after where it belongs.
+		TILE_DIFF_HEAP heap;
+		int *generations = (int *) calloc(nTiles, sizeof(int));
+		int *nPairs = (int *) calloc(nTiles, sizeof(int)); //heap entries involving each tile
+		tdhInit(&heap, nChars * BG_TILE_CANDIDATES);
+		for (int i = 0; i < nTiles; i++) {
+			if (tiles[i].masterTile != i) continue;
+
+			BG_TILE_CANDIDATE *list = candidates + i * BG_TILE_CANDIDATES;
+			for (int k = 0; k < nCandidates[i]; k++) {
+				int j = list[k].tile;
+
+				//pairs both tiles remember are added once, from the higher tile
+				if (j > i && bgCandidateContains(candidates + j * BG_TILE_CANDIDATES, nCandidates[j], i)) continue;
+				bgPushPair(&heap, tiles, generations, nPairs, i, j, list[k].diff, list[k].flip);
+			}
+		}
+		free(candidates);
+		free(nCandidates);
+
+		//keep merging the most similar pair until we get character count down
+		BG_TILE_CANDIDATE refreshList[BG_TILE_CANDIDATES];
+		while (nChars > nMaxChars && heap.nEntries > 0) {
+			TILE_DIFF td;
+			tdhPop(&heap, &td);
+			nPairs[td.tile1]--;
+			nPairs[td.tile2]--;
+
+			int tile1 = td.tile1, tile2 = td.tile2;
+			if (tiles[tile1].masterTile == tile1 && tiles[tile2].masterTile == tile2) {
+				if (td.generation1 != generations[tile1] || td.generation2 != generations[tile2]) {
+					//stale bias, put it back where it now belongs
+					bgPushPair(&heap, tiles, generations, nPairs, tile1, tile2, td.baseDiff, td.flip);
+					continue;
+				}
 
 				//should we swap tile1 and tile2? tile2 should have <= tile1's nRepresents
 				if (tiles[tile2].nRepresents > tiles[tile1].nRepresents) {
@@ -849,30 +944,40 @@ int performCharacterCompression(BGTILE *tiles, int nTiles, int nBits, int nMaxCh
 				}
 
 				//merge tile1 and tile2. All tile2 tiles become tile1 tiles
-				unsigned char flipDiff = flips[tile1 + tile2 * nTiles];
-				for (int i = 0; i < nTiles; i++) {
-					if (tiles[i].masterTile == tile2) {
-						tiles[i].masterTile = tile1;
-						tiles[i].flipMode ^= flipDiff;
-						tiles[i].nRepresents = 0;
-						tiles[tile1].nRepresents++;
-					}
+				int last = tile2;
+				for (int i = tile2; i != -1; i = memberNext[i]) {
+					tiles[i].masterTile = tile1;
+					tiles[i].flipMode ^= td.flip;
+					last = i;
 				}
+				memberNext[last] = memberNext[tile1];
+				memberNext[tile1] = tile2;
+				tiles[tile1].nRepresents += tiles[tile2].nRepresents;
+				tiles[tile2].nRepresents = 0;
+				generations[tile1]++;
 
 				nChars--;
 				*progress = 500 + (int) (500 * sqrt((float) (nTiles - nChars) / (nTiles - nMaxChars)));
+			}
 
-				tdlRemoveAll(&tdl, td.tile1, td.tile2);
+			//a master with no pairs left searches the remaining masters again
+			for (int k = 0; k < 2 && nChars > nMaxChars; k++) {
+				int i = k ? td.tile2 : td.tile1;
+				if (tiles[i].masterTile != i || nPairs[i] > 0) continue;
+
+				int nRefresh;
+				bgCandidateRefresh(weights, planar, tiles, nTiles, i, refreshList, &nRefresh);
+				for (int l = 0; l < nRefresh; l++) {
+					bgPushPair(&heap, tiles, generations, nPairs, i, refreshList[l].tile, refreshList[l].diff, refreshList[l].flip);
+				}
 			}
-			direction = !direction;
-			tdlReset(&tdl);
 		}
-		tdlFree(&tdl);
+		tdhFree(&heap);
+		free(generations);
+		free(nPairs);
+		free(planar);
 	}
 
-	free(flips);
-	free(diffBuff);
-
 	//try to make the compressed result look less bad
 	for (int i = 0; i < nTiles; i++) {
 		if (tiles[i].masterTile != i) continue;
@@ -882,8 +987,7 @@ int performCharacterCompression(BGTILE *tiles, int nTiles, int nBits, int nMaxCh
 		//average all tiles that use this master tile.
 		int pxBlock[64 * 4] = { 0 };
 		int nRep = tile->nRepresents;
-		for (int j = 0; j < nTiles; j++) {
-			if (tiles[j].masterTile != i) continue;
+		for (int j = i; j != -1; j = memberNext[j]) {
 			BGTILE *tile2 = tiles + j;
 			bgAddTileToTotal(reduction, pxBlock, tile2);
 		}
@@ -901,18 +1005,13 @@ int performCharacterCompression(BGTILE *tiles, int nTiles, int nBits, int nMaxCh
 			pxBlock[j] = ch;
 		}
 		for (int j = 0; j < 64; j++) {
-			int cy = pxBlock[j * 4 + 0]; //times 16
-			int ci = pxBlock[j * 4 + 1];
-			int cq = pxBlock[j * 4 + 2];
-			int ca = pxBlock[j * 4 + 3];
-
-			double dcy = ((double) cy) / 16.0;
-			cy = (int) (pow(dcy * 0.00195695, 1.0 / reduction->gamma) * 511.0);
-			int yiq[] = { cy, ci, cq, ca };
-			int rgb[4];
-			yiqToRgb(rgb, yiq);
-
-			tile->px[j] = rgb[0] | (rgb[1] << 8) | (rgb[2] << 16) | (ca << 24);
+			//Y is times 16, undo it along with the gamma
+			double dcy = ((double) pxBlock[j * 4 + 0]) / 16.0;
+			pxBlock[j * 4 + 0] = (int) (pow(dcy * 0.00195695, 1.0 / reduction->gamma) * 511.0);
+		}
+		yiqToRgbBatch(pxBlock, 64, tile->px);
+		for (int j = 0; j < 64; j++) {
+			tile->px[j] |= pxBlock[j * 4 + 3] << 24;
 		}
 
 		//try to determine the most optimal palette. Child tiles can be different palettes.
@@ -946,9 +1045,7 @@ int performCharacterCompression(BGTILE *tiles, int nTiles, int nBits, int nMaxCh
 		tile->palette = bestPalette;
 
 		//lastly, copy tile->indices to all child tile->indices, just to make sure palette and character are in synch.
-		for (int j = 0; j < nTiles; j++) {
-			if (tiles[j].masterTile != i) continue;
-			if (j == i) continue;
+		for (int j = memberNext[i]; j != -1; j = memberNext[j]) {
 			BGTILE *tile2 = tiles + j;
 
 			memcpy(tile2->indices, tile->indices, 64);
@@ -956,8 +1053,8 @@ int performCharacterCompression(BGTILE *tiles, int nTiles, int nBits, int nMaxCh
 		}
 	}
 
-	destroyReduction(reduction);
-	free(reduction);
+	free(memberNext);
+	reductionRelease(reduction);
 	return nChars;
 }
 
@@ -965,57 +1062,125 @@ void setupBgTiles(BGTILE *tiles, int nTiles, int nBits, COLOR32 *palette, int pa
 	setupBgTilesEx(tiles, nTiles, nBits, palette, paletteSize, nPalettes, paletteBase, paletteOffset, dither, diffuse, BALANCE_DEFAULT, BALANCE_DEFAULT, FALSE);
 }
 
-void setupBgTilesEx(BGTILE *tiles, int nTiles, int nBits, COLOR32 *palette, int paletteSize, int nPalettes, int paletteBase, int paletteOffset, int dither, float diffuse, int balance, int colorBalance, int enhanceColors) {
-	REDUCTION *reduction = (REDUCTION *) calloc(1, sizeof(REDUCTION));
-	initReduction(reduction, balance, colorBalance, 15, enhanceColors, paletteSize);
-
-	if (!dither) diffuse = 0.0f;
-	for (int i = 0; i < nTiles; i++) {
-		BGTILE *tile = tiles + i;
+typedef struct BG_SETUP_CONTEXT_ {
+	BGTILE *tiles;
+	REDUCTION **reductions; //one per worker thread
+	PALETTE_SEARCH *searches; //one per palette, from paletteBase
+	DITHER_OFFSETS *ditherOffsets; //one per palette, from paletteBase, for ordered dithering only
+	COLOR32 *palette;
+	int nBits;
+	int paletteSize;
+	int nPalettes;
+	int paletteBase;
+	int paletteOffset;
+	int dither;
+	float diffuse;
+	int balance;
+	int colorBalance;
+	int enhanceColors;
+} BG_SETUP_CONTEXT;
+
+static void bgSetupTile(void *param, int index, int threadIndex) {
+	BG_SETUP_CONTEXT *context = (BG_SETUP_CONTEXT *) param;
+	int nBits = context->nBits, paletteSize = context->paletteSize, paletteOffset = context->paletteOffset;
+	BGTILE *tile = context->tiles + index;
+
+	REDUCTION *reduction = context->reductions[threadIndex];
+	if (reduction == NULL) {
+		reduction = reductionAcquire(context->balance, context->colorBalance, 15, context->enhanceColors, paletteSize);
+		context->reductions[threadIndex] = reduction;
+	}
+
+	//create histogram for tile
+	resetHistogram(reduction);
+	computeHistogram(reduction, tile->px, 8, 8);
+	flattenHistogram(reduction);
+
+	int bestPalette = context->paletteBase;
+	double bestError = 1e32;
+	for (int j = context->paletteBase; j < context->paletteBase + context->nPalettes; j++) {
+		COLOR32 *pal = context->palette + (j << nBits);
+		double err = computeHistogramPaletteError(reduction, pal + paletteOffset + !paletteOffset, paletteSize - !paletteOffset, bestError);
+
+		if (err < bestError) {
+			bestError = err;
+			bestPalette = j;
+		}
+	}
 
-		//create histogram for tile
-		resetHistogram(reduction);
-		computeHistogram(reduction, tile->px, 8, 8);
-		flattenHistogram(reduction);
+	//match colors
+	COLOR32 *pal = context->palette + (bestPalette << nBits);
 
-		int bestPalette = paletteBase;
-		double bestError = 1e32;
-		for (int j = paletteBase; j < paletteBase + nPalettes; j++) {
-			COLOR32 *pal = palette + (j << nBits);
-			double err = computeHistogramPaletteError(reduction, pal + paletteOffset + !paletteOffset, paletteSize - !paletteOffset, bestError);
-
-			if (err < bestError) {
-				bestError = err;
-				bestPalette = j;
-			}
+	//do optional dithering (also matches colors at the same time). Dithering stays within the tile.
+	DITHER_OFFSETS *ditherOffsets = context->ditherOffsets == NULL ? NULL : context->ditherOffsets + bestPalette - context->paletteBase;
+	ditherImagePaletteMode(tile->px, NULL, 8, 8, pal + paletteOffset + !paletteOffset, paletteSize - !paletteOffset, FALSE, TRUE, FALSE, 
+		context->dither, context->diffuse, context->balance, context->colorBalance, context->enhanceColors, ditherOffsets);
+	rgbToYiqBatch(tile->px, 64, &tile->pxYiq[0][0]);
+	for (int j = 0; j < 64; j++) {
+		COLOR32 col = tile->px[j];
+		int colorIndex = 0;
+		if (((col >> 24) & 0xFF) > 127) {
+			colorIndex = paletteSearchClosest(context->searches + bestPalette - context->paletteBase, col) + !paletteOffset + paletteOffset;
 		}
+		
+		tile->indices[j] = colorIndex;
+		tile->px[j] = colorIndex ? (pal[colorIndex] | 0xFF000000) : 0;
+	}
 
-		//match colors
-		COLOR32 *pal = palette + (bestPalette << nBits);
+	tile->masterTile = index;
+	tile->nRepresents = 1;
+	tile->palette = bestPalette;
+}
 
-		//do optional dithering (also matches colors at the same time)
-		ditherImagePaletteEx(tile->px, NULL, 8, 8, pal + paletteOffset + !paletteOffset, paletteSize - !paletteOffset, FALSE, TRUE, FALSE, diffuse, balance, colorBalance, enhanceColors);
-		for (int j = 0; j < 64; j++) {
-			COLOR32 col = tile->px[j];
-			int index = 0;
-			if (((col >> 24) & 0xFF) > 127) {
-				index = closestPalette(col, pal + paletteOffset + !paletteOffset, paletteSize - !paletteOffset) 
-					+ !paletteOffset + paletteOffset;
-			}
-			
-			tile->indices[j] = index;
-			tile->px[j] = index ? (pal[index] | 0xFF000000) : 0;
+void setupBgTilesEx(BGTILE *tiles, int nTiles, int nBits, COLOR32 *palette, int paletteSize, int nPalettes, int paletteBase, int paletteOffset, int dither, float diffuse, int balance, int colorBalance, int enhanceColors) {
+	if (!dither) diffuse = 0.0f;
 
-			//YIQ color
-			rgbToYiq(col, &tile->pxYiq[j][0]);
+	//tiles are independent of each other, so spread them over threads with a reduction each
+	int nThreads = parallelGetThreadCount();
+	BG_SETUP_CONTEXT context;
+	context.tiles = tiles;
+	context.reductions = (REDUCTION **) calloc(nThreads, sizeof(REDUCTION *));
+	context.palette = palette;
+	context.nBits = nBits;
+	context.paletteSize = paletteSize;
+	context.nPalettes = nPalettes;
+	context.paletteBase = paletteBase;
+	context.paletteOffset = paletteOffset;
+	context.dither = dither;
+	context.diffuse = diffuse;
+	context.balance = balance;
+	context.colorBalance = colorBalance;
+	context.enhanceColors = enhanceColors;
+
+	//palette searches can be shared, lookups are safe from any thread
+	context.searches = (PALETTE_SEARCH *) calloc(nPalettes, sizeof(PALETTE_SEARCH));
+	for (int i = 0; i < nPalettes; i++) {
+		COLOR32 *pal = palette + ((paletteBase + i) << nBits);
+		paletteSearchInit(context.searches + i, pal + paletteOffset + !paletteOffset, paletteSize - !paletteOffset, nTiles * 64);
+	}
+
+	//so can ordered dithering offsets, which would otherwise be recomputed for every tile
+	context.ditherOffsets = NULL;
+	if (dither == DITHER_ORDERED) {
+		REDUCTION *reduction = reductionAcquire(balance, colorBalance, 15, enhanceColors, paletteSize);
+		context.ditherOffsets = (DITHER_OFFSETS *) calloc(nPalettes, sizeof(DITHER_OFFSETS));
+		for (int i = 0; i < nPalettes; i++) {
+			COLOR32 *pal = palette + ((paletteBase + i) << nBits);
+			ditherOrderedComputeOffsets(reduction, pal + paletteOffset + !paletteOffset, paletteSize - !paletteOffset, diffuse, 8, context.ditherOffsets + i);
 		}
+		reductionRelease(reduction);
+	}
+	parallelFor(nTiles, bgSetupTile, &context);
 
-		tile->masterTile = i;
-		tile->nRepresents = 1;
-		tile->palette = bestPalette;
+	for (int i = 0; i < nThreads; i++) {
+		if (context.reductions[i] != NULL) reductionRelease(context.reductions[i]);
+	}
+	free(context.reductions);
+	for (int i = 0; i < nPalettes; i++) {
+		paletteSearchFree(context.searches + i);
 	}
-	destroyReduction(reduction);
-	free(reduction);
+	free(context.searches);
+	free(context.ditherOffsets);
 }
 
 int findLeastDistanceToColor(COLOR32 *px, int nPx, int destR, int destG, int destB) {
@@ -1142,8 +1307,8 @@ COLOR32 chooseBGColor0(COLOR32 *px, int width, int height, int mode) {
 void nscrCreate(COLOR32 *imgBits, int width, int height, int nBits, int dither, float diffuse,
 				int paletteBase, int nPalettes, int fmt, int tileBase, int mergeTiles, int alignment,
 				int paletteSize, int paletteOffset, int rowLimit, int nMaxChars,
-				int color0Mode, int balance, int colorBalance, int enhanceColors,
-				int *progress1, int *progress1Max, int *progress2, int *progress2Max,
+				int color0Mode, int balance, int colorBalance, int enhanceColors, int histogramSamples,
+				volatile LONG *progress1, int *progress1Max, volatile LONG *progress2, int *progress2Max,
 				NCLR *nclr, NCGR *ncgr, NSCR *nscr) {
 
 	//cursory sanity checks
@@ -1183,9 +1348,11 @@ void nscrCreate(COLOR32 *imgBits, int width, int height, int nBits, int dither,
 	else nBits = 8;
 	if (nPalettes == 1) {
 		if (paletteOffset) {
-			createPaletteSlowEx(imgBits, width, height, palette + (paletteBase << nBits) + paletteOffset, paletteSize, balance, colorBalance, enhanceColors, 0);
+			createPaletteSampledEx(imgBits, width, height, palette + (paletteBase << nBits) + paletteOffset, paletteSize, balance, colorBalance, enhanceColors, 0,
+				histogramSamples);
 		} else {
-			createPaletteSlowEx(imgBits, width, height, palette + (paletteBase << nBits) + paletteOffset + 1, paletteSize - 1, balance, colorBalance, enhanceColors, 0);
+			createPaletteSampledEx(imgBits, width, height, palette + (paletteBase << nBits) + paletteOffset + 1, paletteSize - 1, balance, colorBalance, enhanceColors, 0,
+				histogramSamples);
 			palette[(paletteBase << nBits) + paletteOffset] = color0; //transparent fill color
 		}
 	} else {
@@ -1226,7 +1393,9 @@ void nscrCreate(COLOR32 *imgBits, int width, int height, int nBits, int dither,
 
 	//match tiles to each other
 	int nChars = nTiles;
-	if (mergeTiles) {
+	if (mergeTiles == BGGEN_MERGE_DEDUP) {
+		nChars = performCharacterDeduplication(tiles, nTiles);
+	} else if (mergeTiles) {
 		nChars = performCharacterCompression(tiles, nTiles, nBits, nMaxChars, palette, paletteSize, nPalettes, paletteBase, 
 			paletteOffset, balance, colorBalance, progress2);
 	}
@@ -1389,4 +1558,4 @@ void nscrCreate(COLOR32 *imgBits, int width, int height, int nBits, int dither,
 	free(indices);
 	free(palette);
 	free(paletteIndices);
-}
\ No newline at end of file
+}
\ No newline at end of file
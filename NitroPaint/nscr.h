@@ -33,6 +33,10 @@
 #define NSCR_TYPE_NC        5
 #define NSCR_TYPE_COMBO     6
 
+#define BGGEN_MERGE_NONE     0
+#define BGGEN_MERGE_COMPRESS 1
+#define BGGEN_MERGE_DEDUP    2
+
 #define BG_COLOR0_FIXED     0
 #define BG_COLOR0_AVERAGE   1
 #define BG_COLOR0_EDGE      2
@@ -137,13 +141,20 @@ void setupBgTiles(BGTILE *tiles, int nTiles, int nBits, COLOR32 *palette, int pa
 //
 void setupBgTilesEx(BGTILE *tiles, int nTiles, int nBits, COLOR32 *palette, int paletteSize, int nPalettes, int paletteBase, int paletteOffset, int dither, float diffuse, int balance, int colorBalance, int enhanceColors);
 
+//
+// Combine tiles whose characters are identical under any flip and that use
+// the same palette. This is lossless, and expects tiles as they are left by
+// setupBgTiles. Returns the resulting number of characters.
+//
+int performCharacterDeduplication(BGTILE *tiles, int nTiles);
+
 //
 // Perform character compresion on the input array of tiles. After tiles are
 // combined, the bit depth and palette settings are used to finalize the
 // result in the tile array. progress must not be NULL, and ranges from 0-1000.
 //
 int performCharacterCompression(BGTILE *tiles, int nTiles, int nBits, int nMaxChars, COLOR32 *palette, int paletteSize, int nPalettes,
-	int paletteBase, int paletteOffset, int balance, int colorBalance, int *progress);
+	int paletteBase, int paletteOffset, int balance, int colorBalance, volatile LONG *progress);
 
 //
 // Generates a BG with the parameters:
@@ -151,22 +162,25 @@ int performCharacterCompression(BGTILE *tiles, int nTiles, int nBits, int nMaxCh
 //  - width: width of image
 //  - height: height of image
 //  - nBits: bit depth of output
-//  - dither: 1/0 to dither/not dither
+//  - dither: DITHER_DIFFUSE, DITHER_ORDERED or DITHER_NONE
 //  - diffuse: between 0.0f and 1.0f, controls diffuse amount
 //  - palette: first palette index to use
 //  - nPalettes: number of palettes to use
 //  - bin: generate raw data
 //  - tileBase: index to be added to all tiles' character index
-//  - mergeTiles: combine tiles in output
+//  - mergeTiles: BGGEN_MERGE_NONE, BGGEN_MERGE_COMPRESS to combine tiles
+//    down to nMaxChars, or BGGEN_MERGE_DEDUP to only combine identical tiles
 //  - paletteSize: maximum number of colors to output per palette
 //  - paletteOffset: First color slot to output in each palette
 //  - rowLimit: 1/0 to cut off/not cut off unused end colors
 //  - nMaxChars: Maximum character count of resulting graphics
 //  - color0Mode: change how color 0 is determined
+//  - histogramSamples: samples per 8x8 block for a single palette's histogram,
+//    HISTOGRAM_SAMPLES_FULL to take every pixel (see computeHistogramSampled)
 //
 void nscrCreate(COLOR32 *imgBits, int width, int height, int nBits, int dither, float diffuse, 
 				int palette, int nPalettes, int bin, int tileBase, int mergeTiles, int alignment,
 				int paletteSize, int paletteOffsetm, int rowLimit, int nMaxChars,
-				int color0Mode, int balance, int colorBalance, int enhanceColors,
-				int *progress1, int *progress1Max, int *progress2, int *progress2Max,
+				int color0Mode, int balance, int colorBalance, int enhanceColors, int histogramSamples,
+				volatile LONG *progress1, int *progress1Max, volatile LONG *progress2, int *progress2Max,
 				NCLR *nclr, NCGR *ncgr, NSCR *nscr);
@@ -11,6 +11,7 @@
 #include "nscr.h"
 #include "gdip.h"
 #include "palette.h"
+#include "palsearch.h"
 #include "tiler.h"
 
 extern HICON g_appIcon;
@@ -877,7 +878,7 @@ void nscrImportBitmap(NCLR *nclr, NCGR *ncgr, NSCR *nscr, COLOR32 *px, int width
 					  int paletteSize, BOOL newPalettes, int writeCharBase, int nMaxChars,
 					  BOOL newCharacters, BOOL dither, float diffuse, int maxTilesX, int maxTilesY,
 					  int nscrTileX, int nscrTileY, int balance, int colorBalance, int enhanceColors,
-					  int *progress, int *progressMax) {
+					  volatile LONG *progress, int *progressMax) {
 	int tilesX = width / 8;
 	int tilesY = height / 8;
 	int paletteStartFrom0 = 0;
@@ -929,8 +930,7 @@ void nscrImportBitmap(NCLR *nclr, NCGR *ncgr, NSCR *nscr, COLOR32 *px, int width
 	uint16_t *nscrData = nscr->data;
 
 	//create dummy reduction to setup parameters for color matching
-	REDUCTION *reduction = (REDUCTION *) calloc(1, sizeof(REDUCTION));
-	initReduction(reduction, balance, colorBalance, 15, enhanceColors, paletteSize - !paletteOffset);
+	REDUCTION *reduction = reductionAcquire(balance, colorBalance, 15, enhanceColors, paletteSize - !paletteOffset);
 
 	//generate an nPalettes color palette
 	if (newPalettes) {
@@ -1002,13 +1002,18 @@ void nscrImportBitmap(NCLR *nclr, NCGR *ncgr, NSCR *nscr, COLOR32 *px, int width
 
 	//pre-convert palette to YIQ
 	int *palsYiq = (int *) calloc(nPalettes * paletteSize, 4 * sizeof(int));
-	for (int i = 0; i < nPalettes * paletteSize; i++) {
-		rgbToYiq(pals[i], palsYiq + i * 4);
-	}
+	rgbToYiqBatch(pals, nPalettes * paletteSize, palsYiq);
 
 	if (!writeScreen) {
 		//no write screen, only character can be written (palette was already dealt with)
 		if (newCharacters) {
+			//tiles may use any of the 16 palettes
+			PALETTE_SEARCH searches[16];
+			for (int i = 0; i < 16; i++) {
+				COLOR32 *thisPalette = pals + i * maxPaletteSize + paletteOffset + !paletteOffset;
+				paletteSearchInit(searches + i, thisPalette, paletteSize - !paletteOffset, tilesX * tilesY * 64);
+			}
+
 			//just write each tile
 			for (int y = 0; y < tilesY; y++) {
 				for (int x = 0; x < tilesX; x++) {
@@ -1032,11 +1037,14 @@ void nscrImportBitmap(NCLR *nclr, NCGR *ncgr, NSCR *nscr, COLOR32 *px, int width
 						int dstY = srcY ^ (flip & TILE_FLIPY ? 7 : 0);
 
 						int cidx = 0;
-						if ((c >> 24) >= 0x80) cidx = closestPalette(c, thisPalette, paletteSize - !paletteOffset) + paletteOffset + !paletteOffset;
+						if ((c >> 24) >= 0x80) cidx = paletteSearchClosest(searches + palIndex, c) + paletteOffset + !paletteOffset;
 						chr[dstX + dstY * 8] = cidx;
 					}
 				}
 			}
+			for (int i = 0; i < 16; i++) {
+				paletteSearchFree(searches + i);
+			}
 		}
 	} else if (writeCharacterIndices) {
 		//write screen, write character indices
@@ -1123,6 +1131,12 @@ void nscrImportBitmap(NCLR *nclr, NCGR *ncgr, NSCR *nscr, COLOR32 *px, int width
 		//write screen, no write character indices.
 		//next, start palette matching. See which palette best fits a tile, set it in the NSCR, then write the bits to the NCGR.
 		if (newCharacters) {
+			PALETTE_SEARCH *searches = (PALETTE_SEARCH *) calloc(nPalettes, sizeof(PALETTE_SEARCH));
+			for (int i = 0; i < nPalettes; i++) {
+				COLOR32 *thisPal = pals + i * maxPaletteSize + paletteOffset + !paletteOffset;
+				paletteSearchInit(searches + i, thisPal, paletteSize - !paletteOffset, tilesX * tilesY * 64);
+			}
+
 			for (int y = 0; y < tilesY; y++) {
 				for (int x = 0; x < tilesX; x++) {
 					COLOR32 *block = blocks[x + y * tilesX].px;
@@ -1157,13 +1171,17 @@ void nscrImportBitmap(NCLR *nclr, NCGR *ncgr, NSCR *nscr, COLOR32 *px, int width
 						for (int i = 0; i < 64; i++) {
 							if ((block[i] & 0xFF000000) < 0x80) ncgrTile[i] = 0;
 							else {
-								int index = paletteOffset + !paletteOffset + closestPalette(block[i], thisPal, paletteSize - !paletteOffset);
+								int index = paletteOffset + !paletteOffset + paletteSearchClosest(searches + leastIndex, block[i]);
 								ncgrTile[i] = index;
 							}
 						}
 					}
 				}
 			}
+			for (int i = 0; i < nPalettes; i++) {
+				paletteSearchFree(searches + i);
+			}
+			free(searches);
 		} else {
 			//no new character
 			for (int y = 0; y < tilesY; y++) {
@@ -1203,8 +1221,7 @@ void nscrImportBitmap(NCLR *nclr, NCGR *ncgr, NSCR *nscr, COLOR32 *px, int width
 	}
 
 	free(palsYiq);
-	destroyReduction(reduction);
-	free(reduction);
+	reductionRelease(reduction);
 
 	free(blocks);
 	free(pals);
@@ -1,4 +1,5 @@
 #pragma once
+#include <Windows.h>
 
 #include "color.h"
 
@@ -8,6 +9,26 @@
 
 #define RECLUSTER_DEFAULT 8
 
+//histogram samples per 8x8 block that take every pixel
+#define HISTOGRAM_SAMPLES_FULL 64
+#define HISTOGRAM_SAMPLES_MIN  16 //fewest histogramSamplesForImage chooses
+
+//images up to this many pixels get full histograms from histogramSamplesForImage
+#define HISTOGRAM_FULL_PIXELS  (512 * 512)
+
+//dithering modes, as taken by the dither parameter of image conversions
+#define DITHER_NONE      0
+#define DITHER_DIFFUSE   1 //adaptive error diffusion
+#define DITHER_ORDERED   2 //8x8 ordered threshold matrix
+
+//ordered dithering matrix size for an image, 4x4 when the image can't fit all of 8x8
+#define DITHER_MATRIX_SIZE(width,height) (((width) < 8 || (height) < 8) ? 4 : 8)
+
+//Y, I and Q added at each position of the ordered dithering matrix, for one palette
+typedef struct DITHER_OFFSETS_ {
+	int offsets[8][8][3];
+} DITHER_OFFSETS;
+
 //
 // Comparator for use with qsort, sortrs an array of colors by lightness.
 //
@@ -28,6 +49,14 @@ void createPaletteExact(COLOR32 *img, int width, int height, COLOR32 *pal, unsig
 //
 int createPaletteSlowEx(COLOR32 *img, int width, int height, COLOR32 *pal, unsigned int nColors, int balance, int colorBalance, int enhanceColors, int sortOnlyUsed);
 
+//
+// Creates a color palette as createPaletteSlowEx does, from a histogram of
+// nSamples pixels out of each 8x8 block of the image (see
+// computeHistogramSampled). Fewer samples are faster on large images at some
+// cost to the palette.
+//
+int createPaletteSampledEx(COLOR32 *img, int width, int height, COLOR32 *pal, unsigned int nColors, int balance, int colorBalance, int enhanceColors, int sortOnlyUsed, int nSamples);
+
 //
 // Creates a color palette for an image, reserving the first color slot for transparency, regardless if the image has transparent pixels.
 //
@@ -54,6 +83,28 @@ void ditherImagePalette(COLOR32 *img, int width, int height, COLOR32 *palette, i
 //
 void ditherImagePaletteEx(COLOR32 *img, int *indices, int width, int height, COLOR32 *palette, int nColors, int touchAlpha, int binaryAlpha, int c0xp, float diffuse, int balance, int colorBalance, int enhanceColors);
 
+//
+// Apply ordered dithering to a whole image, offsetting each pixel in YIQ space
+// by an 8x8 threshold matrix before matching it. Pixels are independent of each
+// other, so large images are spread over worker threads. amount scales the
+// threshold as diffuse does for error diffusion.
+//
+void ditherImagePaletteOrdered(COLOR32 *img, int *indices, int width, int height, COLOR32 *palette, int nColors, int touchAlpha, int binaryAlpha, int c0xp, float amount, int balance, int colorBalance, int enhanceColors);
+
+//
+// Apply ordered dithering with offsets from ditherOrderedComputeOffsets, for
+// when many small images share a palette. When offsets is NULL they are
+// computed from amount, as ditherImagePaletteOrdered does.
+//
+void ditherImagePaletteOrderedEx(COLOR32 *img, int *indices, int width, int height, COLOR32 *palette, int nColors, int touchAlpha, int binaryAlpha, int c0xp, float amount, const DITHER_OFFSETS *offsets, int balance, int colorBalance, int enhanceColors);
+
+//
+// Apply dithering to a whole image using one of the DITHER_* modes. amount is
+// passed on as the diffuse or threshold amount. offsets may hold precomputed
+// ordered dithering offsets for the palette, or be NULL.
+//
+void ditherImagePaletteMode(COLOR32 *img, int *indices, int width, int height, COLOR32 *palette, int nColors, int touchAlpha, int binaryAlpha, int c0xp, int dither, float amount, int balance, int colorBalance, int enhanceColors, const DITHER_OFFSETS *offsets);
+
 //
 // Calculate the average color from a list of colors
 //
@@ -67,14 +118,16 @@ unsigned int getPaletteError(COLOR32 *px, int nPx, COLOR32 *pal, int paletteSize
 //
 // Creates multiple palettes for an image for character map color reduction.
 //
-void createMultiplePalettes(COLOR32 *imgBits, int tilesX, int tilesY, COLOR32 *dest, int paletteBase, int nPalettes, int paletteSize, int nColsPerPalette, int paletteOffset, int *progress);
+void createMultiplePalettes(COLOR32 *imgBits, int tilesX, int tilesY, COLOR32 *dest, int paletteBase, int nPalettes, int paletteSize, int nColsPerPalette, int paletteOffset, volatile LONG *progress);
 
 
 //
 // Creates multiple palettes for an image for character map color reduction
 // with user-provided balance, color balance, and color enhancement settings.
+// Work is spread over parallelGetThreadCount() threads, and progress is
+// updated atomically so that it may be polled from another thread.
 //
-void createMultiplePalettesEx(COLOR32 *imgBits, int tilesX, int tilesY, COLOR32 *dest, int paletteBase, int nPalettes, int paletteSize, int nColsPerPalette, int paletteOffset, int balance, int colorBalance, int enhanceColors, int *progress);
+void createMultiplePalettesEx(COLOR32 *imgBits, int tilesX, int tilesY, COLOR32 *dest, int paletteBase, int nPalettes, int paletteSize, int nColsPerPalette, int paletteOffset, int balance, int colorBalance, int enhanceColors, volatile LONG *progress);
 
 //
 // Convert an RGB color to YUV space.
@@ -101,13 +154,13 @@ unsigned long long computePaletteError(COLOR32 *px, int nPx, COLOR32 *pal, int n
 
 //----------structures used by palette generator
 
-//histogram linked list entry as secondary sorting
+//histogram entry
 typedef struct HIST_ENTRY_ {
 	int y;
 	int i;
 	int q;
 	int a;
-	struct HIST_ENTRY_ *next;
+	int slot; //sort key, flattened histograms are ordered by slot then insertion
 	int entry;
 	double weight;
 	double value;
@@ -125,23 +178,29 @@ typedef struct COLOR_NODE_ {
 	int pivotIndex;
 	int startIndex;
 	int endIndex;
+	int heapIndex; //position in the queue of nodes to split, or -1
+	struct COLOR_NODE_ *parent;
 	struct COLOR_NODE_ *left;
 	struct COLOR_NODE_ *right;
 } COLOR_NODE;
 
-//allocator for allocating the linked lists
-typedef struct ALLOCATOR_ {
-	void *allocation;
-	int nextEntryOffset;
-	struct ALLOCATOR_ *next;
-} ALLOCATOR;
+#define COLOR_NODE_BLOCK_SIZE 256
+
+//block of color tree nodes. Nodes are taken from blocks in order and are all
+//returned at once when the tree is discarded, so blocks are kept for reuse.
+typedef struct COLOR_NODE_BLOCK_ {
+	struct COLOR_NODE_BLOCK_ *next;
+	COLOR_NODE nodes[COLOR_NODE_BLOCK_SIZE];
+} COLOR_NODE_BLOCK;
 
-//histogram structure
+//histogram structure. Colors are stored in the order they were added, and are
+//looked up through an open-addressing hash table of indices.
 typedef struct HISTOGRAM_ {
-	ALLOCATOR allocator;
-	HIST_ENTRY *entries[0x20000];
+	HIST_ENTRY *entries;
 	int nEntries;
-	int firstSlot;
+	int maxEntries;  //allocated size of entries
+	int *table;      //entry index + 1 per slot, or 0 when empty
+	int tableSize;   //number of slots, a power of 2
 } HISTOGRAM;
 
 //struct for totaling a bucket in reclustering
@@ -176,6 +235,14 @@ typedef struct REDUCTION_ {
 	int paletteYiqCopy[256][4];
 	double lumaTable[512];
 	double gamma;
+
+	//kept when a REDUCTION is reused
+	COLOR_NODE_BLOCK *nodeBlocks;
+	COLOR_NODE_BLOCK *nodeBlockCurrent; //block nodes are being taken from, or NULL if none yet
+	int nNodeBlockUsed;                 //nodes taken from nodeBlockCurrent
+	COLOR_NODE **splitHeap;             //leaves that may be split, greatest priority first
+	int nSplitHeap;
+	int splitHeapCapacity;
 } REDUCTION;
 
 //
@@ -188,6 +255,24 @@ void rgbToYiq(COLOR32 rgb, int *yiq);
 //
 void yiqToRgb(int *rgb, int *yiq);
 
+//
+// Encode a run of RGBA colors to YIQA, 4 ints per color, giving the same
+// values as rgbToYiq. Uses SSE2 when available.
+//
+void rgbToYiqBatch(const COLOR32 *rgb, int nColors, int *yiq);
+
+//
+// Encode a run of RGBA colors to separate Y, I, Q and A arrays, giving the
+// same values as rgbToYiq.
+//
+void rgbToYiqPlanar(const COLOR32 *rgb, int nColors, int *y, int *i, int *q, int *a);
+
+//
+// Decode a run of YIQA colors, 4 ints per color, to RGB with alpha cleared,
+// giving the same values as yiqToRgb.
+//
+void yiqToRgbBatch(const int *yiq, int nColors, COLOR32 *rgb);
+
 //
 // Initialize a REDUCTION structure with palette parameters.
 //
@@ -203,6 +288,21 @@ void histogramAddColor(HISTOGRAM *histogram, int y, int i, int q, int a, double
 //
 void computeHistogram(REDUCTION *reduction, COLOR32 *img, int width, int height);
 
+//
+// Add an image's color data to a REDUCTION's histogram from nSamples pixels
+// out of each 8x8 block, spread over the block. Samples are weighted up to
+// stand for the whole block, so weights stay on the scale computeHistogram
+// gives. HISTOGRAM_SAMPLES_FULL or more takes every pixel.
+//
+void computeHistogramSampled(REDUCTION *reduction, COLOR32 *img, int width, int height, int nSamples);
+
+//
+// Get the number of samples per 8x8 block for building a palette for an image.
+// Images up to HISTOGRAM_FULL_PIXELS take every pixel, larger images take fewer
+// samples so their histograms stay about that size.
+//
+int histogramSamplesForImage(int width, int height);
+
 //
 // Sort a histogram's colors by their principal component.
 //
@@ -244,7 +344,30 @@ double computeHistogramPaletteError(REDUCTION *reduction, COLOR32 *palette, int
 //
 double computeHistogramPaletteErrorYiq(REDUCTION *reduction, int *yiqPalette, int nColors, double maxError);
 
+//
+// Compute the ordered dithering offsets for a palette, excluding any color 0
+// reserved for transparency. Offsets are scaled by the spacing of the palette
+// colors and by amount. matrixSize is DITHER_MATRIX_SIZE of the images dithered.
+//
+void ditherOrderedComputeOffsets(REDUCTION *reduction, COLOR32 *palette, int nColors, float amount, int matrixSize, DITHER_OFFSETS *offsets);
+
 //
 // Free all resources consumed by a REDUCTION.
 //
 void destroyReduction(REDUCTION *reduction);
+
+//
+// Get a REDUCTION initialized with palette parameters, as initReduction would.
+// Released workspaces are reused, keeping their allocations.
+//
+REDUCTION *reductionAcquire(int balance, int colorBalance, int optimization, int enhanceColors, unsigned int nColors);
+
+//
+// Return a REDUCTION from reductionAcquire so it can be reused.
+//
+void reductionRelease(REDUCTION *reduction);
+
+//
+// Free the REDUCTIONs kept for reuse.
+//
+void reductionPoolFree(void);
@@ -0,0 +1,254 @@
+#include "palsearch.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+//palettes smaller than this are just scanned linearly
+#define PALETTE_SEARCH_MIN_COLORS    16
+
+//results are only memoized when at least this many lookups are expected
+#define PALETTE_SEARCH_CACHE_MIN     4096
+
+#define PALETTE_SEARCH_YIQ_CACHE_BITS 14
+
+//Both searches walk outwards from the query's luma, taking whichever side is
+//closer in luma next. The luma term of the distance is a lower bound on the
+//whole distance and only grows along each side, so once the nearer side's
+//bound exceeds the best distance nothing left can match. Equal distances go
+//to the lower index, which is the entry a linear scan would have kept.
+
+static unsigned int paletteSearchHash(COLOR32 c) {
+	return (c * 0x9E3779B1u) >> 16;
+}
+
+void paletteSearchInit(PALETTE_SEARCH *search, COLOR32 *palette, int nColors, int nQueries) {
+	memset(search, 0, sizeof(PALETTE_SEARCH));
+	search->palette = palette;
+	search->nColors = nColors;
+
+	if (nColors >= PALETTE_SEARCH_MIN_COLORS) {
+		//table of the first entry of each color, since exact matches take priority
+		int tableSize = 16;
+		while (tableSize < nColors * 2) tableSize <<= 1;
+		search->exactTableSize = tableSize;
+		search->exactTable = (int *) calloc(tableSize, sizeof(int));
+		for (int i = 0; i < nColors; i++) {
+			COLOR32 c = palette[i] & 0xFFFFFF;
+			int slot = paletteSearchHash(c) & (tableSize - 1);
+			while (search->exactTable[slot] && (palette[search->exactTable[slot] - 1] & 0xFFFFFF) != c) {
+				slot = (slot + 1) & (tableSize - 1);
+			}
+			if (!search->exactTable[slot]) search->exactTable[slot] = i + 1;
+		}
+
+		//insertion sort by luma, keeping index order for equal luma
+		search->order = (int *) calloc(nColors, sizeof(int));
+		search->orderLuma = (int *) calloc(nColors, sizeof(int));
+		for (int i = 0; i < nColors; i++) {
+			COLOR32 c = palette[i];
+			int luma = (c & 0xFF) * 299 + ((c >> 8) & 0xFF) * 587 + ((c >> 16) & 0xFF) * 114;
+
+			int j = i;
+			while (j > 0 && search->orderLuma[j - 1] > luma) {
+				search->order[j] = search->order[j - 1];
+				search->orderLuma[j] = search->orderLuma[j - 1];
+				j--;
+			}
+			search->order[j] = i;
+			search->orderLuma[j] = luma;
+		}
+	}
+
+	if (nQueries >= PALETTE_SEARCH_CACHE_MIN && nColors <= 0x10000) {
+		search->cache = (uint32_t *) calloc(0x8000, sizeof(uint32_t));
+	}
+}
+
+void paletteSearchFree(PALETTE_SEARCH *search) {
+	if (search->exactTable != NULL) free(search->exactTable);
+	if (search->order != NULL) free(search->order);
+	if (search->orderLuma != NULL) free(search->orderLuma);
+	if (search->cache != NULL) free(search->cache);
+	memset(search, 0, sizeof(PALETTE_SEARCH));
+}
+
+static int paletteSearchFind(PALETTE_SEARCH *search, COLOR32 rgb) {
+	COLOR32 *palette = search->palette;
+	int nColors = search->nColors;
+	if (search->order == NULL) return closestPalette(rgb, palette, nColors);
+
+	//exact match
+	rgb &= 0xFFFFFF;
+	int tableMask = search->exactTableSize - 1;
+	for (int slot = paletteSearchHash(rgb) & tableMask; search->exactTable[slot]; slot = (slot + 1) & tableMask) {
+		int index = search->exactTable[slot] - 1;
+		if ((palette[index] & 0xFFFFFF) == rgb) return index;
+	}
+
+	int r = rgb & 0xFF, g = (rgb >> 8) & 0xFF, b = (rgb >> 16) & 0xFF;
+	int luma = r * 299 + g * 587 + b * 114;
+
+	//first entry not darker than the color
+	int lo = 0, hi = nColors;
+	while (lo < hi) {
+		int mid = (lo + hi) >> 1;
+		if (search->orderLuma[mid] < luma) lo = mid + 1;
+		else hi = mid;
+	}
+	lo = hi - 1;
+
+	int bestDistance = 1 << 24, bestIndex = 0;
+	while (lo >= 0 || hi < nColors) {
+		int dLo = lo >= 0 ? luma - search->orderLuma[lo] : INT_MAX;
+		int dHi = hi < nColors ? search->orderLuma[hi] - luma : INT_MAX;
+		int pos, dLuma;
+		if (dLo <= dHi) {
+			pos = lo--;
+			dLuma = dLo;
+		} else {
+			pos = hi++;
+			dLuma = dHi;
+		}
+
+		//the luma error is truncated toward zero, so a luma difference above 1000k gives at least k
+		int minY = (dLuma - 1) / 1000;
+		if (4 * minY * minY > bestDistance) break;
+
+		int i = search->order[pos];
+		COLOR32 entry = palette[i];
+		int ey, eu, ev;
+		convertRGBToYUV((entry & 0xFF) - r, ((entry >> 8) & 0xFF) - g, ((entry >> 16) & 0xFF) - b, &ey, &eu, &ev);
+		int dst = 4 * ey * ey + eu * eu + ev * ev;
+		if (dst < bestDistance || (dst == bestDistance && i < bestIndex)) {
+			bestDistance = dst;
+			bestIndex = i;
+		}
+	}
+	return bestIndex;
+}
+
+int paletteSearchClosest(PALETTE_SEARCH *search, COLOR32 rgb) {
+	if (search->cache == NULL) return paletteSearchFind(search, rgb);
+
+	//slots hold a valid bit, the low 3 bits of each channel and the index in
+	//one word, so concurrent lookups only ever see whole entries.
+	int r = rgb & 0xFF, g = (rgb >> 8) & 0xFF, b = (rgb >> 16) & 0xFF;
+	int slot = (r >> 3) | ((g >> 3) << 5) | ((b >> 3) << 10);
+	uint32_t tag = 0x80000000 | (((r & 7) | ((g & 7) << 3) | ((b & 7) << 6)) << 16);
+	uint32_t cached = search->cache[slot];
+	if ((cached & 0xFFFF0000) == tag) return cached & 0xFFFF;
+
+	int index = paletteSearchFind(search, rgb);
+	search->cache[slot] = tag | index;
+	return index;
+}
+
+void paletteSearchInitYiq(PALETTE_SEARCH_YIQ *search, REDUCTION *reduction, int *yiqPalette, int nColors, int nQueries) {
+	memset(search, 0, sizeof(PALETTE_SEARCH_YIQ));
+	search->reduction = reduction;
+	search->palette = yiqPalette;
+	search->nColors = nColors;
+	search->yw2 = reduction->yWeight * reduction->yWeight;
+	search->iw2 = reduction->iWeight * reduction->iWeight;
+	search->qw2 = reduction->qWeight * reduction->qWeight;
+
+	if (nColors >= PALETTE_SEARCH_MIN_COLORS) {
+		//counting sort by Y, keeping index order for equal Y
+		int starts[513] = { 0 };
+		for (int i = 0; i < nColors; i++) {
+			starts[yiqPalette[i * 4] + 1]++;
+		}
+		for (int i = 1; i < 513; i++) {
+			starts[i] += starts[i - 1];
+		}
+		search->order = (int *) calloc(nColors, sizeof(int));
+		for (int i = 0; i < nColors; i++) {
+			search->order[starts[yiqPalette[i * 4]]++] = i;
+		}
+	}
+
+	if (nQueries >= PALETTE_SEARCH_CACHE_MIN) {
+		search->cache = (int *) calloc(1 << PALETTE_SEARCH_YIQ_CACHE_BITS, 4 * sizeof(int));
+	}
+}
+
+void paletteSearchFreeYiq(PALETTE_SEARCH_YIQ *search) {
+	if (search->order != NULL) free(search->order);
+	if (search->cache != NULL) free(search->cache);
+	memset(search, 0, sizeof(PALETTE_SEARCH_YIQ));
+}
+
+static int paletteSearchFindYiq(PALETTE_SEARCH_YIQ *search, int *yiqColor) {
+	int *palette = search->palette;
+	int nColors = search->nColors;
+	if (search->order == NULL) return closestPaletteYiq(search->reduction, yiqColor, palette, nColors);
+
+	double *lumaTable = search->reduction->lumaTable;
+	double yw2 = search->yw2, iw2 = search->iw2, qw2 = search->qw2;
+	double colorLuma = lumaTable[yiqColor[0]];
+
+	//first entry with Y not below the color's
+	int lo = 0, hi = nColors;
+	while (lo < hi) {
+		int mid = (lo + hi) >> 1;
+		if (palette[search->order[mid] * 4] < yiqColor[0]) lo = mid + 1;
+		else hi = mid;
+	}
+	lo = hi - 1;
+
+	double bestDistance = 1e32;
+	int bestIndex = 0;
+	while (lo >= 0 || hi < nColors) {
+		double boundLo = HUGE_VAL, boundHi = HUGE_VAL;
+		if (lo >= 0) {
+			double dy = lumaTable[palette[search->order[lo] * 4]] - colorLuma;
+			boundLo = dy * dy * yw2;
+		}
+		if (hi < nColors) {
+			double dy = lumaTable[palette[search->order[hi] * 4]] - colorLuma;
+			boundHi = dy * dy * yw2;
+		}
+
+		int pos;
+		double bound;
+		if (boundLo <= boundHi) {
+			pos = lo--;
+			bound = boundLo;
+		} else {
+			pos = hi++;
+			bound = boundHi;
+		}
+		if (bound > bestDistance) break;
+
+		//same arithmetic as closestPaletteYiq, so the luma term is exactly the bound
+		int i = search->order[pos];
+		int *yiq = palette + i * 4;
+		double dy = lumaTable[yiq[0]] - colorLuma;
+		double di = yiq[1] - yiqColor[1];
+		double dq = yiq[2] - yiqColor[2];
+		double dst = dy * dy * yw2 + di * di * iw2 + dq * dq * qw2;
+		if (dst < bestDistance || (dst == bestDistance && i < bestIndex)) {
+			bestDistance = dst;
+			bestIndex = i;
+		}
+	}
+	return bestIndex;
+}
+
+int paletteSearchClosestYiq(PALETTE_SEARCH_YIQ *search, int *yiqColor) {
+	if (search->cache == NULL) return paletteSearchFindYiq(search, yiqColor);
+
+	int y = yiqColor[0], i = yiqColor[1], q = yiqColor[2];
+	uint32_t hash = ((uint32_t) y * 0x9E3779B1u) ^ ((uint32_t) i * 0x85EBCA77u) ^ ((uint32_t) q * 0xC2B2AE3Du);
+	int *cached = search->cache + (hash >> (32 - PALETTE_SEARCH_YIQ_CACHE_BITS)) * 4;
+	if (cached[3] && cached[0] == y && cached[1] == i && cached[2] == q) return cached[3] - 1;
+
+	int index = paletteSearchFindYiq(search, yiqColor);
+	cached[0] = y;
+	cached[1] = i;
+	cached[2] = q;
+	cached[3] = index + 1;
+	return index;
+}
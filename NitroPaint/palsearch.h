@@ -0,0 +1,68 @@
+#pragma once
+
+#include "palette.h"
+
+//
+// Nearest color search over a fixed RGB palette, giving the same results as
+// closestPalette. Entries are sorted by luma so a search can stop once luma
+// alone puts every remaining entry further away than the best match. Results
+// may be memoized per color; lookups are safe to make from several threads
+// at once. The palette must stay valid while the search is in use.
+//
+typedef struct PALETTE_SEARCH_ {
+	COLOR32 *palette;
+	int nColors;
+	int *order;          //palette indices sorted by luma then index, or NULL for small palettes
+	int *orderLuma;      //luma of each sorted entry, as 299r + 587g + 114b
+	int *exactTable;     //index + 1 of the first entry of a color per slot, or 0 when empty
+	int exactTableSize;  //number of slots, a power of 2
+	uint32_t *cache;     //memoized results indexed by 15-bit color, or NULL
+} PALETTE_SEARCH;
+
+//
+// Nearest color search over a fixed YIQA palette, giving the same results as
+// closestPaletteYiq with the same reduction. Lookups may update the cache, so
+// a search must only be used by one thread at a time.
+//
+typedef struct PALETTE_SEARCH_YIQ_ {
+	REDUCTION *reduction;
+	int *palette;        //4 ints per color
+	int nColors;
+	double yw2;
+	double iw2;
+	double qw2;
+	int *order;          //palette indices sorted by Y then index, or NULL for small palettes
+	int *cache;          //Y, I, Q, index + 1 per slot (0 when empty), or NULL
+} PALETTE_SEARCH_YIQ;
+
+//
+// Prepare a search over an RGB palette. nQueries is roughly how many lookups
+// will be made, and decides whether memoizing results is worthwhile.
+//
+void paletteSearchInit(PALETTE_SEARCH *search, COLOR32 *palette, int nColors, int nQueries);
+
+//
+// Free the resources held by a PALETTE_SEARCH.
+//
+void paletteSearchFree(PALETTE_SEARCH *search);
+
+//
+// Find the index of the closest palette color, as closestPalette would.
+//
+int paletteSearchClosest(PALETTE_SEARCH *search, COLOR32 rgb);
+
+//
+// Prepare a search over a YIQA palette using a reduction's weights and luma
+// table. nQueries is used as in paletteSearchInit.
+//
+void paletteSearchInitYiq(PALETTE_SEARCH_YIQ *search, REDUCTION *reduction, int *yiqPalette, int nColors, int nQueries);
+
+//
+// Free the resources held by a PALETTE_SEARCH_YIQ.
+//
+void paletteSearchFreeYiq(PALETTE_SEARCH_YIQ *search);
+
+//
+// Find the index of the closest palette color, as closestPaletteYiq would.
+//
+int paletteSearchClosestYiq(PALETTE_SEARCH_YIQ *search, int *yiqColor);
@@ -0,0 +1,82 @@
+#include <Windows.h>
+
+#include "parallel.h"
+
+#define PARALLEL_MAX_THREADS 64
+
+static int g_parallelThreadCount = 0; //0 for one per processor
+
+typedef struct PARALLEL_JOB_ {
+	PARALLEL_FUNCTION fn;
+	void *param;
+	int nItems;
+	volatile LONG nextItem;
+} PARALLEL_JOB;
+
+typedef struct PARALLEL_WORKER_ {
+	PARALLEL_JOB *job;
+	int threadIndex;
+} PARALLEL_WORKER;
+
+int parallelGetThreadCount(void) {
+	if (g_parallelThreadCount > 0) return g_parallelThreadCount;
+
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	int nThreads = info.dwNumberOfProcessors;
+	if (nThreads < 1) nThreads = 1;
+	if (nThreads > PARALLEL_MAX_THREADS) nThreads = PARALLEL_MAX_THREADS;
+	return nThreads;
+}
+
+void parallelSetThreadCount(int nThreads) {
+	if (nThreads < 0) nThreads = 0;
+	if (nThreads > PARALLEL_MAX_THREADS) nThreads = PARALLEL_MAX_THREADS;
+	g_parallelThreadCount = nThreads;
+}
+
+static void parallelRunWorker(PARALLEL_JOB *job, int threadIndex) {
+	//take items one at a time until none are left
+	while (1) {
+		int index = InterlockedIncrement(&job->nextItem) - 1;
+		if (index >= job->nItems) break;
+		job->fn(job->param, index, threadIndex);
+	}
+}
+
+static DWORD CALLBACK parallelThreadEntry(LPVOID lpParam) {
+	PARALLEL_WORKER *worker = (PARALLEL_WORKER *) lpParam;
+	parallelRunWorker(worker->job, worker->threadIndex);
+	return 0;
+}
+
+void parallelFor(int nItems, PARALLEL_FUNCTION fn, void *param) {
+	PARALLEL_JOB job;
+	job.fn = fn;
+	job.param = param;
+	job.nItems = nItems;
+	job.nextItem = 0;
+
+	int nThreads = parallelGetThreadCount();
+	if (nThreads > nItems) nThreads = nItems;
+
+	//the calling thread is worker 0. If a thread can't be created, the rest do its share.
+	HANDLE hThreads[PARALLEL_MAX_THREADS];
+	PARALLEL_WORKER workers[PARALLEL_MAX_THREADS];
+	int nStarted = 0;
+	for (int i = 1; i < nThreads; i++) {
+		workers[nStarted].job = &job;
+		workers[nStarted].threadIndex = nStarted + 1;
+		HANDLE hThread = CreateThread(NULL, 0, parallelThreadEntry, (LPVOID) &workers[nStarted], 0, NULL);
+		if (hThread == NULL) break;
+		hThreads[nStarted++] = hThread;
+	}
+	parallelRunWorker(&job, 0);
+
+	if (nStarted > 0) {
+		WaitForMultipleObjects(nStarted, hThreads, TRUE, INFINITE);
+		for (int i = 0; i < nStarted; i++) {
+			CloseHandle(hThreads[i]);
+		}
+	}
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+//
+// Function called once per item by parallelFor. threadIndex identifies the
+// worker thread making the call, and is less than parallelGetThreadCount().
+//
+typedef void (*PARALLEL_FUNCTION) (void *param, int index, int threadIndex);
+
+//
+// Gets the number of worker threads used by parallelFor.
+//
+int parallelGetThreadCount(void);
+
+//
+// Sets the number of worker threads used by parallelFor. A count of 0 uses one
+// thread per processor.
+//
+void parallelSetThreadCount(int nThreads);
+
+//
+// Calls fn for every index from 0 to nItems - 1, spreading the calls over the
+// worker threads. The calling thread takes part in the work, and the function
+// returns once every call has finished.
+//
+void parallelFor(int nItems, PARALLEL_FUNCTION fn, void *param);
@@ -2,6 +2,8 @@
 #include "color.h"
 #include "texconv.h"
 #include "analysis.h"
+#include "palsearch.h"
+#include "parallel.h"
 
 #include <math.h>
 
@@ -71,8 +73,8 @@ int textureConvertPalette(CREATEPARAMS *params) {
 
 	if (!params->useFixedPalette) {
 		//generate a palette, making sure to leave a transparent color, if applicable.
-		createPaletteSlowEx(params->px, width, height, palette + hasTransparent, nColors - hasTransparent,
-			params->balance, params->colorBalance, params->enhanceColors, TRUE);
+		createPaletteSampledEx(params->px, width, height, palette + hasTransparent, nColors - hasTransparent,
+			params->balance, params->colorBalance, params->enhanceColors, TRUE, params->histogramSamples);
 
 		//reduce palette color depth
 		for (int i = 0; i < nColors; i++) {
@@ -87,17 +89,19 @@ int textureConvertPalette(CREATEPARAMS *params) {
 	//allocate texel space.
 	int nBytes = width * height * bitsPerPixel / 8;
 	uint8_t *txel = (uint8_t *) calloc(nBytes, 1);
-	float diffuse = params->dither ? params->diffuseAmount : 0.0f;
-	ditherImagePaletteEx(params->px, NULL, width, height, palette, nColors, TRUE, TRUE, hasTransparent, diffuse, 
-		params->balance, params->colorBalance, params->enhanceColors);
+	ditherImagePaletteMode(params->px, NULL, width, height, palette, nColors, TRUE, TRUE, hasTransparent, params->dither, params->diffuseAmount,
+		params->balance, params->colorBalance, params->enhanceColors, NULL);
 
 	//write texel data.
+	PALETTE_SEARCH search;
+	paletteSearchInit(&search, palette + hasTransparent, nColors - hasTransparent, width * height);
 	for (int i = 0; i < width * height; i++) {
 		COLOR32 p = params->px[i];
 		int index = 0;
-		if ((p >> 24) >= 0x80) index = closestPalette(p, palette + hasTransparent, nColors - hasTransparent) + hasTransparent;
+		if ((p >> 24) >= 0x80) index = paletteSearchClosest(&search, p) + hasTransparent;
 		txel[i / pixelsPerByte] |= index << (bitsPerPixel * (i & (pixelsPerByte - 1)));
 	}
+	paletteSearchFree(&search);
 
 	//update texture info
 	if (params->dest->palette.pal) free(params->dest->palette.pal);
@@ -141,8 +145,8 @@ int textureConvertTranslucent(CREATEPARAMS *params) {
 
 	if (!params->useFixedPalette) {
 		//generate a palette, making sure to leave a transparent color, if applicable.
-		createPaletteSlowEx(params->px, width, height, palette, nColors,
-			params->balance, params->colorBalance, params->enhanceColors, TRUE);
+		createPaletteSampledEx(params->px, width, height, palette, nColors,
+			params->balance, params->colorBalance, params->enhanceColors, TRUE, params->histogramSamples);
 
 		//reduce palette color depth
 		for (int i = 0; i < nColors; i++) {
@@ -157,14 +161,15 @@ int textureConvertTranslucent(CREATEPARAMS *params) {
 	//allocate texel space.
 	int nBytes = width * height;
 	uint8_t *txel = (uint8_t *) calloc(nBytes, 1);
-	float diffuse = params->dither ? params->diffuseAmount : 0.0f;
-	ditherImagePaletteEx(params->px, NULL, width, height, palette, nColors, FALSE, FALSE, FALSE, diffuse,
-		params->balance, params->colorBalance, params->enhanceColors);
+	ditherImagePaletteMode(params->px, NULL, width, height, palette, nColors, FALSE, FALSE, FALSE, params->dither, params->diffuseAmount,
+		params->balance, params->colorBalance, params->enhanceColors, NULL);
 
 	//write texel data.
+	PALETTE_SEARCH search;
+	paletteSearchInit(&search, palette, nColors, width * height);
 	for (int i = 0; i < width * height; i++) {
 		COLOR32 p = params->px[i];
-		int index = closestPalette(p, palette, nColors);
+		int index = paletteSearchClosest(&search, p);
 		int alpha = (((p >> 24) & 0xFF) * alphaMax + 127) / 255;
 		txel[i] = index | (alpha << alphaShift);
 		if (params->ditherAlpha) {				
@@ -173,6 +178,7 @@ int textureConvertTranslucent(CREATEPARAMS *params) {
 			doDiffuse(i, width, height, params->px, 0, 0, 0, -errorAlpha, params->diffuseAmount);
 		}
 	}
+	paletteSearchFree(&search);
 
 	//update texture info
 	if (params->dest->palette.pal) free(params->dest->palette.pal);
@@ -207,9 +213,9 @@ COLOR32 blend(COLOR32 col1, int weight1, COLOR32 col2, int weight2) {
 	return ColorRoundToDS18(r3 | (g3 << 8) | (b3 << 16));
 }
 
-volatile g_texCompressionProgress = 0;
-volatile g_texCompressionProgressMax = 0;
-volatile g_texCompressionFinished = 0;
+static void texconvProgressAdd(TEXCONV_PROGRESS *progress, int amount) {
+	if (progress != NULL) InterlockedExchangeAdd(&progress->progress, amount);
+}
 
 typedef struct {
 	uint8_t rgb[64];           //the tile's initial RGBA color data
@@ -476,13 +482,36 @@ void choosePaletteAndMode(REDUCTION *reduction, TILEDATA *tile) {
 	}
 }
 
-void addTile(REDUCTION *reduction, TILEDATA *data, int index, COLOR32 *px, int *totalIndex) {
-	memcpy(data[index].rgb, px, 64);
-	data[index].duplicate = 0;
-	data[index].used = 1;
-	data[index].transparentPixels = 0;
-	data[index].mode = 0;
-	data[index].paletteIndex = 0;
+//state shared by the worker threads of textureConvert4x4
+typedef struct TEX4X4_CONTEXT_ {
+	CREATEPARAMS *params;
+	REDUCTION **reductions;    //one per worker thread, acquired on first use
+	TILEDATA *tileData;
+	int *pixelDuplicate;       //first earlier tile with the same pixels, or -1
+	COLOR *palette;
+	int nUsedColors;
+	uint16_t *pidx;
+	uint32_t *txel;
+	int dither;
+	float diffuse;
+} TEX4X4_CONTEXT;
+
+static REDUCTION *tex4x4GetReduction(TEX4X4_CONTEXT *context, int threadIndex) {
+	REDUCTION *reduction = context->reductions[threadIndex];
+	if (reduction == NULL) {
+		CREATEPARAMS *params = context->params;
+		reduction = reductionAcquire(params->balance, params->colorBalance, 15, params->enhanceColors, 4);
+		context->reductions[threadIndex] = reduction;
+	}
+	return reduction;
+}
+
+static void initTile(TILEDATA *tile, COLOR32 *px) {
+	memcpy(tile->rgb, px, 64);
+	tile->duplicate = 0;
+	tile->used = 1;
+	tile->mode = 0;
+	tile->paletteIndex = 0;
 
 	//count transparent pixels
 	int nTransparentPixels = 0;
@@ -491,70 +520,57 @@ void addTile(REDUCTION *reduction, TILEDATA *data, int index, COLOR32 *px, int *
 		int a = (c >> 24) & 0xFF;
 		if (a < 0x80) nTransparentPixels++;
 	}
-	data[index].transparentPixels = nTransparentPixels;
+	tile->transparentPixels = nTransparentPixels;
 
 	//is fully transparent?
 	if (nTransparentPixels == 16) {
-		data[index].used = 0;
-		data[index].paletteIndex = 0;
-		data[index].mode = COMP_TRANSPARENT | COMP_FULL;
-		data[index].palette[0] = 0;
-		data[index].palette[1] = 0;
-		return;
+		tile->used = 0;
+		tile->mode = COMP_TRANSPARENT | COMP_FULL;
+		tile->palette[0] = 0;
+		tile->palette[1] = 0;
 	}
-	
-	//is it a duplicate?
-	int isDuplicate = 0;
-	int duplicateIndex = 0;
-	for (int i = index - 1; i >= 0; i--) {
-		TILEDATA *tile = data + i;
-		COLOR32 *px1 = (COLOR32 *) tile->rgb;
-		COLOR32 *px2 = (COLOR32 *) data[index].rgb;
+}
 
-		if (!memcmp(px1, px2, 16 * sizeof(COLOR32))) {
-			isDuplicate = 1;
-			duplicateIndex = i;
-			break;
-		}
+static unsigned int hashTilePixels(TILEDATA *tile) {
+	unsigned int hash = 0x811C9DC5;
+	for (int i = 0; i < 64; i++) {
+		hash = (hash ^ tile->rgb[i]) * 0x01000193;
 	}
+	return hash;
+}
 
-	if (isDuplicate) {
-		memcpy(data + index, data + duplicateIndex, sizeof(TILEDATA));
-		data[index].duplicate = 1;
-		data[index].paletteIndex = data[duplicateIndex].paletteIndex;
-	} else {
-		//generate a palette and determine the mode.
-		choosePaletteAndMode(reduction, data + index);
-		data[index].paletteIndex = *totalIndex;
-		//is the palette and mode identical to a non-duplicate tile?
-		for (int i = index - 1; i >= 0; i--) {
-			TILEDATA *tile1 = data + i;
-			TILEDATA *tile2 = data + index;
-			if (tile1->duplicate) continue;
-			if (tile1->mode != tile2->mode) continue;
-			if (tile1->palette[0] != tile2->palette[0] || tile1->palette[1] != tile2->palette[1]) continue;
-			if (!(tile1->mode & COMP_INTERPOLATE)) {
-				if (tile1->palette[2] != tile2->palette[2] || tile1->palette[3] != tile2->palette[3]) continue;
-			}
-			//palettes and modes are the same, mark as duplicate.
-			tile2->duplicate = 1;
-			tile2->paletteIndex = tile1->paletteIndex;
-			break;
-		}
+static unsigned int hashTilePalette(TILEDATA *tile) {
+	unsigned int hash = tile->mode * 0x9E3779B1;
+	int nColors = (tile->mode & COMP_INTERPOLATE) ? 2 : 4;
+	for (int i = 0; i < nColors; i++) {
+		hash = (hash ^ tile->palette[i]) * 0x01000193;
 	}
-	if (!data[index].duplicate) {
-		int nPalettes = 1;
-		if (!(data[index].mode & COMP_INTERPOLATE)) {
-			nPalettes = 2;
-		}
-		*totalIndex += nPalettes;
+	return hash;
+}
+
+static int tilePalettesEqual(TILEDATA *tile1, TILEDATA *tile2) {
+	if (tile1->mode != tile2->mode) return 0;
+	if (tile1->palette[0] != tile2->palette[0] || tile1->palette[1] != tile2->palette[1]) return 0;
+	if (!(tile1->mode & COMP_INTERPOLATE)) {
+		if (tile1->palette[2] != tile2->palette[2] || tile1->palette[3] != tile2->palette[3]) return 0;
 	}
-	g_texCompressionProgress++;
+	return 1;
 }
 
-TILEDATA *createTileData(REDUCTION *reduction, COLOR32 *px, int tilesX, int tilesY) {
-	TILEDATA *data = (TILEDATA *) calloc(tilesX * tilesY, sizeof(TILEDATA));
-	int paletteIndex = 0;
+static void createTileDataWorker(void *param, int index, int threadIndex) {
+	TEX4X4_CONTEXT *context = (TEX4X4_CONTEXT *) param;
+	TILEDATA *tile = context->tileData + index;
+
+	//generate a palette and determine the mode for tiles that aren't copies of an earlier one.
+	if (tile->used && context->pixelDuplicate[index] == -1) {
+		choosePaletteAndMode(tex4x4GetReduction(context, threadIndex), tile);
+	}
+	texconvProgressAdd(context->params->progress, 1);
+}
+
+TILEDATA *createTileData(TEX4X4_CONTEXT *context, COLOR32 *px, int tilesX, int tilesY) {
+	int nTiles = tilesX * tilesY;
+	TILEDATA *data = (TILEDATA *) calloc(nTiles, sizeof(TILEDATA));
 	for (int y = 0; y < tilesY; y++) {
 		for (int x = 0; x < tilesX; x++) {
 			COLOR32 tile[16];
@@ -563,9 +579,72 @@ TILEDATA *createTileData(REDUCTION *reduction, COLOR32 *px, int tilesX, int tile
 			memcpy(tile + 4, px + offs + tilesX * 4, 16);
 			memcpy(tile + 8, px + offs + tilesX * 8, 16);
 			memcpy(tile + 12, px + offs + tilesX * 12, 16);
-			addTile(reduction, data, x + y * tilesX, tile, &paletteIndex);
+			initTile(data + x + y * tilesX, tile);
+		}
+	}
+
+	//hash table of tile index + 1, sized to stay at most half full.
+	int tableSize = 16;
+	while (tableSize < nTiles * 2) tableSize <<= 1;
+	int *table = (int *) calloc(tableSize, sizeof(int));
+
+	//find tiles whose pixels match an earlier tile's.
+	int *pixelDuplicate = (int *) calloc(nTiles, sizeof(int));
+	for (int i = 0; i < nTiles; i++) {
+		pixelDuplicate[i] = -1;
+		if (!data[i].used) continue;
+
+		int slot = hashTilePixels(data + i) & (tableSize - 1);
+		while (table[slot] && memcmp(data[table[slot] - 1].rgb, data[i].rgb, 64)) {
+			slot = (slot + 1) & (tableSize - 1);
+		}
+		if (table[slot]) pixelDuplicate[i] = table[slot] - 1;
+		else table[slot] = i + 1;
+	}
+
+	//the palettes of unique tiles don't depend on one another, so choose them in parallel.
+	context->tileData = data;
+	context->pixelDuplicate = pixelDuplicate;
+	parallelFor(nTiles, createTileDataWorker, context);
+
+	//assign palette indices in tile order. A tile whose palette and mode match
+	//those of the latest earlier non-duplicate tile shares its palette.
+	memset(table, 0, tableSize * sizeof(int));
+	int totalIndex = 0;
+	for (int i = 0; i < nTiles; i++) {
+		TILEDATA *tile = data + i;
+		if (pixelDuplicate[i] != -1) {
+			memcpy(tile, data + pixelDuplicate[i], sizeof(TILEDATA));
+			tile->duplicate = 1;
+			continue;
+		}
+
+		if (tile->used) tile->paletteIndex = totalIndex;
+		int slot = hashTilePalette(tile) & (tableSize - 1);
+		while (table[slot] && !tilePalettesEqual(data + table[slot] - 1, tile)) {
+			slot = (slot + 1) & (tableSize - 1);
+		}
+		if (!tile->used) {
+			table[slot] = i + 1;
+			continue;
+		}
+
+		if (table[slot]) {
+			//palettes and modes are the same, mark as duplicate.
+			tile->duplicate = 1;
+			tile->paletteIndex = data[table[slot] - 1].paletteIndex;
+		} else {
+			table[slot] = i + 1;
+			int nPalettes = 1;
+			if (!(tile->mode & COMP_INTERPOLATE)) {
+				nPalettes = 2;
+			}
+			totalIndex += nPalettes;
 		}
 	}
+	free(table);
+	free(pixelDuplicate);
+	context->pixelDuplicate = NULL;
 	return data;
 }
 
@@ -601,70 +680,191 @@ int computePaletteDifference(COLOR *pal1, COLOR *pal2, int nColors, int nMaxErro
 	return total;
 }
 
-int findClosestPalettes(COLOR *palette, uint8_t *colorTable, int nColors, int *colorIndex1, int *colorIndex2) {
-	//determine which two palettes are the most similar. For 2-color palettes, multiply difference by 2.
-	int leastDistance = 0x10000000;
-	int idx1 = 0;
+//palettes built so far by buildPalette. Palettes are numbered in the order they
+//were created, which is also the order they sit in the palette array.
+typedef struct PALETTE_SET_ {
+	COLOR *palette;
+	uint8_t *colorTable;
+	int nEntries;              //size of palette and colorTable
+	int *ids;                  //palettes currently in the array, in order
+	int nIds;
+	int *slot;                 //first palette entry of each palette
+	int *closest;              //closest later palette of the same type, or -1
+	int *closestDistance;
+	int *mergedInto;           //palette a palette was merged into, or itself
+	int *firstTile;            //first tile using each palette
+	int *nextTile;             //next tile using the same palette, in tile order, or -1
+	int *tileGroup;            //palette each tile's group started with, or -1
+} PALETTE_SET;
+
+#define PALETTE_SET_NO_DISTANCE 0x10000000
+
+static void paletteSetInit(PALETTE_SET *set, COLOR *palette, uint8_t *colorTable, int nEntries, TILEDATA *tileData, int nTiles) {
+	set->palette = palette;
+	set->colorTable = colorTable;
+	set->nEntries = nEntries;
+	set->nIds = 0;
+	set->ids = (int *) calloc(nTiles, sizeof(int));
+	set->slot = (int *) calloc(nTiles, sizeof(int));
+	set->closest = (int *) calloc(nTiles, sizeof(int));
+	set->closestDistance = (int *) calloc(nTiles, sizeof(int));
+	set->mergedInto = (int *) calloc(nTiles, sizeof(int));
+	set->firstTile = (int *) calloc(nTiles, sizeof(int));
+	set->nextTile = (int *) calloc(nTiles, sizeof(int));
+	set->tileGroup = (int *) calloc(nTiles, sizeof(int));
+
+	//a tile and its duplicates start out with the same palette index, and every
+	//merge remaps them together, so each such group shares one palette. The
+	//groups get palettes in order as their first non-duplicate tile is reached.
+	int *firstGroup = (int *) calloc(0x10000, sizeof(int));
+	int *lastGroup = (int *) calloc(0x10000, sizeof(int));
+	int *lastTile = (int *) calloc(nTiles, sizeof(int));
+	for (int i = 0; i < 0x10000; i++) {
+		firstGroup[i] = -1;
+		lastGroup[i] = -1;
+	}
+	int nGroups = 0;
+	for (int i = 0; i < nTiles; i++) {
+		TILEDATA *tile = tileData + i;
+		if (tile->used && !tile->duplicate && firstGroup[tile->paletteIndex] == -1) {
+			firstGroup[tile->paletteIndex] = nGroups;
+		}
+		if (tile->used && !tile->duplicate) nGroups++;
+	}
 
-	while (idx1 < nColors) {
-		uint8_t type1 = colorTable[idx1];
-		if (type1 == 0) break;
-		int nColorsInThisPalette = 2;
-		if (type1 == 4 || type1 == 1) {
-			nColorsInThisPalette = 4;
+	nGroups = 0;
+	for (int i = 0; i < nTiles; i++) {
+		TILEDATA *tile = tileData + i;
+		set->nextTile[i] = -1;
+		set->mergedInto[i] = i;
+		set->firstTile[i] = -1;
+		if (!tile->used) {
+			set->tileGroup[i] = -1;
+			continue;
 		}
 
-		//start searching forward.
-		int idx2 = idx1 + nColorsInThisPalette;
-		while (idx2 + nColorsInThisPalette <= nColors) {
-			uint8_t type2 = colorTable[idx2];
-			if (!type2) break;
-			int nColorsInSecondPalette = getColorsFromTable(type2);
-			if (type2 != type1) {
-				idx2 += nColorsInSecondPalette;
-				continue;
-			}
+		int group;
+		if (!tile->duplicate) {
+			group = nGroups++;
+			lastGroup[tile->paletteIndex] = group;
+		} else {
+			group = lastGroup[tile->paletteIndex];
+			if (group == -1) group = firstGroup[tile->paletteIndex];
+		}
+		set->tileGroup[i] = group;
+		if (group == -1) continue;
 
-			//same type, let's compare.
-			int dst = computePaletteDifference(palette + idx1, palette + idx2, nColorsInThisPalette, leastDistance);
-			if (dst < leastDistance) {
-				leastDistance = dst;
-				*colorIndex1 = idx1;
-				*colorIndex2 = idx2;
-				if (!leastDistance) return 0;
-			}
+		//groups only ever gain tiles after their own, so the lists stay in tile order.
+		if (set->firstTile[group] == -1) set->firstTile[group] = i;
+		else set->nextTile[lastTile[group]] = i;
+		lastTile[group] = i;
+	}
+	free(firstGroup);
+	free(lastGroup);
+	free(lastTile);
+}
+
+static void paletteSetFree(PALETTE_SET *set) {
+	free(set->ids);
+	free(set->slot);
+	free(set->closest);
+	free(set->closestDistance);
+	free(set->mergedInto);
+	free(set->firstTile);
+	free(set->nextTile);
+	free(set->tileGroup);
+}
+
+static int paletteSetFindMerged(PALETTE_SET *set, int id) {
+	while (set->mergedInto[id] != id) {
+		set->mergedInto[id] = set->mergedInto[set->mergedInto[id]];
+		id = set->mergedInto[id];
+	}
+	return id;
+}
+
+static int paletteSetDistance(PALETTE_SET *set, int id1, int id2, int nMaxError) {
+	int nColors = getColorsFromTable(set->colorTable[set->slot[id1]]);
+	return computePaletteDifference(set->palette + set->slot[id1], set->palette + set->slot[id2], nColors, nMaxError);
+}
+
+static void paletteSetUpdateClosest(PALETTE_SET *set, int id, int other) {
+	//ties go to the earlier palette, as they would in a scan of all pairs.
+	int distance = paletteSetDistance(set, id, other, set->closestDistance[id] + 1);
+	if (distance < set->closestDistance[id] || (distance == set->closestDistance[id] && other < set->closest[id])) {
+		set->closest[id] = other;
+		set->closestDistance[id] = distance;
+	}
+}
 
-			idx2 += nColorsInThisPalette;
+static void paletteSetFindClosest(PALETTE_SET *set, int index) {
+	int id = set->ids[index];
+	uint8_t type = set->colorTable[set->slot[id]];
+	set->closest[id] = -1;
+	set->closestDistance[id] = PALETTE_SET_NO_DISTANCE;
+	for (int i = index + 1; i < set->nIds && set->closestDistance[id]; i++) {
+		int other = set->ids[i];
+		if (set->colorTable[set->slot[other]] != type) continue;
+
+		int distance = paletteSetDistance(set, id, other, set->closestDistance[id]);
+		if (distance < set->closestDistance[id]) {
+			set->closest[id] = other;
+			set->closestDistance[id] = distance;
 		}
-		idx1 += nColorsInThisPalette;
+	}
+}
 
+static void paletteSetAdd(PALETTE_SET *set, int id, int slot) {
+	set->slot[id] = slot;
+	set->closest[id] = -1;
+	set->closestDistance[id] = PALETTE_SET_NO_DISTANCE;
+
+	uint8_t type = set->colorTable[slot];
+	for (int i = 0; i < set->nIds; i++) {
+		int other = set->ids[i];
+		if (set->colorTable[set->slot[other]] == type) paletteSetUpdateClosest(set, other, id);
+	}
+	set->ids[set->nIds++] = id;
+}
+
+static int paletteSetFindClosestPair(PALETTE_SET *set, int *id1, int *id2) {
+	//determine which two palettes are the most similar. For 2-color palettes, the difference is doubled.
+	int leastDistance = PALETTE_SET_NO_DISTANCE;
+	*id1 = -1;
+	*id2 = -1;
+	for (int i = 0; i < set->nIds; i++) {
+		int id = set->ids[i];
+		if (set->closestDistance[id] < leastDistance) {
+			leastDistance = set->closestDistance[id];
+			*id1 = id;
+			*id2 = set->closest[id];
+		}
 	}
 	return leastDistance;
 }
 
-void mergePalettes(REDUCTION *reduction, TILEDATA *tileData, int nTiles, COLOR *palette, int paletteIndex, uint16_t palettesMode) {
+void mergePalettes(REDUCTION *reduction, TILEDATA *tileData, int firstTile, int *nextTile, COLOR *palette, uint16_t palettesMode) {
 	//count the number of tiles that use this palette.
 	int nUsedTiles = 0;
-	for (int i = 0; i < nTiles; i++) {
-		if (tileData[i].paletteIndex == paletteIndex && tileData[i].used) nUsedTiles++;
+	for (int i = firstTile; i != -1; i = nextTile[i]) {
+		nUsedTiles++;
 	}
 
 	//use the mode to determine the appropriate method of creating the palette.
-	COLOR32 expandPal[4];
+	//slot 3 of a transparent palette is never filled in, keep it from holding garbage.
+	COLOR32 expandPal[4] = { 0 };
 	if (palettesMode == (COMP_TRANSPARENT | COMP_FULL)) {
 		//transparent, full color
 		resetHistogram(reduction);
-		for (int i = 0; i < nTiles; i++) {
-			if (tileData[i].paletteIndex == paletteIndex && tileData[i].used) {
-				computeHistogram(reduction, (COLOR32 *) tileData[i].rgb, 4, 4);
-			}
+		for (int i = firstTile; i != -1; i = nextTile[i]) {
+			computeHistogram(reduction, (COLOR32 *) tileData[i].rgb, 4, 4);
 		}
 		createPaletteFromHistogram(reduction, 3, expandPal + 1);
 
-		palette[paletteIndex * 2 + 0] = ColorConvertToDS(expandPal[2]); //don't waste this slot
-		palette[paletteIndex * 2 + 1] = ColorConvertToDS(expandPal[1]);
-		palette[paletteIndex * 2 + 2] = ColorConvertToDS(expandPal[2]);
-		palette[paletteIndex * 2 + 3] = ColorConvertToDS(expandPal[0]);
+		palette[0] = ColorConvertToDS(expandPal[2]); //don't waste this slot
+		palette[1] = ColorConvertToDS(expandPal[1]);
+		palette[2] = ColorConvertToDS(expandPal[2]);
+		palette[3] = ColorConvertToDS(expandPal[0]);
 	} else if (palettesMode & COMP_INTERPOLATE) {
 		//transparent, interpolated, and opaque, interpolated
 
@@ -673,52 +873,105 @@ void mergePalettes(REDUCTION *reduction, TILEDATA *tileData, int nTiles, COLOR *
 
 		//copy tiles into the buffer
 		int copiedTiles = 0;
-		for (int i = 0; i < nTiles; i++) {
-			if (tileData[i].paletteIndex == paletteIndex && tileData[i].used) {
-				memcpy(px + copiedTiles * 16, tileData[i].rgb, 16 * 4);
-				copiedTiles++;
-			}
+		for (int i = firstTile; i != -1; i = nextTile[i]) {
+			memcpy(px + copiedTiles * 16, tileData[i].rgb, 16 * 4);
+			copiedTiles++;
 		}
 		getColorBounds(reduction, px, 16 * nUsedTiles, &expandPal[0], &expandPal[1]);
 		free(px);
 
-		palette[paletteIndex * 2 + 0] = ColorConvertToDS(expandPal[1]);
-		palette[paletteIndex * 2 + 1] = ColorConvertToDS(expandPal[0]);
+		palette[0] = ColorConvertToDS(expandPal[1]);
+		palette[1] = ColorConvertToDS(expandPal[0]);
 	} else if (palettesMode == (COMP_OPAQUE | COMP_FULL)) {
 		//opaque, full color
 		resetHistogram(reduction);
-		for (int i = 0; i < nTiles; i++) {
-			if (tileData[i].paletteIndex == paletteIndex && tileData[i].used) {
-				computeHistogram(reduction, (COLOR32 *) tileData[i].rgb, 4, 4);
-			}
+		for (int i = firstTile; i != -1; i = nextTile[i]) {
+			computeHistogram(reduction, (COLOR32 *) tileData[i].rgb, 4, 4);
 		}
 		int nFull = createPaletteFromHistogram(reduction, 4, expandPal);
 
 		if (nFull < 4) expandPal[0] = expandPal[1];
-		palette[paletteIndex * 2 + 0] = ColorConvertToDS(expandPal[3]);
-		palette[paletteIndex * 2 + 1] = ColorConvertToDS(expandPal[1]);
-		palette[paletteIndex * 2 + 2] = ColorConvertToDS(expandPal[2]);
-		palette[paletteIndex * 2 + 3] = ColorConvertToDS(expandPal[0]);
+		palette[0] = ColorConvertToDS(expandPal[3]);
+		palette[1] = ColorConvertToDS(expandPal[1]);
+		palette[2] = ColorConvertToDS(expandPal[2]);
+		palette[3] = ColorConvertToDS(expandPal[0]);
 	}
 }
 
-int buildPalette(REDUCTION *reduction, COLOR *palette, int nPalettes, TILEDATA *tileData, int tilesX, int tilesY, int threshold) {
+static int paletteSetMerge(PALETTE_SET *set, REDUCTION *reduction, TILEDATA *tileData, int id1, int id2) {
+	int slot1 = set->slot[id1], slot2 = set->slot[id2];
+	int nColorsInPalettes = getColorsFromTable(set->colorTable[slot1]);
+	uint16_t palettesMode = getModeFromTable(set->colorTable[slot1]);
+
+	//move entries in palette and colorTable.
+	int nToShift = set->nEntries - slot2 - nColorsInPalettes;
+	memmove(set->palette + slot2, set->palette + slot2 + nColorsInPalettes, nToShift * sizeof(COLOR));
+	memmove(set->colorTable + slot2, set->colorTable + slot2 + nColorsInPalettes, nToShift);
+
+	//drop id2 from the list, moving the palettes after it down.
+	int index2 = 0;
+	while (set->ids[index2] != id2) index2++;
+	for (int i = index2 + 1; i < set->nIds; i++) {
+		set->slot[set->ids[i]] -= nColorsInPalettes;
+	}
+	memmove(set->ids + index2, set->ids + index2 + 1, (set->nIds - index2 - 1) * sizeof(int));
+	set->nIds--;
+
+	//tiles that used id2 now use id1. Merge the two tile lists keeping tile order.
+	int *link = &set->firstTile[id1];
+	int tile1 = set->firstTile[id1], tile2 = set->firstTile[id2];
+	while (tile1 != -1 || tile2 != -1) {
+		if (tile2 == -1 || (tile1 != -1 && tile1 < tile2)) {
+			*link = tile1;
+			tile1 = set->nextTile[tile1];
+		} else {
+			*link = tile2;
+			tile2 = set->nextTile[tile2];
+		}
+		link = &set->nextTile[*link];
+	}
+	*link = -1;
+	set->firstTile[id2] = -1;
+	set->mergedInto[id2] = id1;
+
+	//merge those palettes that we've just combined.
+	mergePalettes(reduction, tileData, set->firstTile[id1], set->nextTile, set->palette + slot1, palettesMode);
+
+	//only pairs involving the two merged palettes have changed.
+	uint8_t type = set->colorTable[slot1];
+	for (int i = 0; i < set->nIds; i++) {
+		int id = set->ids[i];
+		if (id == id1 || set->closest[id] == id1 || set->closest[id] == id2) {
+			paletteSetFindClosest(set, i);
+		} else if (id < id1 && set->colorTable[set->slot[id]] == type) {
+			paletteSetUpdateClosest(set, id, id1);
+		}
+	}
+	return nColorsInPalettes;
+}
+
+int buildPalette(REDUCTION *reduction, COLOR *palette, int nPalettes, TILEDATA *tileData, int tilesX, int tilesY, int threshold, TEXCONV_PROGRESS *progress) {
 	//iterate over all non-duplicate tiles, adding the palettes.
 	//colorTable keeps track of how each color is intended to be used.
 	//00 - unused. 01 - mode 0x0000. 02 - mode 0x4000. 04 - mode 0x8000. 08 - mode 0xC000.
 	uint8_t *colorTable = (uint8_t *) calloc(nPalettes * 2, 1);
 	int diffThreshold = threshold * threshold * 52; //threshold 0-100, square normalized to 0-1040400/2
 	int firstSlot = 0;
+
+	//each palette remembers its closest later palette, so finding the closest pair
+	//doesn't need to compare every pair, and tiles are only given their final
+	//palette index once all merging is done.
+	PALETTE_SET set;
+	paletteSetInit(&set, palette, colorTable, nPalettes * 2, tileData, tilesX * tilesY);
 	for (int y = 0; y < tilesY; y++) {
 		for (int x = 0; x < tilesX; x++) {
 			int index = x + y * tilesX;
 			TILEDATA *tile = tileData + index;
 			if (tile->duplicate || !tile->used) {
-				//the paletteIndex field of a duplicate tile is first set to the tile index it is a duplicate of.
-				//set it to an actual palette index here.
-				g_texCompressionProgress++;
+				texconvProgressAdd(progress, 1);
 				continue;
 			}
+			int id = set.tileGroup[index];
 
 			//how many color entries does this consume?
 			int nConsumed = 4;
@@ -732,42 +985,19 @@ int buildPalette(REDUCTION *reduction, COLOR *palette, int nPalettes, TILEDATA *
 				memcpy(palette + firstSlot, tile->palette, nConsumed * sizeof(COLOR));
 				uint8_t fill = 1 << (tile->mode >> 14);
 				memset(colorTable + firstSlot, fill, nConsumed);
-				tile->paletteIndex = firstSlot / 2;
+				paletteSetAdd(&set, id, firstSlot);
 				firstSlot += nConsumed;
 			}
 			if(!fits || (threshold && firstSlot >= 8)) {
 				//does NOT fit, we need to rearrange some things.
 
 				while ((firstSlot + nConsumed > nPalettes * 2) || (threshold && fits)) {
-				//determine which two palettes are the most similar.
-					int colorIndex1 = -1, colorIndex2 = -1;
-					int distance = findClosestPalettes(palette, colorTable, firstSlot, &colorIndex1, &colorIndex2);
-					if (colorIndex1 == -1) break;
+					//merge the two most similar palettes.
+					int id1, id2;
+					int distance = paletteSetFindClosestPair(&set, &id1, &id2);
+					if (id1 == -1) break;
 					if (fits && (distance > diffThreshold || firstSlot < 8)) break;
-					int nColorsInPalettes = getColorsFromTable(colorTable[colorIndex1]);
-					uint16_t palettesMode = getModeFromTable(colorTable[colorIndex1]);
-
-					//find tiles that use colorIndex2. Set them to use colorIndex1. 
-					//then subtract from all palette indices > colorIndex2. Then we can
-					//shift over all the palette colors. Then regenerate the palette.
-					for (int i = 0; i < tilesX * tilesY; i++) {
-						if (tileData[i].paletteIndex == colorIndex2 / 2) {
-							tileData[i].paletteIndex = colorIndex1 / 2;
-						} else if (tileData[i].paletteIndex > colorIndex2 / 2) {
-							tileData[i].paletteIndex -= nColorsInPalettes / 2;
-						}
-					}
-
-					//move entries in palette and colorTable.
-					int nToShift = nPalettes * 2 - colorIndex2 - nColorsInPalettes;
-					memmove(palette + colorIndex2, palette + colorIndex2 + nColorsInPalettes, nToShift * sizeof(COLOR));
-					memmove(colorTable + colorIndex2, colorTable + colorIndex2 + nColorsInPalettes, nToShift);
-
-					//merge those palettes that we've just combined.
-					mergePalettes(reduction, tileData, tilesX * tilesY, palette, colorIndex1 / 2, palettesMode);
-
-					//update end pointer to reflect the change.
-					firstSlot -= nColorsInPalettes;
+					firstSlot -= paletteSetMerge(&set, reduction, tileData, id1, id2);
 				}
 
 				//now add this tile's colors
@@ -775,13 +1005,20 @@ int buildPalette(REDUCTION *reduction, COLOR *palette, int nPalettes, TILEDATA *
 					memcpy(palette + firstSlot, tile->palette, nConsumed * sizeof(COLOR));
 					uint8_t fill = 1 << (tile->mode >> 14);
 					memset(colorTable + firstSlot, fill, nConsumed);
-					tile->paletteIndex = firstSlot / 2;
+					paletteSetAdd(&set, id, firstSlot);
 					firstSlot += nConsumed;
 				}
 			}
-			g_texCompressionProgress++;
+			texconvProgressAdd(progress, 1);
 		}
 	}
+
+	//point every tile at the palette its group ended up in.
+	for (int i = 0; i < tilesX * tilesY; i++) {
+		if (set.tileGroup[i] == -1) continue;
+		tileData[i].paletteIndex = set.slot[paletteSetFindMerged(&set, set.tileGroup[i])] / 2;
+	}
+	paletteSetFree(&set);
 	free(colorTable);
 	return firstSlot;
 }
@@ -849,29 +1086,69 @@ uint16_t findOptimalPidx(REDUCTION *reduction, TILEDATA *tile, COLOR *palette, i
 	return leastPidx;
 }
 
+static void textureConvert4x4Worker(void *param, int i, int threadIndex) {
+	TEX4X4_CONTEXT *context = (TEX4X4_CONTEXT *) param;
+	REDUCTION *reduction = tex4x4GetReduction(context, threadIndex);
+	TILEDATA *tile = context->tileData + i;
+	uint32_t texel = 0;
+
+	//double check that these settings are the most optimal for this tile.
+	uint16_t idx = findOptimalPidx(reduction, tile, context->palette, context->nUsedColors);
+	uint16_t mode = idx & 0xC000;
+	uint16_t index = idx & 0x3FFF;
+	COLOR *thisPalette = context->palette + (index * 2);
+	context->pidx[i] = idx;
+
+	COLOR32 palette[4];
+	int paletteSize;
+	expandPalette(thisPalette, mode, palette, &paletteSize);
+
+	//if dither is enabled, do so here.
+	ditherImagePaletteMode((COLOR32 *) tile->rgb, NULL, 4, 4, palette, paletteSize, 0, 1, 0, context->dither, context->diffuse,
+		BALANCE_DEFAULT, BALANCE_DEFAULT, FALSE, NULL);
+
+	for (int j = 0; j < 16; j++) {
+		int index = 0;
+		COLOR32 col = ((COLOR32 *) tile->rgb)[j];
+		if ((col >> 24) < 0x80) {
+			index = 3;
+		} else {
+			index = closestPalette(col, palette, paletteSize);
+		}
+		texel |= index << (j * 2);
+	}
+	context->txel[i] = texel;
+	texconvProgressAdd(context->params->progress, 1);
+}
+
 int textureConvert4x4(CREATEPARAMS *params) {
 	//3-stage compression. First stage builds tile data, second stage builds palettes, third stage builds the final texture.
+	//The first and third stages work on each tile independently and are spread across threads.
 	if (params->colorEntries < 16) params->colorEntries = 16;
 	params->colorEntries = (params->colorEntries + 7) & 0xFFFFFFF8;
 	int width = params->width, height = params->height;
 	int tilesX = width / 4, tilesY = height / 4;
-	g_texCompressionProgressMax = tilesX * tilesY * 3;
-	g_texCompressionProgress = 0;
+	if (params->progress != NULL) {
+		params->progress->progressMax = tilesX * tilesY * 3;
+		params->progress->progress = 0;
+	}
 
 	//create tile data
-	REDUCTION *reduction = (REDUCTION *) calloc(1, sizeof(REDUCTION));
-	initReduction(reduction, params->balance, params->colorBalance, 15, params->enhanceColors, 4);
-	TILEDATA *tileData = createTileData(reduction, params->px, tilesX, tilesY);
+	TEX4X4_CONTEXT context = { 0 };
+	context.params = params;
+	context.reductions = (REDUCTION **) calloc(parallelGetThreadCount(), sizeof(REDUCTION *));
+	TILEDATA *tileData = createTileData(&context, params->px, tilesX, tilesY);
 
-	//build the palettes.
+	//build the palettes. Merging depends on the order tiles are visited in, so this stays on one thread.
 	COLOR *nnsPal = (COLOR *) calloc(params->colorEntries, sizeof(COLOR));
 	int nUsedColors;
 	if (!params->useFixedPalette) {
-		nUsedColors = buildPalette(reduction, nnsPal, params->colorEntries / 2, tileData, tilesX, tilesY, params->threshold);
+		REDUCTION *reduction = tex4x4GetReduction(&context, 0);
+		nUsedColors = buildPalette(reduction, nnsPal, params->colorEntries / 2, tileData, tilesX, tilesY, params->threshold, params->progress);
 	} else {
 		nUsedColors = params->colorEntries;
 		memcpy(nnsPal, params->fixedPalette, params->colorEntries * 2);
-		g_texCompressionProgress += tilesX * tilesY;
+		texconvProgressAdd(params->progress, tilesX * tilesY);
 	}
 	if (nUsedColors & 7) nUsedColors += 8 - (nUsedColors & 7);
 	if (nUsedColors < 16) nUsedColors = 16;
@@ -881,39 +1158,18 @@ int textureConvert4x4(CREATEPARAMS *params) {
 
 	//generate texel data.
 	uint32_t *txel = (uint32_t *) calloc(tilesX * tilesY, 4);
-	float diffuse = params->dither ? params->diffuseAmount : 0.0f;
-	for (int i = 0; i < tilesX * tilesY; i++) {
-		uint32_t texel = 0;
-
-		//double check that these settings are the most optimal for this tile.
-		uint16_t idx = findOptimalPidx(reduction, tileData + i, nnsPal, nUsedColors);
-		uint16_t mode = idx & 0xC000;
-		uint16_t index = idx & 0x3FFF;
-		COLOR *thisPalette = nnsPal + (index * 2);
-		pidx[i] = idx;
-
-		COLOR32 palette[4];
-		int paletteSize;
-		expandPalette(thisPalette, mode, palette, &paletteSize);
-
-		//if dither is enabled, do so here.
-		ditherImagePalette((COLOR32 *) tileData[i].rgb, 4, 4, palette, paletteSize, 0, 1, 0, diffuse);
-
-		for (int j = 0; j < 16; j++) {
-			int index = 0;
-			COLOR32 col = ((COLOR32 *) tileData[i].rgb)[j];
-			if ((col >> 24) < 0x80) {
-				index = 3;
-			} else {
-				index = closestPalette(col, palette, paletteSize);
-			}
-			texel |= index << (j * 2);
-		}
-		txel[i] = texel;
-		g_texCompressionProgress++;
+	context.palette = nnsPal;
+	context.nUsedColors = nUsedColors;
+	context.pidx = pidx;
+	context.txel = txel;
+	context.dither = params->dither;
+	context.diffuse = params->diffuseAmount;
+	parallelFor(tilesX * tilesY, textureConvert4x4Worker, &context);
+
+	for (int i = 0; i < parallelGetThreadCount(); i++) {
+		if (context.reductions[i] != NULL) reductionRelease(context.reductions[i]);
 	}
-	destroyReduction(reduction);
-	free(reduction);
+	free(context.reductions);
 
 	//set fields in the texture
 	params->dest->palette.nColors = nUsedColors;
@@ -965,7 +1221,7 @@ int textureConvert(CREATEPARAMS *params) {
 		COLOR32 p = params->px[i];
 		params->px[i] = REVERSE(p);
 	}
-	g_texCompressionFinished = 1;
+	if (params->progress != NULL) InterlockedExchange(&params->progress->finished, 1);
 	if (params->callback) params->callback(params->callbackParam);
 	if (params->useFixedPalette) free(params->fixedPalette);
 	return 0;
@@ -976,9 +1232,13 @@ DWORD CALLBACK textureStartConvertThreadEntry(LPVOID lpParam) {
 	return textureConvert(params);
 }
 
-HANDLE textureConvertThreaded(COLOR32 *px, int width, int height, int fmt, int dither, float diffuse, int ditherAlpha, int colorEntries, int useFixedPalette, COLOR *fixedPalette, int threshold, int balance, int colorBalance, int enhanceColors, char *pnam, TEXTURE *dest, void (*callback) (void *), void *callbackParam) {
+HANDLE textureConvertThreaded(COLOR32 *px, int width, int height, int fmt, int dither, float diffuse, int ditherAlpha, int colorEntries, int useFixedPalette, COLOR *fixedPalette, int threshold, int balance, int colorBalance, int enhanceColors, int histogramSamples, char *pnam, TEXTURE *dest, TEXCONV_PROGRESS *progress, void (*callback) (void *), void *callbackParam) {
 	CREATEPARAMS *params = (CREATEPARAMS *) calloc(1, sizeof(CREATEPARAMS));
-	g_texCompressionFinished = 0;
+	if (progress != NULL) {
+		progress->progress = 0;
+		progress->progressMax = 0;
+		progress->finished = 0;
+	}
 	params->px = px;
 	params->width = width;
 	params->height = height;
@@ -991,11 +1251,13 @@ HANDLE textureConvertThreaded(COLOR32 *px, int width, int height, int fmt, int d
 	params->balance = balance;
 	params->colorBalance = colorBalance;
 	params->enhanceColors = enhanceColors;
+	params->histogramSamples = histogramSamples;
 	params->dest = dest;
+	params->progress = progress;
 	params->callback = callback;
 	params->callbackParam = callbackParam;
 	params->useFixedPalette = useFixedPalette;
 	params->fixedPalette = useFixedPalette ? fixedPalette : NULL;
 	memcpy(params->pnam, pnam, strlen(pnam) + 1);
 	return CreateThread(NULL, 0, textureStartConvertThreadEntry, (LPVOID) params, 0, NULL);
-}
\ No newline at end of file
+}
\ No newline at end of file
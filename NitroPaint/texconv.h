@@ -2,6 +2,16 @@
 #include <Windows.h>
 #include "texture.h"
 
+//
+// Progress of a texture conversion. The conversion updates it from its worker
+// threads while other threads may read it at any time.
+//
+typedef struct TEXCONV_PROGRESS_ {
+	volatile LONG progress;
+	volatile LONG progressMax;
+	volatile LONG finished;
+} TEXCONV_PROGRESS;
+
 //
 // Structure used by texture conversion functions.
 //
@@ -20,7 +30,9 @@ typedef struct {
 	int balance;
 	int colorBalance;
 	int enhanceColors;
+	int histogramSamples; //per 8x8 block for palette histograms, HISTOGRAM_SAMPLES_FULL for every pixel
 	TEXTURE *dest;
+	TEXCONV_PROGRESS *progress; //may be NULL
 	void (*callback) (void *);
 	void *callbackParam;
 	char pnam[17];
@@ -46,11 +58,6 @@ int textureConvertPalette(CREATEPARAMS *params);
 //
 int textureConvertTranslucent(CREATEPARAMS *params);
 
-//progress markers for textureConvert4x4.
-extern volatile g_texCompressionProgress;
-extern volatile g_texCompressionProgressMax;
-extern volatile g_texCompressionFinished;
-
 //
 // Convert an image to a 4x4 compressed texture
 //
@@ -63,5 +70,6 @@ int textureConvert(CREATEPARAMS *params);
 
 //
 // Begin a texture conversion in a new thread, returning a handle to the thread.
+// If progress is not NULL, it is reset and then kept updated by the conversion.
 //
-HANDLE textureConvertThreaded(COLOR32 *px, int width, int height, int fmt, int dither, float diffuse, int ditherAlpha, int colorEntries, int useFixedPalette, COLOR *fixedPalette, int threshold, int balance, int colorBalance, int enhanceColors, char *pnam, TEXTURE *dest, void (*callback) (void *), void *callbackParam);
+HANDLE textureConvertThreaded(COLOR32 *px, int width, int height, int fmt, int dither, float diffuse, int ditherAlpha, int colorEntries, int useFixedPalette, COLOR *fixedPalette, int threshold, int balance, int colorBalance, int enhanceColors, int histogramSamples, char *pnam, TEXTURE *dest, TEXCONV_PROGRESS *progress, void (*callback) (void *), void *callbackParam);
@@ -1263,6 +1263,7 @@ void updateConvertDialog(TEXTUREEDITORDATA *data) {
 	setStyle(data->hWndBalance, fmt == CT_DIRECT, WS_DISABLED);
 	setStyle(data->hWndColorBalance, fmt == CT_DIRECT, WS_DISABLED);
 	setStyle(data->hWndEnhanceColors, fmt == CT_DIRECT, WS_DISABLED);
+	setStyle(data->hWndSampleHistogram, fmt == CT_4x4 || fmt == CT_DIRECT || fixedPalette, WS_DISABLED);
 
 	setStyle(data->hWndDiffuseAmount, !((dither && !disables[1]) || (ditherAlpha && !disables[0])), WS_DISABLED);
 	SetFocus(data->hWndConvertDialog);
@@ -1334,6 +1335,7 @@ LRESULT CALLBACK ConvertDialogWndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM
 			CreateWindow(L"STATIC", L"Balance:", WS_VISIBLE | WS_CHILD | SS_CENTERIMAGE, leftX, bottomY, 100, 22, hWnd, NULL, NULL, NULL);
 			CreateWindow(L"STATIC", L"Color Balance:", WS_VISIBLE | WS_CHILD | SS_CENTERIMAGE, leftX, bottomY + 27, 100, 22, hWnd, NULL, NULL, NULL);
 			data->hWndEnhanceColors = CreateWindow(L"BUTTON", L"Enhance Colors", WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX, leftX, bottomY + 27 * 2, 200, 22, hWnd, NULL, NULL, NULL);
+			data->hWndSampleHistogram = CreateWindow(L"BUTTON", L"Sample Large Images", WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX, leftX + 210, bottomY + 27 * 2, 200, 22, hWnd, NULL, NULL, NULL);
 			CreateWindow(L"STATIC", L"Lightness", WS_VISIBLE | WS_CHILD | SS_CENTERIMAGE | SS_RIGHT, leftX + 110, bottomY, 50, 22, hWnd, NULL, NULL, NULL);
 			CreateWindow(L"STATIC", L"Color", WS_VISIBLE | WS_CHILD | SS_CENTERIMAGE, leftX + 110 + 50 + 200, bottomY, 50, 22, hWnd, NULL, NULL, NULL);
 			CreateWindow(L"STATIC", L"Green", WS_VISIBLE | WS_CHILD | SS_CENTERIMAGE | SS_RIGHT, leftX + 110, bottomY + 27, 50, 22, hWnd, NULL, NULL, NULL);
@@ -1451,6 +1453,8 @@ LRESULT CALLBACK ConvertDialogWndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM
 					int balance = SendMessage(data->hWndBalance, TBM_GETPOS, 0, 0);
 					int colorBalance = SendMessage(data->hWndColorBalance, TBM_GETPOS, 0, 0);
 					BOOL enhanceColors = SendMessage(data->hWndEnhanceColors, BM_GETCHECK, 0, 0) == BST_CHECKED;
+					BOOL sampleHistogram = SendMessage(data->hWndSampleHistogram, BM_GETCHECK, 0, 0) == BST_CHECKED;
+					int histogramSamples = sampleHistogram ? histogramSamplesForImage(data->width, data->height) : HISTOGRAM_SAMPLES_FULL;
 					BOOL limitPalette = SendMessage(data->hWndLimitPalette, BM_GETCHECK, 0, 0) == BST_CHECKED;
 
 					//if we set to not limit palette, set the max size to the max allowed
@@ -1465,14 +1469,14 @@ LRESULT CALLBACK ConvertDialogWndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM
 
 					HWND hWndMain = (HWND) GetWindowLong(hWnd, GWL_HWNDPARENT);
 					data->hWndProgress = CreateWindow(L"CompressionProgress", L"Compressing", WS_OVERLAPPEDWINDOW & ~(WS_THICKFRAME | WS_MAXIMIZEBOX | WS_MINIMIZEBOX), 
-													  CW_USEDEFAULT, CW_USEDEFAULT, 500, 150, hWndMain, NULL, NULL, NULL);
+													  CW_USEDEFAULT, CW_USEDEFAULT, 500, 150, hWndMain, NULL, NULL, &data->convertProgress);
 					ShowWindow(data->hWndProgress, SW_SHOW);
 					SendMessage(hWnd, WM_CLOSE, 0, 0);
 					SetActiveWindow(data->hWndProgress);
 					textureConvertThreaded(data->px, data->width, data->height, fmt, dither, diffuse, ditherAlpha, 
 									fixedPalette ? paletteFile.nColors : (fmt == CT_4x4 ? colorEntries : paletteSize), 
-									fixedPalette, paletteFile.colors, optimization, balance, colorBalance, enhanceColors,
-									mbpnam, &data->textureData, conversionCallback, (void *) data);
+									fixedPalette, paletteFile.colors, optimization, balance, colorBalance, enhanceColors, histogramSamples,
+									mbpnam, &data->textureData, &data->convertProgress, conversionCallback, (void *) data);
 
 					SetWindowLong(hWndMain, GWL_STYLE, GetWindowLong(hWndMain, GWL_STYLE) | WS_DISABLED);
 				}
@@ -1513,6 +1517,7 @@ LRESULT CALLBACK CompressionProgressProc(HWND hWnd, UINT msg, WPARAM wParam, LPA
 			HWND hWndProgress = CreateWindow(PROGRESS_CLASSW, L"", WS_VISIBLE | WS_CHILD, 10, 42, 400, 22, hWnd, NULL, NULL, NULL);
 			SendMessage(hWndProgress, PBM_DELTAPOS, 1, 0);
 			SetWindowLong(hWnd, 0, (LONG) hWndProgress);
+			SetWindowLongPtr(hWnd, sizeof(LPVOID), (LONG_PTR) ((CREATESTRUCT *) lParam)->lpCreateParams);
 			SetWindowSize(hWnd, 420, 74);
 			EnumChildWindows(hWnd, SetFontProc, (LPARAM) GetStockObject(DEFAULT_GUI_FONT));
 
@@ -1521,16 +1526,18 @@ LRESULT CALLBACK CompressionProgressProc(HWND hWnd, UINT msg, WPARAM wParam, LPA
 		}
 		case WM_TIMER:
 		{
-			if (g_texCompressionProgressMax) {
+			TEXCONV_PROGRESS *progress = (TEXCONV_PROGRESS *) GetWindowLongPtr(hWnd, sizeof(LPVOID));
+			if (progress->progressMax) {
 				HWND hWndProgress = (HWND) GetWindowLong(hWnd, 0);
-				SendMessage(hWndProgress, PBM_SETRANGE, 0, g_texCompressionProgressMax << 16);
-				SendMessage(hWndProgress, PBM_SETPOS, g_texCompressionProgress, 0);
+				SendMessage(hWndProgress, PBM_SETRANGE, 0, progress->progressMax << 16);
+				SendMessage(hWndProgress, PBM_SETPOS, progress->progress, 0);
 			}
 			break;
 		}
 		case WM_CLOSE:
 		{
-			if (g_texCompressionFinished) {
+			TEXCONV_PROGRESS *progress = (TEXCONV_PROGRESS *) GetWindowLongPtr(hWnd, sizeof(LPVOID));
+			if (progress->finished) {
 				KillTimer(hWnd, 1);
 				break;
 			} else {
@@ -2192,14 +2199,15 @@ BOOL CALLBACK BatchTexConvertFileCallback(LPCWSTR path, void *param) {
 	}
 
 	HWND hWndMain = g_hWndBatchTexWindow;
+	TEXCONV_PROGRESS progress = { 0 };
 	HWND hWndProgress = CreateWindow(L"CompressionProgress", L"Compressing", WS_OVERLAPPEDWINDOW & ~(WS_THICKFRAME | WS_MAXIMIZEBOX | WS_MINIMIZEBOX),
-		CW_USEDEFAULT, CW_USEDEFAULT, 500, 150, hWndMain, NULL, NULL, NULL);
+		CW_USEDEFAULT, CW_USEDEFAULT, 500, 150, hWndMain, NULL, NULL, &progress);
 	ShowWindow(hWndProgress, SW_SHOW);
 
 	TEXTURE texture = { 0 };
 	HANDLE hThread = textureConvertThreaded(px, width, height, fmt, dither, diffuse, ditherAlpha, colorEntries,
-		useFixedPalette, fixedPalette, threshold4x4, balance, colorBalance, enhanceColors, pnam, &texture,
-		NULL, NULL);
+		useFixedPalette, fixedPalette, threshold4x4, balance, colorBalance, enhanceColors, HISTOGRAM_SAMPLES_FULL, pnam, &texture,
+		&progress, NULL, NULL);
 	DoModalWait(hWndProgress, hThread); //modal wait progress window
 	
 	//write file out
@@ -2425,7 +2433,7 @@ VOID RegisterCompressionProgressClass(VOID) {
 	wcex.hCursor = LoadCursor(NULL, IDC_ARROW);
 	wcex.lpszClassName = L"CompressionProgress";
 	wcex.lpfnWndProc = CompressionProgressProc;
-	wcex.cbWndExtra = sizeof(LPVOID);
+	wcex.cbWndExtra = 2 * sizeof(LPVOID);
 	wcex.hIcon = g_appIcon;
 	wcex.hIconSm = g_appIcon;
 	RegisterClassEx(&wcex);
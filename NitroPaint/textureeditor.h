@@ -2,6 +2,7 @@
 #include <Windows.h>
 #include "color.h"
 #include "texture.h"
+#include "texconv.h"
 #include "childwindow.h"
 
 typedef struct {
@@ -52,10 +53,12 @@ typedef struct {
 	HWND hWndBalance;
 	HWND hWndColorBalance;
 	HWND hWndEnhanceColors;
+	HWND hWndSampleHistogram;
 	HWND hWndPaletteSize;
 	HWND hWndLimitPalette;
 
 	HWND hWndProgress;
+	TEXCONV_PROGRESS convertProgress;
 
 	HWND hWndPaletteEditor;
 	DWORD tmpCust[16];
@@ -0,0 +1,257 @@
+#include "tilediff.h"
+#include "nscr.h"
+
+#include <math.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#define TILEDIFF_X86
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+//All kernels sum in the same order so their results match exactly. Lane k of
+//four accumulates columns k and k + 4 of each row, top to bottom, and the
+//lanes are then combined as (0 + 2) + (1 + 3). Bounded runs check the totals
+//every two rows; each term is non-negative, so a total can only grow.
+
+typedef int (*TILE_DIFFERENCE_KERNEL) (const double *weights, const TILE_PLANAR *t1, const TILE_PLANAR *t2, double *diffs, double maxDiff);
+
+void tilePlanarInit(TILE_PLANAR *dest, REDUCTION *reduction, int (*pxYiq)[4]) {
+	for (int i = 0; i < 64; i++) {
+		dest->y[i] = reduction->lumaTable[pxYiq[i][0]];
+		dest->i[i] = pxYiq[i][1];
+		dest->q[i] = pxYiq[i][2];
+		dest->a[i] = pxYiq[i][3];
+	}
+}
+
+void tileDifferenceWeights(REDUCTION *reduction, double *weights) {
+	weights[0] = reduction->yWeight * reduction->yWeight;
+	weights[1] = reduction->iWeight * reduction->iWeight;
+	weights[2] = reduction->qWeight * reduction->qWeight;
+	weights[3] = 1600.0;
+}
+
+static int tileDifferenceSumLanes(double (*lanes)[4], double *diffs, double maxDiff) {
+	//combine lanes into per-flip totals. Returns 0 if every total exceeds maxDiff.
+	int exceeded = 1;
+	for (int flip = 0; flip < 4; flip++) {
+		diffs[flip] = (lanes[flip][0] + lanes[flip][2]) + (lanes[flip][1] + lanes[flip][3]);
+		if (diffs[flip] <= maxDiff) exceeded = 0;
+	}
+	return !exceeded;
+}
+
+static int tileDifferenceFlipsScalar(const double *weights, const TILE_PLANAR *t1, const TILE_PLANAR *t2, double *diffs, double maxDiff) {
+	double lanes[4][4] = { 0 };
+	for (int y = 0; y < 8; y++) {
+		for (int flip = 0; flip < 4; flip++) {
+			int y2 = (flip & TILE_FLIPY) ? (7 - y) : y;
+			for (int x = 0; x < 8; x++) {
+				int x2 = (flip & TILE_FLIPX) ? (7 - x) : x;
+				int i1 = x + y * 8, i2 = x2 + y2 * 8;
+
+				double dy = t1->y[i1] - t2->y[i2];
+				double di = t1->i[i1] - t2->i[i2];
+				double dq = t1->q[i1] - t2->q[i2];
+				double da = t1->a[i1] - t2->a[i2];
+				lanes[flip][x & 3] += weights[0] * dy * dy + weights[1] * di * di + weights[2] * dq * dq + weights[3] * da * da;
+			}
+		}
+
+		if ((y & 1) && y < 7 && !tileDifferenceSumLanes(lanes, diffs, maxDiff)) return 0;
+	}
+	tileDifferenceSumLanes(lanes, diffs, maxDiff);
+	return 1;
+}
+
+#ifdef TILEDIFF_X86
+
+static __inline __m128d tileDifferenceTermSse2(const __m128d *w, const __m128d *c1, const __m128d *c2) {
+	__m128d dy = _mm_sub_pd(c1[0], c2[0]);
+	__m128d di = _mm_sub_pd(c1[1], c2[1]);
+	__m128d dq = _mm_sub_pd(c1[2], c2[2]);
+	__m128d da = _mm_sub_pd(c1[3], c2[3]);
+	__m128d term = _mm_mul_pd(_mm_mul_pd(w[0], dy), dy);
+	term = _mm_add_pd(term, _mm_mul_pd(_mm_mul_pd(w[1], di), di));
+	term = _mm_add_pd(term, _mm_mul_pd(_mm_mul_pd(w[2], dq), dq));
+	return _mm_add_pd(term, _mm_mul_pd(_mm_mul_pd(w[3], da), da));
+}
+
+static int tileDifferenceSumLanesSse2(__m128d (*lanes)[2], double *diffs, double maxDiff) {
+	double sums[4][4];
+	for (int flip = 0; flip < 4; flip++) {
+		_mm_storeu_pd(sums[flip], lanes[flip][0]);
+		_mm_storeu_pd(sums[flip] + 2, lanes[flip][1]);
+	}
+	return tileDifferenceSumLanes(sums, diffs, maxDiff);
+}
+
+static int tileDifferenceFlipsSse2(const double *weights, const TILE_PLANAR *t1, const TILE_PLANAR *t2, double *diffs, double maxDiff) {
+	const double *planes1[] = { t1->y, t1->i, t1->q, t1->a };
+	const double *planes2[] = { t2->y, t2->i, t2->q, t2->a };
+	__m128d w[4], lanes[4][2];
+	for (int i = 0; i < 4; i++) {
+		w[i] = _mm_set1_pd(weights[i]);
+		lanes[i][0] = _mm_setzero_pd();
+		lanes[i][1] = _mm_setzero_pd();
+	}
+
+	for (int y = 0; y < 8; y++) {
+		for (int x = 0; x < 8; x += 2) {
+			//lanes 0-1 take columns 0-1 and 4-5, lanes 2-3 take columns 2-3 and 6-7
+			int half = (x >> 1) & 1;
+			__m128d c1[4], c2[4];
+			for (int c = 0; c < 4; c++) c1[c] = _mm_loadu_pd(planes1[c] + x + y * 8);
+
+			for (int flip = 0; flip < 4; flip++) {
+				int y2 = (flip & TILE_FLIPY) ? (7 - y) : y;
+				for (int c = 0; c < 4; c++) {
+					if (flip & TILE_FLIPX) {
+						__m128d v = _mm_loadu_pd(planes2[c] + (6 - x) + y2 * 8);
+						c2[c] = _mm_shuffle_pd(v, v, 1);
+					} else {
+						c2[c] = _mm_loadu_pd(planes2[c] + x + y2 * 8);
+					}
+				}
+				lanes[flip][half] = _mm_add_pd(lanes[flip][half], tileDifferenceTermSse2(w, c1, c2));
+			}
+		}
+
+		if ((y & 1) && y < 7 && !tileDifferenceSumLanesSse2(lanes, diffs, maxDiff)) return 0;
+	}
+	tileDifferenceSumLanesSse2(lanes, diffs, maxDiff);
+	return 1;
+}
+
+static __inline __m256d tileDifferenceTermAvx(const __m256d *w, const __m256d *c1, const __m256d *c2) {
+	__m256d dy = _mm256_sub_pd(c1[0], c2[0]);
+	__m256d di = _mm256_sub_pd(c1[1], c2[1]);
+	__m256d dq = _mm256_sub_pd(c1[2], c2[2]);
+	__m256d da = _mm256_sub_pd(c1[3], c2[3]);
+	__m256d term = _mm256_mul_pd(_mm256_mul_pd(w[0], dy), dy);
+	term = _mm256_add_pd(term, _mm256_mul_pd(_mm256_mul_pd(w[1], di), di));
+	term = _mm256_add_pd(term, _mm256_mul_pd(_mm256_mul_pd(w[2], dq), dq));
+	return _mm256_add_pd(term, _mm256_mul_pd(_mm256_mul_pd(w[3], da), da));
+}
+
+static int tileDifferenceSumLanesAvx(__m256d *lanes, double *diffs, double maxDiff) {
+	double sums[4][4];
+	for (int flip = 0; flip < 4; flip++) {
+		_mm256_storeu_pd(sums[flip], lanes[flip]);
+	}
+	return tileDifferenceSumLanes(sums, diffs, maxDiff);
+}
+
+static int tileDifferenceFlipsAvx(const double *weights, const TILE_PLANAR *t1, const TILE_PLANAR *t2, double *diffs, double maxDiff) {
+	const double *planes1[] = { t1->y, t1->i, t1->q, t1->a };
+	const double *planes2[] = { t2->y, t2->i, t2->q, t2->a };
+	__m256d w[4], lanes[4];
+	for (int i = 0; i < 4; i++) {
+		w[i] = _mm256_broadcast_sd(weights + i);
+		lanes[i] = _mm256_setzero_pd();
+	}
+
+	int completed = 1;
+	for (int y = 0; y < 8; y++) {
+		for (int x = 0; x < 8; x += 4) {
+			__m256d c1[4], c2[4];
+			for (int c = 0; c < 4; c++) c1[c] = _mm256_loadu_pd(planes1[c] + x + y * 8);
+
+			for (int flip = 0; flip < 4; flip++) {
+				int y2 = (flip & TILE_FLIPY) ? (7 - y) : y;
+				for (int c = 0; c < 4; c++) {
+					if (flip & TILE_FLIPX) {
+						//reverse the four columns mirrored across the row
+						__m256d v = _mm256_loadu_pd(planes2[c] + (4 - x) + y2 * 8);
+						c2[c] = _mm256_permute_pd(_mm256_permute2f128_pd(v, v, 1), 0x5);
+					} else {
+						c2[c] = _mm256_loadu_pd(planes2[c] + x + y2 * 8);
+					}
+				}
+				lanes[flip] = _mm256_add_pd(lanes[flip], tileDifferenceTermAvx(w, c1, c2));
+			}
+		}
+
+		if ((y & 1) && y < 7 && !tileDifferenceSumLanesAvx(lanes, diffs, maxDiff)) {
+			completed = 0;
+			break;
+		}
+	}
+	if (completed) tileDifferenceSumLanesAvx(lanes, diffs, maxDiff);
+	_mm256_zeroupper();
+	return completed;
+}
+
+#endif
+
+static TILE_DIFFERENCE_KERNEL tileDifferenceSelectKernel(void) {
+#ifdef TILEDIFF_X86
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] >= 1) {
+		__cpuid(info, 1);
+
+		//AVX also needs the OS to save the upper register halves (OSXSAVE, then XCR0)
+		if ((info[2] & (1 << 28)) && (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6) return tileDifferenceFlipsAvx;
+		if (info[3] & (1 << 26)) return tileDifferenceFlipsSse2;
+	}
+#endif
+	return tileDifferenceFlipsScalar;
+}
+
+#ifndef NDEBUG
+
+static void tileDifferenceCheckKernel(TILE_DIFFERENCE_KERNEL kernel) {
+	//debug builds check the selected kernel against the scalar one on fixed tile pairs
+	const double weights[] = { 1.0, 0.5625, 0.390625, 1600.0 };
+	const double bounds[] = { HUGE_VAL, 1e6, 1e4, 0.0 };
+	unsigned int seed = 0x7E57;
+	TILE_PLANAR t1, t2;
+	double *planes1[] = { t1.y, t1.i, t1.q, t1.a };
+	double *planes2[] = { t2.y, t2.i, t2.q, t2.a };
+
+	for (int pair = 0; pair < 16; pair++) {
+		for (int c = 0; c < 4; c++) {
+			for (int i = 0; i < 64; i++) {
+				seed = seed * 1103515245 + 12345;
+				planes1[c][i] = (double) ((seed >> 16) & 0xFF);
+				seed = seed * 1103515245 + 12345;
+
+				//later pairs differ less, so bounded runs stop at different rows
+				int delta = (int) ((seed >> 16) & 0xFF) - 128;
+				planes2[c][i] = planes1[c][i] + delta / (1 << (pair / 4));
+			}
+		}
+
+		for (int i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++) {
+			double diffs[4], expected[4];
+			int completed = kernel(weights, &t1, &t2, diffs, bounds[i]);
+			int expectedCompleted = tileDifferenceFlipsScalar(weights, &t1, &t2, expected, bounds[i]);
+			assert(completed == expectedCompleted);
+			assert(memcmp(diffs, expected, sizeof(diffs)) == 0);
+		}
+	}
+}
+
+#endif
+
+static TILE_DIFFERENCE_KERNEL g_tileDifferenceKernel = NULL;
+
+int tileDifferenceFlipsBounded(const double *weights, const TILE_PLANAR *t1, const TILE_PLANAR *t2, double *diffs, double maxDiff) {
+	//every thread selects the same kernel, so racing here is harmless
+	if (g_tileDifferenceKernel == NULL) {
+		TILE_DIFFERENCE_KERNEL kernel = tileDifferenceSelectKernel();
+#ifndef NDEBUG
+		tileDifferenceCheckKernel(kernel);
+#endif
+		g_tileDifferenceKernel = kernel;
+	}
+	return g_tileDifferenceKernel(weights, t1, t2, diffs, maxDiff);
+}
+
+void tileDifferenceFlips(const double *weights, const TILE_PLANAR *t1, const TILE_PLANAR *t2, double *diffs) {
+	tileDifferenceFlipsBounded(weights, t1, t2, diffs, HUGE_VAL);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "palette.h"
+
+//
+// Tile pixels split into planes for comparison during character compression.
+// Luma has already been passed through the reduction's luma table.
+//
+typedef struct TILE_PLANAR_ {
+	double y[64];
+	double i[64];
+	double q[64];
+	double a[64];
+} TILE_PLANAR;
+
+//
+// Fills a TILE_PLANAR from 64 YIQA pixels.
+//
+void tilePlanarInit(TILE_PLANAR *dest, REDUCTION *reduction, int (*pxYiq)[4]);
+
+//
+// Gets the four channel weights used by tileDifferenceFlips from a reduction.
+//
+void tileDifferenceWeights(REDUCTION *reduction, double *weights);
+
+//
+// Computes the weighted squared difference between t1 and each of the four
+// flips of t2 in one pass. diffs is indexed by flip mode. An SSE2 or AVX
+// kernel is used when the processor supports one, and every kernel gives
+// exactly the same result.
+//
+void tileDifferenceFlips(const double *weights, const TILE_PLANAR *t1, const TILE_PLANAR *t2, double *diffs);
+
+//
+// Same as tileDifferenceFlips, but gives up once every flip's difference is
+// known to exceed maxDiff, returning 0. diffs then holds partial differences,
+// each greater than maxDiff. Returns 1 if the differences are complete.
+//
+int tileDifferenceFlipsBounded(const double *weights, const TILE_PLANAR *t1, const TILE_PLANAR *t2, double *diffs, double maxDiff);